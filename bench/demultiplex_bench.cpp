@@ -0,0 +1,300 @@
+//
+//  demultiplex_bench.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+//  Generates a synthetic run (see synthetic.h), times FastqReader::read(),
+//  barcode matching and output writing on it, then runs the demultiplex_satay
+//  binary on it --repeat times for wall time, CPU time, peak RSS and reads/s.
+//  Results go to a JSON file whose keys and number formats don't change from
+//  run to run, so results of two commits can be diffed or compared by script.
+//  Component timings are the best of --repeat passes, whole runs the median.
+//
+//  usage: demultiplex_bench [--reads N] [--threads T] [--json results.json] ...
+//
+
+#include "synthetic.h"
+#include "fastqreader.h"
+#include "barcode.h"
+#include "writer.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+#define BENCH_JSON_SCHEMA 1
+
+struct StageResult {
+    long records;
+    long matched;
+    size_t bytes;
+    double seconds;
+};
+
+struct RunResult {
+    double wallSeconds;
+    double cpuSeconds;
+    long peakRssKb;
+};
+
+static double secondsSince(chrono::steady_clock::time_point start){
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static size_t fileSize(const string& filename){
+    struct stat st;
+    return stat(filename.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+static StageResult benchRead(const SyntheticFiles& files){
+    StageResult result = {0, 0, fileSize(files.reads), 0};
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    FastqReader reader(files.reads);
+    Read* r;
+    while((r = reader.read()) != NULL) {
+        result.records++;
+        delete r;
+    }
+    result.seconds = secondsSince(start);
+    return result;
+}
+
+static StageResult benchMatch(const SyntheticFiles& files){
+    vector<string> barcodes;
+    vector<int> ids;
+    ifstream in(files.barcodes.c_str());
+    string line;
+    while(getline(in, line)) {
+        barcodes.push_back(line.substr(0, line.find('\t')));
+        ids.push_back(barcodes.size());
+    }
+    BarcodeTable table(barcodes, ids, 1);
+
+    // the indexes are read first, only matching is timed
+    vector<string> indexes, quals;
+    FastqReader reader(files.index);
+    FastqRecord rec;
+    while(reader.next(rec)) {
+        indexes.push_back(string(rec.seq, rec.seqLen));
+        quals.push_back(string(rec.quality, rec.qualityLen));
+    }
+
+    StageResult result = {(long)indexes.size(), 0, 0, 0};
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for(size_t i=0; i<indexes.size(); i++) {
+        BarcodeMatch match = table.match(indexes[i].data(), indexes[i].length(), quals[i].data());
+        if(match.barcode >= 0)
+            result.matched++;
+    }
+    result.seconds = secondsSince(start);
+    return result;
+}
+
+static StageResult benchWrite(const SyntheticFiles& files, const string& workDir, int samples){
+    // records stay valid while the mapped reader is open
+    FastqReader reader(files.reads);
+    vector<FastqRecord> records;
+    FastqRecord rec;
+    while(reader.next(rec))
+        records.push_back(rec);
+
+    vector<string> outputs;
+    for(int i=0; i<samples; i++)
+        outputs.push_back(workDir + "/write_bench_" + to_string(i) + ".fastq");
+
+    StageResult result = {(long)records.size(), 0, 0, 0};
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    SampleOutputs writers(outputs);
+    for(size_t i=0; i<records.size(); i++)
+        writers.write(i % samples, records[i]);
+    writers.closeAll();
+    result.seconds = secondsSince(start);
+    result.bytes = writers.bytesWritten();
+    for(int i=0; i<samples; i++)
+        remove(outputs[i].c_str());
+    return result;
+}
+
+// one run of the binary with its output thrown away
+static bool runPipeline(const string& binary, const SyntheticFiles& files, int threads, RunResult& result){
+    string threadArg = to_string(threads);
+    const char* args[] = {binary.c_str(), "-r", files.reads.c_str(), "-i", files.index.c_str(),
+        "-b", files.barcodes.c_str(), "-t", threadArg.c_str(), NULL};
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    pid_t pid = fork();
+    if(pid < 0)
+        return false;
+    if(pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        execv(binary.c_str(), (char* const*)args);
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    if(wait4(pid, &status, 0, &usage) != pid)
+        return false;
+    result.wallSeconds = secondsSince(start);
+    result.cpuSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#ifdef __APPLE__
+    result.peakRssKb = usage.ru_maxrss / 1024;
+#else
+    result.peakRssKb = usage.ru_maxrss;
+#endif
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static StageResult best(const vector<StageResult>& results){
+    StageResult result = results[0];
+    for(size_t i=1; i<results.size(); i++) {
+        if(results[i].seconds < result.seconds)
+            result = results[i];
+    }
+    return result;
+}
+
+template<typename T>
+static T median(vector<T> values){
+    sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+static string jsonString(const string& s){
+    string out = "\"";
+    for(size_t i=0; i<s.length(); i++) {
+        if(s[i] == '"' || s[i] == '\\')
+            out += '\\';
+        if((unsigned char)s[i] >= 0x20)
+            out += s[i];
+    }
+    return out + "\"";
+}
+
+static void writeStage(FILE* fp, const char* name, const StageResult& stage, bool matched, bool last){
+    fprintf(fp, "    \"%s\": {\n", name);
+    fprintf(fp, "      \"records\": %ld,\n", stage.records);
+    if(matched)
+        fprintf(fp, "      \"matched\": %ld,\n", stage.matched);
+    fprintf(fp, "      \"seconds\": %.6f,\n", stage.seconds);
+    fprintf(fp, "      \"records_per_second\": %.0f%s\n", stage.seconds > 0 ? stage.records / stage.seconds : 0, matched ? "" : ",");
+    if(!matched)
+        fprintf(fp, "      \"mb_per_second\": %.3f\n", stage.seconds > 0 ? stage.bytes / stage.seconds / 1e6 : 0);
+    fprintf(fp, "    }%s\n", last ? "" : ",");
+}
+
+int main(int argc, char* argv[]){
+    cmdline::parser cmd;
+    addSyntheticOptions(cmd);
+    cmd.add<string>("binary", 'B', "demultiplex_satay binary to time", false, "./demultiplex_satay");
+    cmd.add<int>("threads", 't', "--threads of the timed runs", false, 1);
+    cmd.add<int>("repeat", 'R', "Passes of each benchmark", false, 3);
+    cmd.add<string>("work-dir", 'w', "Directory for the synthetic files and outputs", false, "bench/work");
+    cmd.add<string>("json", 'j', "Results file", false, "bench/results.json");
+    cmd.add<string>("label", '\0', "Free text kept in the results, such as the commit", false, "");
+    cmd.parse_check(argc, argv);
+
+    SyntheticConfig config = syntheticConfig(cmd);
+    string error = syntheticConfigError(config);
+    int threads = cmd.get<int>("threads");
+    int repeat = cmd.get<int>("repeat");
+    if(error == "" && (threads < 1 || repeat < 1))
+        error = "Threads and repeat must be at least 1";
+    if(error != "") {
+        cerr << "Error: " << error << endl;
+        return 1;
+    }
+    string workDir = cmd.get<string>("work-dir");
+    string binary = cmd.get<string>("binary");
+    if(mkdir(workDir.c_str(), 0755) != 0 && errno != EEXIST) {
+        cerr << "Failed to create directory: " << workDir << endl;
+        return 1;
+    }
+
+    cout << "Generating " << config.reads << " synthetic reads in " << workDir << "..." << endl;
+    SyntheticFiles files;
+    if(!writeSyntheticRun(config, workDir + "/synthetic", files))
+        return 1;
+
+    vector<StageResult> reads, matches, writes;
+    for(int i=0; i<repeat; i++) {
+        reads.push_back(benchRead(files));
+        matches.push_back(benchMatch(files));
+        writes.push_back(benchWrite(files, workDir, config.barcodes + 1));
+    }
+    StageResult read = best(reads);
+    StageResult match = best(matches);
+    StageResult write = best(writes);
+    cout << "FastqReader::read:  " << read.seconds << " s" << endl;
+    cout << "BarcodeTable::match: " << match.seconds << " s" << endl;
+    cout << "SampleOutputs::write: " << write.seconds << " s" << endl;
+
+    vector<double> walls, cpus;
+    vector<long> rss;
+    for(int i=0; i<repeat; i++) {
+        RunResult run;
+        if(!runPipeline(binary, files, threads, run)) {
+            cerr << "Failed to run " << binary << " on " << files.reads << endl;
+            return 1;
+        }
+        walls.push_back(run.wallSeconds);
+        cpus.push_back(run.cpuSeconds);
+        rss.push_back(run.peakRssKb);
+        cout << "Run " << i + 1 << ": " << run.wallSeconds << " s wall, " << run.cpuSeconds << " s CPU, " << run.peakRssKb << " KB peak RSS" << endl;
+    }
+    double wall = median(walls);
+
+    // the sample files of the timed runs
+    remove((workDir + "/synthetic_reads_unassigned.fastq").c_str());
+    for(int i=1; i<=config.barcodes; i++)
+        remove((workDir + "/synthetic_reads_sample_" + to_string(i) + ".fastq").c_str());
+
+    string json = cmd.get<string>("json");
+    FILE* fp = fopen(json.c_str(), "w");
+    if(fp == NULL) {
+        cerr << "Failed to open file for writing: " << json << endl;
+        return 1;
+    }
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"schema\": %d,\n", BENCH_JSON_SCHEMA);
+    fprintf(fp, "  \"label\": %s,\n", jsonString(cmd.get<string>("label")).c_str());
+    fprintf(fp, "  \"config\": {\n");
+    fprintf(fp, "    \"reads\": %ld,\n", config.reads);
+    fprintf(fp, "    \"read_length\": %d,\n", config.readLength);
+    fprintf(fp, "    \"barcodes\": %d,\n", config.barcodes);
+    fprintf(fp, "    \"barcode_length\": %d,\n", config.barcodeLength);
+    fprintf(fp, "    \"mismatch_rate\": %.6f,\n", config.mismatchRate);
+    fprintf(fp, "    \"unassigned_fraction\": %.6f,\n", config.unassignedFraction);
+    fprintf(fp, "    \"seed\": %llu,\n", (unsigned long long)config.seed);
+    fprintf(fp, "    \"threads\": %d,\n", threads);
+    fprintf(fp, "    \"repeat\": %d\n", repeat);
+    fprintf(fp, "  },\n");
+    fprintf(fp, "  \"pipeline\": {\n");
+    fprintf(fp, "    \"wall_seconds\": %.6f,\n", wall);
+    fprintf(fp, "    \"cpu_seconds\": %.6f,\n", median(cpus));
+    fprintf(fp, "    \"peak_rss_kb\": %ld,\n", median(rss));
+    fprintf(fp, "    \"reads_per_second\": %.0f\n", wall > 0 ? config.reads / wall : 0);
+    fprintf(fp, "  },\n");
+    fprintf(fp, "  \"components\": {\n");
+    writeStage(fp, "fastq_read", read, false, false);
+    writeStage(fp, "barcode_match", match, true, false);
+    writeStage(fp, "output_write", write, false, true);
+    fprintf(fp, "  }\n");
+    fprintf(fp, "}\n");
+    if(fclose(fp) != 0) {
+        cerr << "Failed to write to file: " << json << endl;
+        return 1;
+    }
+    cout << "Results written to " << json << endl;
+    return 0;
+}
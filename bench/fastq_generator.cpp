@@ -0,0 +1,34 @@
+//
+//  fastq_generator.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+//  Writes <prefix>_reads.fastq, <prefix>_index.fastq and
+//  <prefix>_barcodes.txt for a synthetic run, the same for the same options.
+//
+//  usage: fastq_generator --out <prefix> [--reads N] [--read-length L] ...
+//
+
+#include "synthetic.h"
+
+using namespace std;
+
+int main(int argc, char* argv[]){
+    cmdline::parser cmd;
+    cmd.add<string>("out", 'o', "Prefix of the output files", true);
+    addSyntheticOptions(cmd);
+    cmd.parse_check(argc, argv);
+
+    SyntheticConfig config = syntheticConfig(cmd);
+    string error = syntheticConfigError(config);
+    if(error != "") {
+        cerr << "Error: " << error << endl;
+        return 1;
+    }
+    SyntheticFiles files;
+    if(!writeSyntheticRun(config, cmd.get<string>("out"), files))
+        return 1;
+    cout << files.reads << endl << files.index << endl << files.barcodes << endl;
+    return 0;
+}
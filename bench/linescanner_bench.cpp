@@ -0,0 +1,123 @@
+//
+//  linescanner_bench.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+//  Compares the line break scanner with the byte loop FastqReader::getLine()
+//  used before it. The input FASTQ is repeated in memory up to the requested
+//  size so the timings measure parsing, not disk reads.
+//
+//  usage: linescanner_bench [fastq] [size in MB]
+//
+
+#include "linescanner.h"
+#include "fastqreader.h"
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+using namespace std;
+
+#define BENCH_BLOCK (1<<20)
+
+// the scalar loop of the former FastqReader::getLine(), one line at a time
+static long legacyLines(const char* p, size_t len, size_t& checksum){
+    long lines = 0;
+    size_t pos = 0;
+    while(pos < len) {
+        size_t end = pos;
+        while(end < len) {
+            if(p[end] != '\r' && p[end] != '\n')
+                end++;
+            else
+                break;
+        }
+        checksum += end - pos;
+        end++;
+        if(end < len && p[end-1] == '\r' && p[end] == '\n')
+            end++;
+        pos = end;
+        lines++;
+    }
+    return lines;
+}
+
+static long vectorLines(const char* p, size_t len, size_t& checksum){
+    long lines = 0;
+    size_t pos = 0;
+    while(pos < len) {
+        size_t end = pos + findLineBreak(p + pos, len - pos);
+        checksum += end - pos;
+        end++;
+        if(end < len && p[end-1] == '\r' && p[end] == '\n')
+            end++;
+        pos = end;
+        lines++;
+    }
+    return lines;
+}
+
+static long vectorRecords(const char* p, size_t len, size_t& checksum){
+    vector<uint32_t> breaks;
+    vector<RecordOffsets> records;
+    long count = 0;
+    size_t cursor = 0;
+    while(cursor < len) {
+        size_t block = min((size_t)BENCH_BLOCK, len - cursor);
+        bool final = cursor + block == len;
+        records.clear();
+        size_t used = scanRecords(p + cursor, block, final, 4, breaks, records);
+        for(size_t r=0; r<records.size(); r++)
+            checksum += records[r].len[0] + records[r].len[1] + records[r].len[2] + records[r].len[3];
+        count += records.size();
+        cursor += final ? block : used;
+    }
+    return count * 4;
+}
+
+template<typename F>
+static void run(const char* label, F scan, const string& data){
+    size_t checksum = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    long lines = scan(data.data(), data.size(), checksum);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << label << ": " << lines << " lines, " << seconds << " s, "
+        << (data.size() / seconds / (1<<20)) << " MB/s (checksum " << checksum << ")" << endl;
+}
+
+int main(int argc, char* argv[]){
+    string filename = argc > 1 ? argv[1] : "test/test_1000_R1.fastq";
+    size_t megabytes = argc > 2 ? atol(argv[2]) : 1024;
+
+    ifstream in(filename.c_str(), ios::binary);
+    if(!in) {
+        cerr << "Failed to open file: " << filename << endl;
+        return 1;
+    }
+    stringstream ss;
+    ss << in.rdbuf();
+    string sample = ss.str();
+    if(sample.empty()) {
+        cerr << "Empty file: " << filename << endl;
+        return 1;
+    }
+    if(sample[sample.length()-1] != '\n')
+        sample += '\n';
+
+    string data;
+    data.reserve(megabytes << 20);
+    while(data.size() + sample.size() <= (megabytes << 20))
+        data += sample;
+    if(data.empty())
+        data = sample;
+
+    cout << "Input: " << filename << " repeated to " << (data.size() >> 20) << " MB" << endl;
+    cout << "Kernel: " << lineScannerKernel() << endl;
+    run("getLine byte loop", legacyLines, data);
+    run("findLineBreak", vectorLines, data);
+    run("scanRecords", vectorRecords, data);
+    return 0;
+}
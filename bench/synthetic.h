@@ -0,0 +1,206 @@
+//
+//  synthetic.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+//  Deterministic reads, index and barcodes files for the benchmarks. The
+//  same settings and seed give the same files on every machine: the random
+//  numbers come from splitmix64, not from <random>, whose distributions
+//  differ between standard libraries.
+//
+
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <iostream>
+#include "cmdline.h"
+
+using namespace std;
+
+// Illumina-style names, so the read index packs them as a real run would
+#define SYNTHETIC_NAME_PREFIX "@SYN001:1:HSYNTHXX"
+#define SYNTHETIC_TILE_READS 1000000
+#define SYNTHETIC_ROW_READS 50000
+
+// Barcodes are drawn until each is at least this far from all the others,
+// so fuzzy matches within threshold 1 stay unique
+#define SYNTHETIC_BARCODE_DISTANCE 3
+
+struct SyntheticConfig {
+    long reads;
+    int readLength;
+    int barcodes;
+    int barcodeLength;
+    double mismatchRate;        // chance of each index base being miscalled
+    double unassignedFraction;  // share of indexes that are random sequence
+    uint64_t seed;
+};
+
+struct SyntheticFiles {
+    string reads;
+    string index;
+    string barcodes;
+};
+
+class SyntheticRandom{
+public:
+    SyntheticRandom(uint64_t seed){
+        mState = seed;
+    }
+
+    uint64_t next(){
+        uint64_t z = (mState += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    // uniform in [0, 1)
+    double uniform(){
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    int below(int n){
+        return (int)((next() >> 32) * (uint64_t)n >> 32);
+    }
+
+private:
+    uint64_t mState;
+};
+
+static const char SYNTHETIC_BASES[] = "ACGT";
+
+inline string syntheticSequence(SyntheticRandom& rng, int len){
+    string seq(len, 'A');
+    for(int i=0; i<len; i++)
+        seq[i] = SYNTHETIC_BASES[rng.below(4)];
+    return seq;
+}
+
+inline int syntheticDistance(const string& a, const string& b){
+    int d = 0;
+    for(int i=0; i<a.length(); i++)
+        d += a[i] != b[i];
+    return d;
+}
+
+inline vector<string> syntheticBarcodes(const SyntheticConfig& config, SyntheticRandom& rng){
+    vector<string> barcodes;
+    int attempts = 0;
+    while(barcodes.size() < config.barcodes) {
+        string candidate = syntheticSequence(rng, config.barcodeLength);
+        bool far = true;
+        for(int i=0; i<barcodes.size() && far; i++)
+            far = syntheticDistance(candidate, barcodes[i]) >= SYNTHETIC_BARCODE_DISTANCE;
+        // short barcodes can't all be far apart, settle for distinct ones
+        if(!far && ++attempts < 1000 * config.barcodes)
+            continue;
+        bool seen = false;
+        for(int i=0; i<barcodes.size() && !seen; i++)
+            seen = barcodes[i] == candidate;
+        if(!seen)
+            barcodes.push_back(candidate);
+    }
+    return barcodes;
+}
+
+inline string syntheticQuality(SyntheticRandom& rng, int len){
+    static const char QUALS[] = "AAAAEEEEEEEE6/#";
+    string qual(len, 'E');
+    for(int i=0; i<len; i++)
+        qual[i] = QUALS[rng.below(sizeof(QUALS) - 1)];
+    return qual;
+}
+
+// the index as sequenced: a barcode with miscalled bases, or random sequence
+inline string syntheticIndex(const SyntheticConfig& config, const vector<string>& barcodes, SyntheticRandom& rng){
+    if(rng.uniform() < config.unassignedFraction)
+        return syntheticSequence(rng, config.barcodeLength);
+    string index = barcodes[rng.below(barcodes.size())];
+    for(int i=0; i<index.length(); i++) {
+        if(rng.uniform() < config.mismatchRate)
+            index[i] = SYNTHETIC_BASES[(string(SYNTHETIC_BASES).find(index[i]) + 1 + rng.below(3)) % 4];
+    }
+    return index;
+}
+
+inline void addSyntheticOptions(cmdline::parser& cmd){
+    cmd.add<long>("reads", 'n', "Number of reads", false, 1000000);
+    cmd.add<int>("read-length", 'l', "Read length", false, 75);
+    cmd.add<int>("barcodes", 'b', "Number of barcodes", false, 24);
+    cmd.add<int>("barcode-length", 'L', "Barcode length", false, 8);
+    cmd.add<double>("mismatch-rate", 'e', "Chance of each index base being miscalled", false, 0.01);
+    cmd.add<double>("unassigned-fraction", 'u', "Share of indexes that are random sequence", false, 0.05);
+    cmd.add<long>("seed", 's', "Random seed", false, 1);
+}
+
+inline SyntheticConfig syntheticConfig(cmdline::parser& cmd){
+    SyntheticConfig config;
+    config.reads = cmd.get<long>("reads");
+    config.readLength = cmd.get<int>("read-length");
+    config.barcodes = cmd.get<int>("barcodes");
+    config.barcodeLength = cmd.get<int>("barcode-length");
+    config.mismatchRate = cmd.get<double>("mismatch-rate");
+    config.unassignedFraction = cmd.get<double>("unassigned-fraction");
+    config.seed = cmd.get<long>("seed");
+    return config;
+}
+
+// what is wrong with the settings, empty if nothing
+inline string syntheticConfigError(const SyntheticConfig& config){
+    if(config.reads < 0 || config.readLength < 1)
+        return "Reads and read length must be positive";
+    if(config.barcodeLength < 1 || config.barcodeLength > 32)
+        return "Barcode length must be between 1 and 32";
+    if(config.barcodes < 1 || (config.barcodeLength < 16 && config.barcodes > (1L << (2 * config.barcodeLength))))
+        return "There are not that many barcodes of that length";
+    if(config.mismatchRate < 0 || config.mismatchRate > 1 || config.unassignedFraction < 0 || config.unassignedFraction > 1)
+        return "Mismatch rate and unassigned fraction must be between 0 and 1";
+    return "";
+}
+
+inline bool writeSyntheticRun(const SyntheticConfig& config, const string& prefix, SyntheticFiles& files){
+    files.reads = prefix + "_reads.fastq";
+    files.index = prefix + "_index.fastq";
+    files.barcodes = prefix + "_barcodes.txt";
+    SyntheticRandom rng(config.seed);
+
+    vector<string> barcodes = syntheticBarcodes(config, rng);
+    FILE* fb = fopen(files.barcodes.c_str(), "w");
+    if(fb == NULL) {
+        cerr << "Failed to open file for writing: " << files.barcodes << endl;
+        return false;
+    }
+    for(int i=0; i<barcodes.size(); i++)
+        fprintf(fb, "%s\tsample_%d\n", barcodes[i].c_str(), i + 1);
+    fclose(fb);
+
+    FILE* fr = fopen(files.reads.c_str(), "w");
+    FILE* fi = fopen(files.index.c_str(), "w");
+    if(fr == NULL || fi == NULL) {
+        cerr << "Failed to open file for writing: " << (fr == NULL ? files.reads : files.index) << endl;
+        return false;
+    }
+    for(long r=0; r<config.reads; r++) {
+        int tile = 11101 + r / SYNTHETIC_TILE_READS;
+        int x = (r % SYNTHETIC_TILE_READS) % SYNTHETIC_ROW_READS + 1000;
+        int y = (r % SYNTHETIC_TILE_READS) / SYNTHETIC_ROW_READS + 1000;
+        string index = syntheticIndex(config, barcodes, rng);
+        string seq = syntheticSequence(rng, config.readLength);
+        string qual = syntheticQuality(rng, config.readLength);
+        fprintf(fr, "%s:1:%d:%d:%d 1:N:0:%s\n%s\n+\n%s\n", SYNTHETIC_NAME_PREFIX, tile, x, y, index.c_str(), seq.c_str(), qual.c_str());
+        fprintf(fi, "%s:1:%d:%d:%d 2:N:0:%s\n%s\n+\n%s\n", SYNTHETIC_NAME_PREFIX, tile, x, y, index.c_str(), index.c_str(), syntheticQuality(rng, config.barcodeLength).c_str());
+    }
+    if(fclose(fr) != 0 || fclose(fi) != 0) {
+        cerr << "Failed to write synthetic files: " << prefix << endl;
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,223 @@
+//
+//  assignments.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "assignments.h"
+#include "util.h"
+#include <string.h>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The record counts sit after the magic, version, threshold and quality,
+// so they can be filled in once the last record is written
+#define ASSIGNMENT_COUNTS_OFFSET 20
+
+#define ASSIGNMENT_FILE_BUFFER (1<<20)
+
+AssignmentWriter::AssignmentWriter(string filename, const vector<string>& barcodes, int threshold, int minQual){
+    mFilename = filename;
+    mBarcodes = barcodes;
+    mThreshold = threshold;
+    mMinQual = minQual;
+    mRecords = 0;
+    mResolved = 0;
+    mHeaderWritten = false;
+    mFile = fopen(filename.c_str(), "wb");
+    if(mFile == NULL)
+        error_exit("Failed to open file for writing: " + filename);
+    setvbuf(mFile, NULL, _IOFBF, ASSIGNMENT_FILE_BUFFER);
+}
+
+AssignmentWriter::~AssignmentWriter(){
+    if(mFile)
+        close();
+}
+
+void AssignmentWriter::setNamePrefix(const string& prefix){
+    mNamePrefix = prefix;
+}
+
+void AssignmentWriter::writeBytes(const void* data, size_t len){
+    if(fwrite(data, 1, len, mFile) != len)
+        error_exit("Failed to write to file: " + mFilename);
+}
+
+void AssignmentWriter::writeString(const string& s){
+    uint32_t len = s.length();
+    writeBytes(&len, sizeof(len));
+    writeBytes(s.data(), len);
+}
+
+void AssignmentWriter::writeHeader(){
+    uint32_t version = ASSIGNMENT_VERSION;
+    int32_t threshold = mThreshold;
+    int32_t minQual = mMinQual;
+    uint32_t barcodes = mBarcodes.size();
+    writeBytes(ASSIGNMENT_MAGIC, 8);
+    writeBytes(&version, sizeof(version));
+    writeBytes(&threshold, sizeof(threshold));
+    writeBytes(&minQual, sizeof(minQual));
+    // until close() fills them in the counts are too large for the file,
+    // so one that was never finished reads as truncated
+    uint64_t unfinished = UINT64_MAX;
+    writeBytes(&unfinished, sizeof(unfinished));
+    writeBytes(&unfinished, sizeof(unfinished));
+    writeString(mNamePrefix);
+    writeBytes(&barcodes, sizeof(barcodes));
+    for(int i=0; i<mBarcodes.size(); i++)
+        writeString(mBarcodes[i]);
+    mHeaderWritten = true;
+}
+
+void AssignmentWriter::add(uint64_t key, const BarcodeMatch& match){
+    // the header goes out with the first record, once the prefix is known
+    if(!mHeaderWritten)
+        writeHeader();
+    char record[ASSIGNMENT_RECORD_BYTES];
+    uint16_t barcode = match.barcode < 0 ? ASSIGNMENT_UNASSIGNED : match.barcode;
+    memcpy(record, &key, 8);
+    memcpy(record + 8, &barcode, 2);
+    record[10] = (char)min(match.mismatches, 0xff);
+    record[11] = (char)(match.type | (match.ambiguous ? ASSIGNMENT_AMBIGUOUS : 0));
+    writeBytes(record, ASSIGNMENT_RECORD_BYTES);
+    mRecords++;
+}
+
+void AssignmentWriter::addResolved(const string& name, const BarcodeMatch& match){
+    if(!mHeaderWritten)
+        writeHeader();
+    uint16_t barcode = match.barcode < 0 ? ASSIGNMENT_UNASSIGNED : match.barcode;
+    writeString(name);
+    writeBytes(&barcode, sizeof(barcode));
+    mResolved++;
+}
+
+void AssignmentWriter::close(){
+    if(!mHeaderWritten)
+        writeHeader();
+    if(fseek(mFile, ASSIGNMENT_COUNTS_OFFSET, SEEK_SET) != 0)
+        error_exit("Failed to write to file: " + mFilename);
+    writeBytes(&mRecords, sizeof(mRecords));
+    writeBytes(&mResolved, sizeof(mResolved));
+    if(fclose(mFile) != 0)
+        error_exit("Failed to write to file: " + mFilename);
+    mFile = NULL;
+}
+
+AssignmentFile::AssignmentFile(string filename){
+    mFilename = filename;
+    mMap = NULL;
+    mMapLen = 0;
+    mCursor = 0;
+    mResolvedRead = 0;
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+        error_exit("Failed to open file: " + filename);
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        error_exit("Not an assignment file: " + filename);
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(map == MAP_FAILED)
+        error_exit("Failed to map file: " + filename);
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    mMap = (char*)map;
+    mMapLen = st.st_size;
+
+    char magic[8];
+    uint32_t barcodes;
+    if(!readBytes(magic, 8) || memcmp(magic, ASSIGNMENT_MAGIC, 8) != 0)
+        error_exit("Not an assignment file: " + filename);
+    if(!readBytes(&mVersion, sizeof(mVersion)) || mVersion != ASSIGNMENT_VERSION)
+        error_exit("Assignment file " + filename + " is of another version, save it again");
+    if(!readBytes(&mThreshold, sizeof(mThreshold)) || !readBytes(&mMinQual, sizeof(mMinQual))
+        || !readBytes(&mRecords, sizeof(mRecords)) || !readBytes(&mResolved, sizeof(mResolved))
+        || !readString(mNamePrefix) || !readBytes(&barcodes, sizeof(barcodes)))
+        error_exit("Assignment file is truncated: " + filename);
+    mBarcodes.resize(barcodes);
+    for(int i=0; i<mBarcodes.size(); i++) {
+        if(!readString(mBarcodes[i]))
+            error_exit("Assignment file is truncated: " + filename);
+    }
+    mRecordStart = mMap + mCursor;
+    if((mMapLen - mCursor) / ASSIGNMENT_RECORD_BYTES < mRecords)
+        error_exit("Assignment file is truncated: " + filename);
+    mCursor += mRecords * ASSIGNMENT_RECORD_BYTES;
+}
+
+AssignmentFile::~AssignmentFile(){
+    if(mMap)
+        munmap(mMap, mMapLen);
+}
+
+bool AssignmentFile::readBytes(void* data, size_t len){
+    if(mMapLen - mCursor < len)
+        return false;
+    memcpy(data, mMap + mCursor, len);
+    mCursor += len;
+    return true;
+}
+
+bool AssignmentFile::readString(string& s){
+    uint32_t len;
+    if(!readBytes(&len, sizeof(len)) || mMapLen - mCursor < len)
+        return false;
+    s.assign(mMap + mCursor, len);
+    mCursor += len;
+    return true;
+}
+
+string AssignmentFile::staleReason(const vector<string>& barcodes, int threshold, int minQual){
+    if(mThreshold != threshold)
+        return "saved with fuzzy threshold " + to_string(mThreshold);
+    if(mMinQual != minQual)
+        return "saved with minimum index quality " + to_string(mMinQual);
+    if(mBarcodes != barcodes)
+        return "saved with a different barcode table";
+    return "";
+}
+
+const string& AssignmentFile::namePrefix(){
+    return mNamePrefix;
+}
+
+size_t AssignmentFile::size(){
+    return mRecords;
+}
+
+Assignment AssignmentFile::record(size_t i){
+    const char* record = mRecordStart + i * ASSIGNMENT_RECORD_BYTES;
+    Assignment assignment;
+    uint16_t barcode;
+    memcpy(&assignment.key, record, 8);
+    memcpy(&barcode, record + 8, 2);
+    assignment.barcode = barcode == ASSIGNMENT_UNASSIGNED ? -1 : barcode;
+    assignment.mismatches = (unsigned char)record[10];
+    assignment.type = (MatchType)(record[11] & ~ASSIGNMENT_AMBIGUOUS);
+    assignment.ambiguous = (record[11] & ASSIGNMENT_AMBIGUOUS) != 0;
+    return assignment;
+}
+
+size_t AssignmentFile::resolvedSize(){
+    return mResolved;
+}
+
+bool AssignmentFile::nextResolved(string& name, int& barcode){
+    if(mResolvedRead == mResolved)
+        return false;
+    uint16_t id;
+    if(!readString(name) || !readBytes(&id, sizeof(id)))
+        error_exit("Assignment file is truncated: " + mFilename);
+    barcode = id == ASSIGNMENT_UNASSIGNED ? -1 : id;
+    mResolvedRead++;
+    return true;
+}
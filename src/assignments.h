@@ -0,0 +1,113 @@
+//
+//  assignments.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef ASSIGNMENTS_H
+#define ASSIGNMENTS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "barcode.h"
+
+using namespace std;
+
+#define ASSIGNMENT_MAGIC "DSASSIGN"
+#define ASSIGNMENT_VERSION 1
+
+// Bytes of one record: name key, barcode, mismatches, match type
+#define ASSIGNMENT_RECORD_BYTES 12
+
+// No barcode matched; tables of this many barcodes or more can't be saved
+#define ASSIGNMENT_UNASSIGNED 0xffff
+
+// Set in the match type byte when more than one barcode was in range
+#define ASSIGNMENT_AMBIGUOUS 0x80
+
+// One index read as saved by the index pass
+struct Assignment {
+    uint64_t key;
+    int barcode;        // position in the barcode table, -1 if unassigned
+    int mismatches;
+    MatchType type;
+    bool ambiguous;
+};
+
+// Binary file of the index pass, so a later run can split the reads again
+// without reading and matching the index file.
+// The header holds the version, fuzzy threshold, minimum index quality,
+// record counts, the read name prefix of NameCodec and the barcode table;
+// then come the records in the order the index pass read them, fixed-size
+// (key, barcode, mismatches, match type) in native byte order, then the
+// names of keys shared by more than one name with their barcode. Barcodes
+// rather than sample ids are kept, so the samples of the barcodes file can
+// be renamed between runs.
+class AssignmentWriter{
+public:
+    AssignmentWriter(string filename, const vector<string>& barcodes, int threshold, int minQual);
+    ~AssignmentWriter();
+
+    // the name prefix is only known once the first read has been seen
+    void setNamePrefix(const string& prefix);
+    void add(uint64_t key, const BarcodeMatch& match);
+    // after the last add(), each record of a key marked by ReadIndex
+    void addResolved(const string& name, const BarcodeMatch& match);
+    void close();
+
+private:
+    void writeBytes(const void* data, size_t len);
+    void writeString(const string& s);
+    void writeHeader();
+
+private:
+    string mFilename;
+    FILE* mFile;
+    vector<string> mBarcodes;
+    int mThreshold;
+    int mMinQual;
+    string mNamePrefix;
+    uint64_t mRecords;
+    uint64_t mResolved;
+    bool mHeaderWritten;
+};
+
+// A saved file, memory-mapped and read in place
+class AssignmentFile{
+public:
+    AssignmentFile(string filename);
+    ~AssignmentFile();
+
+    // why the file doesn't fit this barcode table and threshold, empty if it does
+    string staleReason(const vector<string>& barcodes, int threshold, int minQual);
+    const string& namePrefix();
+    size_t size();
+    Assignment record(size_t i);
+    size_t resolvedSize();
+    // the next name of a shared key and its barcode, false after the last
+    bool nextResolved(string& name, int& barcode);
+
+private:
+    bool readBytes(void* data, size_t len);
+    bool readString(string& s);
+
+private:
+    string mFilename;
+    char* mMap;
+    size_t mMapLen;
+    size_t mCursor;
+    uint32_t mVersion;
+    int32_t mThreshold;
+    int32_t mMinQual;
+    uint64_t mRecords;
+    uint64_t mResolved;
+    string mNamePrefix;
+    vector<string> mBarcodes;
+    const char* mRecordStart;
+    size_t mResolvedRead;
+};
+
+#endif
@@ -0,0 +1,586 @@
+//
+//  barcode.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "barcode.h"
+#include <algorithm>
+#include <map>
+
+#define EMPTY_LENGTH 0xFF
+
+// Stands in for a wildcard base of an index compared character by character
+#define MASKED_BASE '\0'
+
+// Source: https://stackoverflow.com/a/33075485/9571488
+string complementSeq(string seq) {
+    string c;
+    
+    for (int i = 0; i < seq.length(); ++i) {
+        char base = seq.at(i);
+        if (base == 'A') {
+            c = c + "T";
+        } else if (base == 'T') {
+            c = c + "A";
+        } else if (base == 'C') {
+            c = c + "G";
+        } else if (base == 'G') {
+            c = c + "C";
+        } else {
+            c = c + base;
+        }
+    }
+
+    return c;
+}
+
+string reverseSeq(string seq) {
+    reverse(seq.begin(), seq.end());
+    return seq;
+}
+
+string reverseComplement(string seq) {
+
+    string s_seq_c, s_seq_r;
+    s_seq_c = complementSeq(seq);
+    s_seq_r = reverseSeq(s_seq_c);
+    return s_seq_r;
+}
+
+bool fuzzyMatch(string s1, string s2, int threshold) {
+
+    if (s1.length() != s2.length()) {
+        return 1;
+    }
+
+    PackedBarcode p1, p2;
+    if (PackedBarcode::pack(s1, p1) && PackedBarcode::pack(s2, p2)) {
+        return p1.mismatches(p2) <= threshold ? 0 : 1;
+    }
+
+    int mismatch = 0;
+    for (int i = 0; i < s1.length(); ++i) {
+        if (s1.at(i) != s2.at(i)) {
+            ++mismatch;
+        }
+    }
+    if (mismatch <= threshold) {
+        return 0;
+    } else {
+        return 1;
+    }
+}
+
+// Mismatch count, or -1 when the lengths differ
+// MASKED_BASE positions of s1 are not counted
+static int hammingDistance(const string& s1, const string& s2) {
+    if (s1.length() != s2.length())
+        return -1;
+    int mismatch = 0;
+    for (int i = 0; i < s1.length(); ++i) {
+        if (s1[i] != s2[i] && s1[i] != MASKED_BASE)
+            ++mismatch;
+    }
+    return mismatch;
+}
+
+// The care mask of the reverse complement of a len base sequence
+static uint64_t reverseCare(uint64_t care, int len) {
+    uint64_t rc = 0;
+    for (int i = 0; i < len; ++i)
+        rc |= ((care >> (2 * i)) & 1) << (2 * (len - 1 - i));
+    return rc;
+}
+
+BarcodeTable::BarcodeTable(vector<string> barcodes, vector<int> sampleIds, int threshold, int minQual, size_t maxBytes){
+    mBarcodes = barcodes;
+    mSampleIds = sampleIds;
+    mThreshold = threshold;
+    mMinQual = minQual;
+    mPackable = true;
+    mMask = 0;
+    mShift = 64;
+    mEntries = 0;
+    mHasLookup = false;
+
+    for(int i=0; i<mBarcodes.size(); i++) {
+        PackedBarcode p;
+        if(!PackedBarcode::pack(mBarcodes[i], p)) {
+            mPackable = false;
+            return;
+        }
+        mPackedLengths.push_back(p.mLength);
+        mPackedBases.push_back(p.mBases);
+        mPackedNMasks.push_back(p.mNMask);
+    }
+    uint64_t capacity = lookupCapacity();
+    if(capacity > BARCODE_TABLE_MAX_SLOTS)
+        return;
+    if(maxBytes > 0 && capacity * (sizeof(Slot) + sizeof(Neighbour)) > maxBytes)
+        return;
+
+    buildLookup();
+}
+
+double BarcodeTable::estimateEntries(){
+    double total = 0;
+    for(int i=0; i<mBarcodes.size(); i++) {
+        int len = mBarcodes[i].length();
+        double ways = 1;
+        double sum = 1;
+        for(int k=1; k<=min(mThreshold, len); k++) {
+            ways = ways * (len - k + 1) / k * 4;
+            sum += ways;
+        }
+        // forward and reverse complement neighbourhoods
+        total += 2 * sum;
+    }
+    return total;
+}
+
+// Slots for the neighbourhoods at a load of 1/2 at most, a power of 2
+uint64_t BarcodeTable::lookupCapacity(){
+    uint64_t capacity = 16;
+    while(capacity < estimateEntries() * 2)
+        capacity <<= 1;
+    return capacity;
+}
+
+uint64_t BarcodeTable::slotFor(const PackedBarcode& seq){
+    uint64_t h = seq.mBases ^ (seq.mNMask * 0xC2B2AE3D27D4EB4FULL) ^ ((uint64_t)seq.mLength << 58);
+    return (h * 0x9E3779B97F4A7C15ULL) >> mShift;
+}
+
+BarcodeTable::Neighbour* BarcodeTable::findOrInsert(vector<Neighbour>& table, const PackedBarcode& seq){
+    uint64_t i = slotFor(seq);
+    while(table[i].length != EMPTY_LENGTH) {
+        Neighbour& n = table[i];
+        if(n.bases == seq.mBases && n.nmask == seq.mNMask && n.length == seq.mLength)
+            return &n;
+        i = (i + 1) & mMask;
+    }
+    Neighbour& n = table[i];
+    n.bases = seq.mBases;
+    n.nmask = seq.mNMask;
+    n.length = seq.mLength;
+    n.exact = -1;
+    n.exactRevComp = -1;
+    n.fuzzy = -1;
+    n.fuzzyRevComp = -1;
+    n.fuzzyCount = 0;
+    n.fuzzyRevCompCount = 0;
+    n.fuzzyDist = 0;
+    n.fuzzyRevCompDist = 0;
+    mEntries++;
+    return &n;
+}
+
+void BarcodeTable::enumerate(vector<Neighbour>& table, int barcode, bool revComp, PackedBarcode& seq, int start, int dist){
+    // each neighbour is generated exactly once per barcode and orientation
+    Neighbour* n = findOrInsert(table, seq);
+    if(!revComp) {
+        if(dist == 0)
+            n->exact = barcode;
+        if(n->fuzzyCount < 2)
+            n->fuzzyCount++;
+        n->fuzzy = barcode;
+        n->fuzzyDist = dist;
+    } else {
+        if(dist == 0)
+            n->exactRevComp = barcode;
+        if(n->fuzzyRevCompCount < 2)
+            n->fuzzyRevCompCount++;
+        n->fuzzyRevComp = barcode;
+        n->fuzzyRevCompDist = dist;
+    }
+
+    if(dist == mThreshold)
+        return;
+
+    // substitute each later position with each of the other four symbols
+    for(int p=start; p<seq.mLength; p++) {
+        int orig = seq.base(p);
+        for(int s=0; s<=4; s++) {
+            if(s == orig)
+                continue;
+            seq.setBase(p, s);
+            enumerate(table, barcode, revComp, seq, p + 1, dist + 1);
+        }
+        seq.setBase(p, orig);
+    }
+}
+
+void BarcodeTable::buildLookup(){
+    uint64_t capacity = lookupCapacity();
+    mShift = 64;
+    for(uint64_t c=1; c<capacity; c<<=1)
+        mShift--;
+    mMask = capacity - 1;
+
+    Neighbour empty;
+    empty.length = EMPTY_LENGTH;
+    vector<Neighbour> table(capacity, empty);
+
+    // the reverse complement neighbourhood of a barcode is the set of indexes
+    // whose reverse complement is within the threshold of that barcode
+    for(int i=0; i<mBarcodes.size(); i++) {
+        PackedBarcode seq = packedAt(i);
+        PackedBarcode revComp = seq.reverseComplement();
+        enumerate(table, i, false, seq, 0, 0);
+        enumerate(table, i, true, revComp, 0, 0);
+    }
+
+    // Resolve the precedence once per neighbour instead of once per read
+    Slot emptySlot;
+    emptySlot.length = EMPTY_LENGTH;
+    mSlots.assign(capacity, emptySlot);
+    for(uint64_t i=0; i<capacity; i++) {
+        Neighbour& n = table[i];
+        if(n.length == EMPTY_LENGTH)
+            continue;
+        Slot& s = mSlots[i];
+        s.bases = n.bases;
+        s.nmask = n.nmask;
+        s.length = n.length;
+        s.ambiguous = 0;
+        s.mismatches = 0;
+        if(n.exact >= 0) {
+            s.barcode = n.exact;
+            s.type = MATCH_EXACT;
+        } else if(n.exactRevComp >= 0) {
+            s.barcode = n.exactRevComp;
+            s.type = MATCH_REVCOMP;
+        } else if(n.fuzzyCount == 1) {
+            s.barcode = n.fuzzy;
+            s.type = MATCH_FUZZY;
+            s.mismatches = n.fuzzyDist;
+        } else if(n.fuzzyRevCompCount == 1) {
+            s.barcode = n.fuzzyRevComp;
+            s.type = MATCH_FUZZY_REVCOMP;
+            s.mismatches = n.fuzzyRevCompDist;
+        } else {
+            // neighbour of two or more barcodes in each orientation it occurs in
+            s.barcode = -1;
+            s.type = MATCH_NONE;
+            s.ambiguous = 1;
+        }
+    }
+
+    mHasLookup = true;
+}
+
+BarcodeMatch BarcodeTable::resolve(int32_t barcode, MatchType type, int mismatches, bool ambiguous){
+    BarcodeMatch m;
+    m.barcode = barcode;
+    m.sampleId = barcode >= 0 ? mSampleIds[barcode] : -1;
+    m.type = type;
+    m.mismatches = mismatches;
+    m.ambiguous = ambiguous;
+    return m;
+}
+
+BarcodeMatch BarcodeTable::match(const string& index){
+    return match(index.data(), index.length());
+}
+
+// Lane low bits of the first PACKED_MAX_LEN positions of index that count
+// towards the distance, without a branch per base
+uint64_t BarcodeTable::careMask(const char* index, const char* qual, int len){
+    int n = min(len, PACKED_MAX_LEN);
+    uint64_t care = 0;
+    for(int i=0; i<n; i++)
+        care |= (uint64_t)(index[i] != 'N') << (2 * i);
+    if(qual != NULL) {
+        char minChar = INDEX_QUAL_OFFSET + mMinQual;
+        for(int i=0; i<n; i++)
+            care &= ~((uint64_t)(qual[i] < minChar) << (2 * i));
+    }
+    return care;
+}
+
+BarcodeMatch BarcodeTable::match(const char* index, int len, const char* qual){
+    PackedBarcode seq;
+    bool packed = false;
+    if(mMinQual > 0) {
+        packed = mPackable && PackedBarcode::pack(index, len, seq);
+        if(packed) {
+            uint64_t care = careMask(index, qual, len);
+            if(care != PackedBarcode::careOf(len))
+                return scanPacked(seq, care);
+        } else if(!mPackable || len <= PACKED_MAX_LEN) {
+            string masked(index, len);
+            bool any = false;
+            for(int i=0; i<len; i++) {
+                if(masked[i] == 'N' || (qual != NULL && qual[i] < INDEX_QUAL_OFFSET + mMinQual)) {
+                    masked[i] = MASKED_BASE;
+                    any = true;
+                }
+            }
+            if(any)
+                return scan(masked, true);
+        }
+    }
+
+    if(!mPackable)
+        return scan(string(index, len));
+    if(!packed && !PackedBarcode::pack(index, len, seq)) {
+        // packable barcodes are never longer than PACKED_MAX_LEN
+        if(len > PACKED_MAX_LEN)
+            return resolve(-1, MATCH_NONE, 0, false);
+        return scan(string(index, len));
+    }
+    if(!mHasLookup)
+        return scanPacked(seq);
+
+    uint64_t i = slotFor(seq);
+    while(mSlots[i].length != EMPTY_LENGTH) {
+        Slot& s = mSlots[i];
+        if(s.bases == seq.mBases && s.nmask == seq.mNMask && s.length == seq.mLength)
+            return resolve(s.barcode, (MatchType)s.type, s.mismatches, s.ambiguous);
+        i = (i + 1) & mMask;
+    }
+    return resolve(-1, MATCH_NONE, 0, false);
+}
+
+// Count a barcode within the threshold towards the fuzzy match. Without
+// wildcards the match must be the only barcode in range, as in the lookup
+// table. Wildcards bring every barcode closer, so with them the match is
+// the only one at the smallest distance: an index one mismatch from one
+// barcode and, through a masked base, none from another is not ambiguous
+static inline void countFuzzy(int barcode, int dist, bool best, int& fuzzy, int& count, int& fuzzyDist){
+    if(best && count > 0 && dist > fuzzyDist)
+        return;
+    if(best && count > 0 && dist < fuzzyDist)
+        count = 0;
+    count++;
+    fuzzy = barcode;
+    fuzzyDist = dist;
+}
+
+// With wildcards the orientation nearer a barcode wins, whichever it is:
+// drop the other one's candidates. At equal distances forward goes first
+static inline void keepNearer(bool best, int& count, int dist, int& countRevComp, int distRevComp){
+    if(!best || count == 0 || countRevComp == 0)
+        return;
+    if(distRevComp < dist)
+        count = 0;
+    else if(dist < distRevComp)
+        countRevComp = 0;
+}
+
+// Compare against every packed barcode, used when the lookup table would be
+// too large or some positions of the index are wildcards
+BarcodeMatch BarcodeTable::scanPacked(const PackedBarcode& index, uint64_t care){
+    size_t n = mBarcodes.size();
+    // scratch kept per thread, tables are shared by the worker threads
+    static thread_local vector<uint32_t> hits, hitsRevComp;
+    static thread_local vector<uint8_t> dists, distsRevComp;
+    if(hits.size() < n) {
+        hits.resize(n);
+        hitsRevComp.resize(n);
+        dists.resize(n);
+        distsRevComp.resize(n);
+    }
+    PackedBarcode revComp = index.reverseComplement();
+    uint64_t careRevComp = care == PACKED_CARE_ALL ? care : reverseCare(care, index.mLength);
+    // a match with wildcards is never exact
+    int exactDist = care == PACKED_CARE_ALL ? 0 : -1;
+    size_t found = packedWithinThreshold(index, mPackedBases.data(), mPackedNMasks.data(), n, mThreshold, hits.data(), dists.data(), care);
+    size_t foundRevComp = packedWithinThreshold(revComp, mPackedBases.data(), mPackedNMasks.data(), n, mThreshold, hitsRevComp.data(), distsRevComp.data(), careRevComp);
+
+    int exact = -1, exactRevComp = -1;
+    int fuzzy = -1, fuzzyRevComp = -1;
+    int fuzzyCount = 0, fuzzyRevCompCount = 0;
+    int fuzzyDist = 0, fuzzyRevCompDist = 0;
+
+    bool best = care != PACKED_CARE_ALL;
+    for(size_t h=0; h<found; h++) {
+        int i = hits[h];
+        if(mPackedLengths[i] != index.mLength)
+            continue;
+        int d = dists[h];
+        if(d == exactDist)
+            exact = i;
+        countFuzzy(i, d, best, fuzzy, fuzzyCount, fuzzyDist);
+    }
+    for(size_t h=0; h<foundRevComp; h++) {
+        int i = hitsRevComp[h];
+        if(mPackedLengths[i] != index.mLength)
+            continue;
+        int d = distsRevComp[h];
+        if(d == exactDist)
+            exactRevComp = i;
+        countFuzzy(i, d, best, fuzzyRevComp, fuzzyRevCompCount, fuzzyRevCompDist);
+    }
+
+    if(exact >= 0)
+        return resolve(exact, MATCH_EXACT, 0, false);
+    if(exactRevComp >= 0)
+        return resolve(exactRevComp, MATCH_REVCOMP, 0, false);
+    keepNearer(best, fuzzyCount, fuzzyDist, fuzzyRevCompCount, fuzzyRevCompDist);
+    if(fuzzyCount == 1)
+        return resolve(fuzzy, MATCH_FUZZY, fuzzyDist, false);
+    if(fuzzyRevCompCount == 1)
+        return resolve(fuzzyRevComp, MATCH_FUZZY_REVCOMP, fuzzyRevCompDist, false);
+    return resolve(-1, MATCH_NONE, 0, fuzzyCount > 1 || fuzzyRevCompCount > 1);
+}
+
+PackedBarcode BarcodeTable::packedAt(int id){
+    PackedBarcode seq;
+    seq.mBases = mPackedBases[id];
+    seq.mNMask = mPackedNMasks[id];
+    seq.mLength = mPackedLengths[id];
+    return seq;
+}
+
+// Compare character by character, used for sequences outside ACGTN
+// A masked index has MASKED_BASE wildcards and is never an exact match
+BarcodeMatch BarcodeTable::scan(const string& index, bool masked){
+    string revComp = reverseComplement(index);
+    int exactDist = masked ? -1 : 0;
+    int exact = -1, exactRevComp = -1;
+    int fuzzy = -1, fuzzyRevComp = -1;
+    int fuzzyCount = 0, fuzzyRevCompCount = 0;
+    int fuzzyDist = 0, fuzzyRevCompDist = 0;
+
+    for(int i=0; i<mBarcodes.size(); i++) {
+        int d = hammingDistance(index, mBarcodes[i]);
+        if(d == exactDist)
+            exact = i;
+        if(d >= 0 && d <= mThreshold)
+            countFuzzy(i, d, masked, fuzzy, fuzzyCount, fuzzyDist);
+        d = hammingDistance(revComp, mBarcodes[i]);
+        if(d == exactDist)
+            exactRevComp = i;
+        if(d >= 0 && d <= mThreshold)
+            countFuzzy(i, d, masked, fuzzyRevComp, fuzzyRevCompCount, fuzzyRevCompDist);
+    }
+
+    if(exact >= 0)
+        return resolve(exact, MATCH_EXACT, 0, false);
+    if(exactRevComp >= 0)
+        return resolve(exactRevComp, MATCH_REVCOMP, 0, false);
+    keepNearer(masked, fuzzyCount, fuzzyDist, fuzzyRevCompCount, fuzzyRevCompDist);
+    if(fuzzyCount == 1)
+        return resolve(fuzzy, MATCH_FUZZY, fuzzyDist, false);
+    if(fuzzyRevCompCount == 1)
+        return resolve(fuzzyRevComp, MATCH_FUZZY_REVCOMP, fuzzyRevCompDist, false);
+    return resolve(-1, MATCH_NONE, 0, fuzzyCount > 1 || fuzzyRevCompCount > 1);
+}
+
+string BarcodeTable::barcode(int id){
+    return mBarcodes[id];
+}
+
+int BarcodeTable::size(){
+    return mBarcodes.size();
+}
+
+bool BarcodeTable::hasLookup(){
+    return mHasLookup;
+}
+
+size_t BarcodeTable::lookupEntries(){
+    return mEntries;
+}
+
+size_t BarcodeTable::memoryBytes(){
+    return mSlots.size() * sizeof(Slot);
+}
+
+DualBarcodeTable::DualBarcodeTable(vector<string> i7, vector<string> i5, vector<int> sampleIds, int threshold7, int threshold5, int minQual,
+    size_t maxBytes){
+    mI7 = i7;
+    mI5 = i5;
+    mSampleIds = sampleIds;
+
+    // each distinct index sequence is one barcode of its own table
+    vector<string> barcodes7, barcodes5;
+    vector<int> ids7, ids5;
+    map<string, int> index7, index5;
+    for(int row=0; row<mI7.size(); row++) {
+        if(index7.count(mI7[row]) == 0) {
+            index7[mI7[row]] = barcodes7.size();
+            ids7.push_back(barcodes7.size());
+            barcodes7.push_back(mI7[row]);
+        }
+        if(index5.count(mI5[row]) == 0) {
+            index5[mI5[row]] = barcodes5.size();
+            ids5.push_back(barcodes5.size());
+            barcodes5.push_back(mI5[row]);
+        }
+    }
+    mTable7 = new BarcodeTable(barcodes7, ids7, threshold7, minQual, maxBytes);
+    size_t maxBytes5 = maxBytes;
+    if(maxBytes > 0)
+        maxBytes5 = maxBytes > mTable7->memoryBytes() ? maxBytes - mTable7->memoryBytes() : 1;
+    mTable5 = new BarcodeTable(barcodes5, ids5, threshold5, minQual, maxBytes5);
+    mCount5 = barcodes5.size();
+
+    // a grid that doesn't fit in what the lookup tables leave of maxBytes is
+    // kept in the hash map too
+    double pairs = (double)barcodes7.size() * barcodes5.size();
+    bool dense = pairs <= DUAL_TABLE_MAX_PAIRS;
+    if(maxBytes > 0 && pairs * sizeof(int32_t) + mTable7->memoryBytes() + mTable5->memoryBytes() > maxBytes)
+        dense = false;
+    if(dense)
+        mPairs.assign(barcodes7.size() * barcodes5.size(), -1);
+    for(int row=0; row<mI7.size(); row++) {
+        int b7 = index7[mI7[row]];
+        int b5 = index5[mI5[row]];
+        if(dense)
+            mPairs[(size_t)b7 * mCount5 + b5] = row;
+        else
+            mSparsePairs[(uint64_t)b7 << 32 | b5] = row;
+    }
+}
+
+DualBarcodeTable::~DualBarcodeTable(){
+    delete mTable7;
+    delete mTable5;
+}
+
+int DualBarcodeTable::pairRow(int barcode7, int barcode5){
+    if(!mPairs.empty())
+        return mPairs[(size_t)barcode7 * mCount5 + barcode5];
+    unordered_map<uint64_t, int32_t>::iterator it = mSparsePairs.find((uint64_t)barcode7 << 32 | barcode5);
+    return it == mSparsePairs.end() ? -1 : it->second;
+}
+
+BarcodeMatch DualBarcodeTable::match(const char* i7, int len7, const char* i5, int len5, const char* qual7, const char* qual5){
+    BarcodeMatch m7 = mTable7->match(i7, len7, qual7);
+    BarcodeMatch m5 = mTable5->match(i5, len5, qual5);
+
+    BarcodeMatch m;
+    m.barcode = -1;
+    m.sampleId = -1;
+    m.type = MATCH_NONE;
+    m.mismatches = 0;
+    m.ambiguous = m7.ambiguous || m5.ambiguous;
+    if(m7.barcode < 0 || m5.barcode < 0)
+        return m;
+    int row = pairRow(m7.barcode, m5.barcode);
+    if(row < 0)
+        return m;
+
+    // the pair is as good as its worse index
+    m.barcode = row;
+    m.sampleId = mSampleIds[row];
+    m.type = max(m7.type, m5.type);
+    m.mismatches = m7.mismatches + m5.mismatches;
+    return m;
+}
+
+string DualBarcodeTable::barcode(int row){
+    return mI7[row] + "+" + mI5[row];
+}
+
+int DualBarcodeTable::size(){
+    return mI7.size();
+}
+
+size_t DualBarcodeTable::memoryBytes(){
+    return mTable7->memoryBytes() + mTable5->memoryBytes() + mPairs.size() * sizeof(int32_t);
+}
@@ -0,0 +1,161 @@
+//
+//  barcode.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef BARCODE_H
+#define BARCODE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "packedbarcode.h"
+
+using namespace std;
+
+// Lookup tables larger than this, or than the memory given to the table,
+// fall back to scanning every barcode
+#ifndef BARCODE_TABLE_MAX_SLOTS
+#define BARCODE_TABLE_MAX_SLOTS (1<<24)
+#endif
+
+// i7 x i5 grids larger than this are kept in a hash map instead of an array
+#define DUAL_TABLE_MAX_PAIRS (1<<24)
+
+// Index qualities are Phred+33
+#define INDEX_QUAL_OFFSET 33
+
+string complementSeq(string seq);
+string reverseSeq(string seq);
+string reverseComplement(string seq);
+bool fuzzyMatch(string s1, string s2, int threshold);
+
+enum MatchType {
+    MATCH_NONE = 0,
+    MATCH_EXACT,
+    MATCH_REVCOMP,
+    MATCH_FUZZY,
+    MATCH_FUZZY_REVCOMP
+};
+
+struct BarcodeMatch {
+    int barcode;        // position in the barcode table, -1 if unassigned
+    int sampleId;
+    MatchType type;
+    int mismatches;
+    bool ambiguous;     // more than one barcode within the fuzzy threshold (at the best distance, with wildcards)
+};
+
+// Barcode table with every sequence within the fuzzy threshold of each
+// barcode (and of its reverse complement) precomputed into one flat hash
+// table, so assigning an index costs a single probe
+// With minQual > 0, N bases and bases of quality below minQual are
+// wildcards: they don't count towards the distance, and an index with any
+// is matched by scanning the barcodes instead, never as an exact match, to
+// the one barcode at the smallest distance within the threshold
+// maxBytes, if not 0, bounds the lookup table while it is built, when a
+// working table of neighbours is held next to it
+class BarcodeTable{
+public:
+    BarcodeTable(vector<string> barcodes, vector<int> sampleIds, int threshold, int minQual = 0, size_t maxBytes = 0);
+
+    BarcodeMatch match(const string& index);
+    // qual may be NULL, then only N bases are wildcards
+    BarcodeMatch match(const char* index, int len, const char* qual = NULL);
+    string barcode(int id);
+    int size();
+    bool hasLookup();
+    size_t lookupEntries();
+    // bytes of the lookup table, 0 without one
+    size_t memoryBytes();
+
+private:
+    struct Slot {
+        uint64_t bases;
+        uint64_t nmask;
+        int32_t barcode;
+        uint8_t length;
+        uint8_t type;
+        uint8_t mismatches;
+        uint8_t ambiguous;
+    };
+
+    struct Neighbour {
+        uint64_t bases;
+        uint64_t nmask;
+        uint8_t length;
+        int32_t exact;
+        int32_t exactRevComp;
+        int32_t fuzzy;
+        int32_t fuzzyRevComp;
+        uint8_t fuzzyCount;
+        uint8_t fuzzyRevCompCount;
+        uint8_t fuzzyDist;
+        uint8_t fuzzyRevCompDist;
+    };
+
+    double estimateEntries();
+    uint64_t lookupCapacity();
+    void buildLookup();
+    void enumerate(vector<Neighbour>& table, int barcode, bool revComp, PackedBarcode& seq, int start, int dist);
+    Neighbour* findOrInsert(vector<Neighbour>& table, const PackedBarcode& seq);
+    uint64_t slotFor(const PackedBarcode& seq);
+    uint64_t careMask(const char* index, const char* qual, int len);
+    BarcodeMatch scan(const string& index, bool masked = false);
+    BarcodeMatch scanPacked(const PackedBarcode& index, uint64_t care = PACKED_CARE_ALL);
+    PackedBarcode packedAt(int id);
+    BarcodeMatch resolve(int32_t barcode, MatchType type, int mismatches, bool ambiguous);
+
+private:
+    vector<string> mBarcodes;
+    vector<int> mSampleIds;
+    int mThreshold;
+    int mMinQual;
+    bool mPackable;
+    vector<uint8_t> mPackedLengths;
+    vector<uint64_t> mPackedBases;
+    vector<uint64_t> mPackedNMasks;
+    vector<Slot> mSlots;
+    uint64_t mMask;
+    int mShift;
+    size_t mEntries;
+    bool mHasLookup;
+};
+
+// Dual-index (i7 + i5) barcode table. Each index is matched on its own
+// BarcodeTable with its own threshold, and the pair of matched barcodes is
+// looked up in an i7 x i5 grid of barcode table rows. The match's barcode
+// is the row, and the pair is unassigned if either index or the pair is.
+// maxBytes, if not 0, is shared by the two lookup tables, i7 first, and
+// the grid.
+class DualBarcodeTable{
+public:
+    DualBarcodeTable(vector<string> i7, vector<string> i5, vector<int> sampleIds, int threshold7, int threshold5, int minQual = 0,
+        size_t maxBytes = 0);
+    ~DualBarcodeTable();
+
+    BarcodeMatch match(const char* i7, int len7, const char* i5, int len5, const char* qual7 = NULL, const char* qual5 = NULL);
+    // i7+i5
+    string barcode(int row);
+    int size();
+    // bytes of both lookup tables and of the pair grid
+    size_t memoryBytes();
+
+private:
+    int pairRow(int barcode7, int barcode5);
+
+private:
+    vector<string> mI7;
+    vector<string> mI5;
+    vector<int> mSampleIds;
+    BarcodeTable* mTable7;
+    BarcodeTable* mTable5;
+    int mCount5;
+    vector<int32_t> mPairs;
+    unordered_map<uint64_t, int32_t> mSparsePairs;
+};
+
+#endif
@@ -0,0 +1,150 @@
+//
+//  bgzf.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "bgzf.h"
+#include "util.h"
+#include <string.h>
+#include <chrono>
+
+// gzip header with the BC extra subfield holding the block size
+#define BGZF_HEADER_SIZE 18
+// CRC32 and uncompressed length
+#define BGZF_FOOTER_SIZE 8
+
+static void initStream(z_stream* zs, int level){
+    memset(zs, 0, sizeof(*zs));
+    if(deflateInit2(zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        error_exit("Failed to initialize zlib for output compression");
+}
+
+BgzfCompressor::BgzfCompressor(int level, int threads){
+    mLevel = level;
+    mQueue = NULL;
+    mNanos = 0;
+    mBytesIn = 0;
+    mBytesOut = 0;
+    initStream(&mStream, mLevel);
+    if(threads > 1) {
+        mQueue = new BoundedQueue<BgzfBlock*>(threads * BGZF_PENDING_PER_WRITER);
+        for(int t=0; t<threads; t++)
+            mWorkers.push_back(thread(&BgzfCompressor::worker, this));
+    }
+}
+
+BgzfCompressor::~BgzfCompressor(){
+    if(mQueue) {
+        mQueue->close();
+        for(size_t t=0; t<mWorkers.size(); t++)
+            mWorkers[t].join();
+        delete mQueue;
+    }
+    deflateEnd(&mStream);
+}
+
+void BgzfCompressor::submit(BgzfBlock* block){
+    block->done = false;
+    if(mQueue) {
+        mQueue->push(block);
+        return;
+    }
+    lock_guard<mutex> lock(mStreamMtx);
+    compress(&mStream, block);
+    block->done = true;
+}
+
+bool BgzfCompressor::isDone(BgzfBlock* block){
+    lock_guard<mutex> lock(mMtx);
+    return block->done;
+}
+
+void BgzfCompressor::wait(BgzfBlock* block){
+    unique_lock<mutex> lock(mMtx);
+    mDone.wait(lock, [block]{ return block->done; });
+}
+
+void BgzfCompressor::worker(){
+    z_stream zs;
+    initStream(&zs, mLevel);
+    BgzfBlock* block;
+    while(mQueue->pop(block)) {
+        compress(&zs, block);
+        lock_guard<mutex> lock(mMtx);
+        block->done = true;
+        mDone.notify_all();
+    }
+    deflateEnd(&zs);
+}
+
+void BgzfCompressor::compress(z_stream* zs, BgzfBlock* block){
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    const string& in = block->data;
+    string& out = block->compressed;
+    out.resize(BGZF_MAX_BLOCK_SIZE);
+    unsigned char* p = (unsigned char*)&out[0];
+
+    deflateReset(zs);
+    zs->next_in = (Bytef*)in.data();
+    zs->avail_in = in.length();
+    zs->next_out = p + BGZF_HEADER_SIZE;
+    zs->avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+    size_t deflated;
+    if(deflate(zs, Z_FINISH) == Z_STREAM_END) {
+        deflated = zs->total_out;
+    } else {
+        // did not fit, write one stored deflate block instead
+        unsigned char* s = p + BGZF_HEADER_SIZE;
+        s[0] = 1;
+        s[1] = in.length() & 0xff;
+        s[2] = in.length() >> 8;
+        s[3] = ~s[1];
+        s[4] = ~s[2];
+        memcpy(s + 5, in.data(), in.length());
+        deflated = in.length() + 5;
+    }
+
+    size_t size = BGZF_HEADER_SIZE + deflated + BGZF_FOOTER_SIZE;
+    static const unsigned char header[BGZF_HEADER_SIZE - 2] = {
+        0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0 };
+    memcpy(p, header, sizeof(header));
+    p[16] = (size - 1) & 0xff;
+    p[17] = (size - 1) >> 8;
+
+    uint32_t crc = crc32(0, (const Bytef*)in.data(), in.length());
+    uint32_t len = in.length();
+    unsigned char* f = p + BGZF_HEADER_SIZE + deflated;
+    for(int b=0; b<4; b++) {
+        f[b] = (crc >> (8 * b)) & 0xff;
+        f[4 + b] = (len >> (8 * b)) & 0xff;
+    }
+    out.resize(size);
+
+    mBytesIn += in.length();
+    mBytesOut += size;
+    mNanos += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+int BgzfCompressor::level(){
+    return mLevel;
+}
+
+double BgzfCompressor::seconds(){
+    return mNanos / 1e9;
+}
+
+size_t BgzfCompressor::bytesIn(){
+    return mBytesIn;
+}
+
+size_t BgzfCompressor::bytesOut(){
+    return mBytesOut;
+}
+
+const string& BgzfCompressor::eofBlock(){
+    static const string block("\x1f\x8b\x08\x04\x00\x00\x00\x00\x00\xff\x06\x00\x42\x43\x02\x00\x1b\x00\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00", 28);
+    return block;
+}
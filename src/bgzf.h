@@ -0,0 +1,76 @@
+//
+//  bgzf.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef BGZF_H
+#define BGZF_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <zlib.h>
+#include "boundedqueue.h"
+
+using namespace std;
+
+// Uncompressed bytes per block, small enough that a stored block still fits
+// in the 64 KiB limit when the data does not compress
+#define BGZF_BLOCK_SIZE 0xff00
+#define BGZF_MAX_BLOCK_SIZE 0x10000
+
+// Blocks a writer keeps in flight before waiting on the oldest one
+#define BGZF_PENDING_PER_WRITER 32
+
+struct BgzfBlock{
+    string data;
+    string compressed;
+    bool done;
+};
+
+// Compresses independent BGZF blocks, on a pool of threads when there are
+// any or on the calling thread otherwise. Blocks concatenated in the order
+// they were submitted form a valid gzip file that any gunzip can read.
+class BgzfCompressor{
+public:
+    BgzfCompressor(int level, int threads);
+    ~BgzfCompressor();
+
+    void submit(BgzfBlock* block);
+    bool isDone(BgzfBlock* block);
+    void wait(BgzfBlock* block);
+
+    int level();
+    // time spent in deflate summed over all threads
+    double seconds();
+    size_t bytesIn();
+    size_t bytesOut();
+
+    // empty block that marks the end of a BGZF file
+    static const string& eofBlock();
+
+private:
+    void worker();
+    void compress(z_stream* zs, BgzfBlock* block);
+
+private:
+    int mLevel;
+    BoundedQueue<BgzfBlock*>* mQueue;
+    vector<thread> mWorkers;
+    // z_stream of the calling thread when there are no workers
+    z_stream mStream;
+    mutex mStreamMtx;
+    mutex mMtx;
+    condition_variable mDone;
+    atomic<long> mNanos;
+    atomic<size_t> mBytesIn;
+    atomic<size_t> mBytesOut;
+};
+
+#endif
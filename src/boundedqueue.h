@@ -0,0 +1,61 @@
+//
+//  boundedqueue.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <stddef.h>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+// Fixed-capacity queue, push() blocks while full and pop() blocks while empty
+template<typename T>
+class BoundedQueue{
+public:
+    BoundedQueue(size_t capacity){
+        mCapacity = capacity;
+        mClosed = false;
+    }
+
+    void push(T item){
+        unique_lock<mutex> lock(mMtx);
+        mNotFull.wait(lock, [this]{ return mItems.size() < mCapacity; });
+        mItems.push_back(item);
+        mNotEmpty.notify_one();
+    }
+
+    // false once the queue is closed and drained
+    bool pop(T& item){
+        unique_lock<mutex> lock(mMtx);
+        mNotEmpty.wait(lock, [this]{ return !mItems.empty() || mClosed; });
+        if(mItems.empty())
+            return false;
+        item = mItems.front();
+        mItems.pop_front();
+        mNotFull.notify_one();
+        return true;
+    }
+
+    void close(){
+        lock_guard<mutex> lock(mMtx);
+        mClosed = true;
+        mNotEmpty.notify_all();
+    }
+
+private:
+    deque<T> mItems;
+    size_t mCapacity;
+    bool mClosed;
+    mutex mMtx;
+    condition_variable mNotFull;
+    condition_variable mNotEmpty;
+};
+
+#endif
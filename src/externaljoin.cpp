@@ -0,0 +1,324 @@
+//
+//  externaljoin.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "externaljoin.h"
+#include "readindex.h"
+#include "util.h"
+#include <algorithm>
+#include <queue>
+#include <map>
+
+// Partition files are a sequence of (hash, name length, record, mate),
+// run files of (hash, sample id, name length, name) sorted by hash
+static void writeBytes(FILE* fp, const void* data, size_t len, const string& filename){
+    if(fwrite(data, 1, len, fp) != len)
+        error_exit("Failed to write to file: " + filename);
+}
+
+static bool readBytes(FILE* fp, void* data, size_t len, const string& filename){
+    size_t got = fread(data, 1, len, fp);
+    if(got == 0 && len > 0)
+        return false;
+    if(got != len)
+        error_exit("Failed to read file: " + filename);
+    return true;
+}
+
+static void writeString(FILE* fp, const string& s, const string& filename){
+    uint32_t len = s.length();
+    writeBytes(fp, &len, sizeof(len), filename);
+    writeBytes(fp, s.data(), len, filename);
+}
+
+static void readString(FILE* fp, string& s, const string& filename){
+    uint32_t len;
+    if(!readBytes(fp, &len, sizeof(len), filename))
+        error_exit("Failed to read file: " + filename);
+    s.resize(len);
+    if(len > 0 && !readBytes(fp, &s[0], len, filename))
+        error_exit("Failed to read file: " + filename);
+}
+
+static bool entryBefore(const ExternalJoinEntry& a, const ExternalJoinEntry& b){
+    // names of one key are all packed or all hashed, either way the offset
+    // keeps them in the order they were added
+    return a.hash < b.hash || (a.hash == b.hash && a.nameOffset < b.nameOffset);
+}
+
+ExternalJoin::ExternalJoin(size_t maxBytes, string spillPrefix){
+    mMaxBytes = maxBytes;
+    mSpillPrefix = spillPrefix;
+    mRuns = 0;
+    mPartitionBits = 0;
+    mCollisions = 0;
+    mTableBytes = 0;
+    mSpilledBytes = 0;
+    mBuckets.assign((size_t)1 << EXTERNAL_JOIN_BUCKET_BITS, 0);
+
+    // the rest of the budget holds the records of a run; both are reserved
+    // up front so they never move, and only the pages in use count
+    size_t fixed = mBuckets.size() * sizeof(size_t) + EXTERNAL_JOIN_FILE_BUFFER;
+    if(mMaxBytes <= fixed + (1<<16))
+        error_exit("--max-memory is too small for the external join");
+    mRunBytes = min(mMaxBytes - fixed, (size_t)UINT32_MAX);
+    mEntries.reserve(mRunBytes / sizeof(ExternalJoinEntry));
+    mNames.reserve(mRunBytes);
+}
+
+ExternalJoin::~ExternalJoin(){
+    for(size_t p=0; p<mPartitionFiles.size(); p++) {
+        if(mPartitionFiles[p] != NULL)
+            fclose(mPartitionFiles[p]);
+        remove(partitionFile(p).c_str());
+    }
+    for(size_t run=0; run<mRuns; run++)
+        remove(runFile(run).c_str());
+}
+
+uint64_t ExternalJoin::mix(uint64_t key){
+    // the murmur3 finalizer: one to one, and spreads packed keys, whose high
+    // bits barely change, over the whole range
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+string ExternalJoin::runFile(size_t run){
+    return mSpillPrefix + "_external_run_" + to_string(run) + ".tmp";
+}
+
+string ExternalJoin::partitionFile(size_t partition){
+    return mSpillPrefix + "_external_part_" + to_string(partition) + ".tmp";
+}
+
+FILE* ExternalJoin::openSpill(string filename, const char* mode){
+    FILE* fp = fopen(filename.c_str(), mode);
+    if(fp == NULL)
+        error_exit("Failed to open file: " + filename);
+    setvbuf(fp, NULL, _IOFBF, EXTERNAL_JOIN_FILE_BUFFER);
+    return fp;
+}
+
+void ExternalJoin::closeSpill(FILE* fp, string filename){
+    if(fclose(fp) != 0)
+        error_exit("Failed to write to file: " + filename);
+}
+
+size_t ExternalJoin::partitionOf(uint64_t hash){
+    return mPartitionBits == 0 ? 0 : (size_t)(hash >> (64 - mPartitionBits));
+}
+
+void ExternalJoin::addIndex(uint64_t key, const char* name, int len, int sampleId){
+    // packed names are exact, so only hashed ones are kept
+    int nameLen = NameCodec::isPacked(key) ? 0 : len;
+    if((mEntries.size() + 1) * sizeof(ExternalJoinEntry) + mNames.size() + nameLen > mRunBytes)
+        writeRun();
+
+    ExternalJoinEntry entry;
+    entry.hash = mix(key);
+    entry.nameOffset = nameLen > 0 ? mNames.size() : mEntries.size();
+    entry.nameLen = nameLen;
+    entry.sampleId = sampleId;
+    mEntries.push_back(entry);
+    mNames.append(name, nameLen);
+    mBuckets[entry.hash >> (64 - EXTERNAL_JOIN_BUCKET_BITS)]++;
+}
+
+void ExternalJoin::writeRun(){
+    if(mEntries.empty())
+        return;
+    if(mRuns == EXTERNAL_JOIN_MAX_FILES)
+        error_exit("External join needs more than " + to_string(EXTERNAL_JOIN_MAX_FILES) + " runs; raise --max-memory");
+
+    sort(mEntries.begin(), mEntries.end(), entryBefore);
+    string filename = runFile(mRuns);
+    FILE* fp = openSpill(filename, "wb");
+    for(size_t i=0; i<mEntries.size(); i++) {
+        const ExternalJoinEntry& entry = mEntries[i];
+        writeBytes(fp, &entry.hash, sizeof(entry.hash), filename);
+        writeBytes(fp, &entry.sampleId, sizeof(entry.sampleId), filename);
+        writeBytes(fp, &entry.nameLen, sizeof(entry.nameLen), filename);
+        writeBytes(fp, mNames.data() + (entry.nameLen > 0 ? entry.nameOffset : 0), entry.nameLen, filename);
+        mSpilledBytes += sizeof(entry.hash) + sizeof(entry.sampleId) + sizeof(entry.nameLen) + entry.nameLen;
+    }
+    closeSpill(fp, filename);
+    mRuns++;
+    mEntries.clear();
+    mNames.clear();
+}
+
+void ExternalJoin::finishIndex(){
+    writeRun();
+    vector<ExternalJoinEntry>().swap(mEntries);
+    string().swap(mNames);
+
+    // The fewest partitions whose largest table, next to a buffer per run,
+    // fits in the budget
+    if(mRuns + 1 > EXTERNAL_JOIN_MAX_FILES)
+        error_exit("External join needs more than " + to_string(EXTERNAL_JOIN_MAX_FILES) + " runs; raise --max-memory");
+    size_t buffers = (mRuns + 1) * EXTERNAL_JOIN_FILE_BUFFER + mBuckets.size() * sizeof(size_t);
+    for(mPartitionBits = 0; ; mPartitionBits++) {
+        size_t partitions = (size_t)1 << mPartitionBits;
+        if(mPartitionBits > EXTERNAL_JOIN_BUCKET_BITS || partitions > EXTERNAL_JOIN_MAX_FILES || partitions * EXTERNAL_JOIN_FILE_BUFFER > mMaxBytes)
+            error_exit("External join can't fit the read index in --max-memory; raise it");
+        size_t perPartition = mBuckets.size() / partitions;
+        size_t largest = 0;
+        for(size_t b=0; b<mBuckets.size(); b+=perPartition) {
+            size_t count = 0;
+            for(size_t i=b; i<b+perPartition; i++)
+                count += mBuckets[i];
+            largest = max(largest, count);
+        }
+        if(ReadIndex::bytesFor(largest) + buffers <= mMaxBytes)
+            break;
+    }
+
+    mPartitionFiles.resize((size_t)1 << mPartitionBits);
+    for(size_t p=0; p<mPartitionFiles.size(); p++)
+        mPartitionFiles[p] = openSpill(partitionFile(p), "wb");
+}
+
+void ExternalJoin::addRead(uint64_t key, int nameLen, const FastqRecord& read, const FastqRecord* mate){
+    uint64_t hash = mix(key);
+    size_t p = partitionOf(hash);
+    FILE* fp = mPartitionFiles[p];
+    uint32_t len = nameLen;
+    mRecord.clear();
+    appendRecord(mRecord, read);
+    mMate.clear();
+    if(mate != NULL)
+        appendRecord(mMate, *mate);
+
+    string filename = partitionFile(p);
+    writeBytes(fp, &hash, sizeof(hash), filename);
+    writeBytes(fp, &len, sizeof(len), filename);
+    writeString(fp, mRecord, filename);
+    writeString(fp, mMate, filename);
+    mSpilledBytes += sizeof(hash) + sizeof(len) + 2 * sizeof(uint32_t) + mRecord.length() + mMate.length();
+}
+
+void ExternalJoin::nextEntry(RunCursor& cursor, size_t run){
+    string filename = runFile(run);
+    uint16_t nameLen;
+    cursor.valid = readBytes(cursor.fp, &cursor.hash, sizeof(cursor.hash), filename);
+    if(!cursor.valid)
+        return;
+    if(!readBytes(cursor.fp, &cursor.sampleId, sizeof(cursor.sampleId), filename) || !readBytes(cursor.fp, &nameLen, sizeof(nameLen), filename))
+        error_exit("Failed to read file: " + filename);
+    cursor.name.resize(nameLen);
+    if(nameLen > 0 && !readBytes(cursor.fp, &cursor.name[0], nameLen, filename))
+        error_exit("Failed to read file: " + filename);
+}
+
+void ExternalJoin::finish(int unassignedId, function<void(int, const string&, const string&)> emit){
+    // Each run is sorted by hash, so merging them gives the records of one
+    // partition after another, and those of a name in the order they came
+    // the buffers of the partition files are given back before any table
+    for(size_t p=0; p<mPartitionFiles.size(); p++) {
+        closeSpill(mPartitionFiles[p], partitionFile(p));
+        mPartitionFiles[p] = NULL;
+    }
+
+    vector<RunCursor> cursors(mRuns);
+    typedef pair<uint64_t, size_t> HeapItem;
+    priority_queue<HeapItem, vector<HeapItem>, greater<HeapItem> > heap;
+    for(size_t run=0; run<mRuns; run++) {
+        cursors[run].fp = openSpill(runFile(run), "rb");
+        nextEntry(cursors[run], run);
+        if(cursors[run].valid)
+            heap.push(make_pair(cursors[run].hash, run));
+    }
+
+    string record, mate;
+    for(size_t p=0; p<mPartitionFiles.size(); p++) {
+        size_t count = 0;
+        size_t perPartition = mBuckets.size() >> mPartitionBits;
+        for(size_t i=p*perPartition; i<(p+1)*perPartition; i++)
+            count += mBuckets[i];
+        ReadIndex table (count, mMaxBytes);
+
+        // a name seen more than once keeps its last sample, names that share
+        // a hash are kept by name
+        while(!heap.empty() && partitionOf(heap.top().first) == p) {
+            uint64_t hash = heap.top().first;
+            map<string, int> names;
+            int sampleId = -1;
+            string name;
+            while(!heap.empty() && heap.top().first == hash) {
+                size_t run = heap.top().second;
+                heap.pop();
+                RunCursor& cursor = cursors[run];
+                if(sampleId >= 0 && (!names.empty() || cursor.name != name)) {
+                    if(names.empty())
+                        names[name] = sampleId;
+                    names[cursor.name] = cursor.sampleId;
+                }
+                name = cursor.name;
+                sampleId = cursor.sampleId;
+                nextEntry(cursor, run);
+                if(cursor.valid)
+                    heap.push(make_pair(cursor.hash, run));
+            }
+            table.insert(hash, sampleId);
+            if(names.size() > 1) {
+                // names sharing the hash are looked up by name
+                table.markCollided(hash);
+                for(map<string, int>::iterator it = names.begin(); it != names.end(); ++it)
+                    table.resolve(it->first, it->second);
+                mCollisions++;
+            }
+        }
+        mTableBytes = max(mTableBytes, table.bytes());
+
+        string filename = partitionFile(p);
+        FILE* fp = openSpill(filename, "rb");
+        uint64_t hash;
+        uint32_t nameLen;
+        while(readBytes(fp, &hash, sizeof(hash), filename)) {
+            if(!readBytes(fp, &nameLen, sizeof(nameLen), filename))
+                error_exit("Failed to read file: " + filename);
+            readString(fp, record, filename);
+            readString(fp, mate, filename);
+            int sampleId = table.find(hash, record.data(), nameLen);
+            emit(sampleId < 0 ? unassignedId : sampleId, record, mate);
+        }
+        fclose(fp);
+        remove(filename.c_str());
+    }
+
+    for(size_t run=0; run<mRuns; run++) {
+        fclose(cursors[run].fp);
+        remove(runFile(run).c_str());
+    }
+}
+
+size_t ExternalJoin::maxBytes(){
+    return mMaxBytes;
+}
+
+size_t ExternalJoin::runs(){
+    return mRuns;
+}
+
+size_t ExternalJoin::partitions(){
+    return mPartitionFiles.size();
+}
+
+size_t ExternalJoin::collisions(){
+    return mCollisions;
+}
+
+size_t ExternalJoin::tableBytes(){
+    return mTableBytes;
+}
+
+size_t ExternalJoin::spilledBytes(){
+    return mSpilledBytes;
+}
@@ -0,0 +1,110 @@
+//
+//  externaljoin.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef EXTERNAL_JOIN_H
+#define EXTERNAL_JOIN_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include "fastqreader.h"
+#include "namecodec.h"
+
+using namespace std;
+
+// Buffer of each run and partition file
+#define EXTERNAL_JOIN_FILE_BUFFER (1<<16)
+
+// Most run or partition files open at once
+#define EXTERNAL_JOIN_MAX_FILES 512
+
+// Name key hashes are counted in this many buckets to size the partitions
+#define EXTERNAL_JOIN_BUCKET_BITS 12
+
+// A record of a run before it is written, sorted by hash
+struct ExternalJoinEntry {
+    uint64_t hash;
+    // where the name starts, or the record number for packed names
+    uint32_t nameOffset;
+    uint16_t nameLen;
+    uint16_t sampleId;
+};
+
+// Join of index assignments and reads through files on disk, for index and
+// reads files in different orders that don't fit in memory.
+// The index pass collects (key, sample id) records up to the memory budget,
+// sorts them by a hash of the key and writes each batch as a run next to the
+// outputs. The hash range is then cut into partitions small enough that one
+// partition's records fit in a ReadIndex, and the reads pass appends each
+// read to the partition file of its key. finish() merges the runs one
+// partition at a time, so every file is read and written once, front to back.
+// Hashed names are kept in the runs too, to tell apart names that share a key.
+class ExternalJoin{
+public:
+    // maxBytes is the budget for records, tables and file buffers
+    ExternalJoin(size_t maxBytes, string spillPrefix);
+    ~ExternalJoin();
+
+    // key of the name from NameCodec, name up to the first space; later
+    // records of the same name replace earlier ones
+    void addIndex(uint64_t key, const char* name, int len, int sampleId);
+    // end of the index pass: writes the last run and picks the partitions
+    void finishIndex();
+    // the read, and its mate which may be NULL, whose name has this key
+    void addRead(uint64_t key, int nameLen, const FastqRecord& read, const FastqRecord* mate);
+    // emit(sampleId, record, mate) for every read, partition by partition;
+    // mate is empty for single-end reads
+    void finish(int unassignedId, function<void(int, const string&, const string&)> emit);
+
+    size_t maxBytes();
+    size_t runs();
+    size_t partitions();
+    size_t collisions();
+    // largest table of a partition
+    size_t tableBytes();
+    size_t spilledBytes();
+
+private:
+    // next record of a run while the runs are merged
+    struct RunCursor {
+        FILE* fp;
+        uint64_t hash;
+        uint16_t sampleId;
+        string name;
+        bool valid;
+    };
+
+    void writeRun();
+    void nextEntry(RunCursor& cursor, size_t run);
+    size_t partitionOf(uint64_t hash);
+    string runFile(size_t run);
+    string partitionFile(size_t partition);
+    FILE* openSpill(string filename, const char* mode);
+    void closeSpill(FILE* fp, string filename);
+
+    static uint64_t mix(uint64_t key);
+
+private:
+    size_t mMaxBytes;
+    string mSpillPrefix;
+    vector<ExternalJoinEntry> mEntries;
+    string mNames;
+    size_t mRunBytes;
+    size_t mRuns;
+    vector<size_t> mBuckets;
+    int mPartitionBits;
+    vector<FILE*> mPartitionFiles;
+    string mRecord;
+    string mMate;
+    size_t mCollisions;
+    size_t mTableBytes;
+    size_t mSpilledBytes;
+};
+
+#endif
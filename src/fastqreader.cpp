@@ -24,13 +24,25 @@
 
 #include "fastqreader.h"
 #include "util.h"
+#include "linescanner.h"
 #include <string.h>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
 #define FQ_BUF_SIZE (1<<20)
+// mapped pages further than this behind the cursor are released
+#define FQ_DROP_BEHIND (64<<20)
+// bytes of the mapping split into records per scan
+#define FQ_SCAN_BLOCK (1<<20)
 
-FastqReader::FastqReader(string filename, bool hasQuality, bool phred64){
+// input bytes consumed by all readers, counted a block at a time
+static atomic<size_t> sBytesRead (0);
+
+FastqReader::FastqReader(string filename, bool hasQuality, bool phred64, int threads){
     mFilename = filename;
     mFile = NULL;
     mStdinMode = false;
@@ -39,7 +51,23 @@ FastqReader::FastqReader(string filename, bool hasQuality, bool phred64){
     mBuf = new char[FQ_BUF_SIZE];
     mBufDataLen = 0;
     mBufUsedLen = 0;
+    mBufFilled = false;
     mHasNoLineBreakAtEnd = false;
+    mThreads = threads;
+    mGzip = NULL;
+    mGzipCounted = 0;
+    mFileSize = 0;
+    mMapped = false;
+    mMap = NULL;
+    mMapLen = 0;
+    mCursor = 0;
+    mDropped = 0;
+    mRecordIndex = 0;
+    mRecordOffset = 0;
+    mRangeStart = 0;
+    mRangeEnd = 0;
+    mRecordsLeft = -1;
+    mScanBlock = FQ_SCAN_BLOCK;
     init();
 }
 
@@ -54,12 +82,20 @@ bool FastqReader::hasNoLineBreakAtEnd() {
 
 void FastqReader::readToBuf() {
     
-    mBufDataLen = fread(mBuf, 1, FQ_BUF_SIZE, mFile);
+    if(mGzip) {
+        mBufDataLen = mGzip->read(mBuf, FQ_BUF_SIZE);
+        // the compressed bytes, as they were read from the disk
+        sBytesRead += mGzip->bytesRead() - mGzipCounted;
+        mGzipCounted = mGzip->bytesRead();
+    } else {
+        mBufDataLen = fread(mBuf, 1, FQ_BUF_SIZE, mFile);
+        sBytesRead += mBufDataLen;
+    }
 
     mBufUsedLen = 0;
 
     if(mBufDataLen < FQ_BUF_SIZE) {
-        if(mBuf[mBufDataLen-1] != '\n')
+        if(mBufDataLen > 0 && mBuf[mBufDataLen-1] != '\n')
             mHasNoLineBreakAtEnd = true;
     }
 }
@@ -74,18 +110,167 @@ void FastqReader::init(){
     if(mFile == NULL) {
         error_exit("Failed to open file: " + mFilename);
     }
-    
-    readToBuf();
+
+    // kept for getBytes(), pipes and stdin have no size
+    struct stat st;
+    if(fstat(fileno(mFile), &st) == 0 && S_ISREG(st.st_mode))
+        mFileSize = st.st_size;
+
+    // gzip is detected by its magic bytes, whatever the file is called
+    if(GzipReader::isGzip(mFile))
+        mGzip = new GzipReader(mFile, mFilename, mThreads);
+    else if(mFile != stdin)
+        mapFile();
+}
+
+// Map regular files, pipes and stdin keep using the fread() buffer
+bool FastqReader::mapFile(){
+    struct stat st;
+    if(fstat(fileno(mFile), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return false;
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(mFile), 0);
+    if(map == MAP_FAILED)
+        return false;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    mMap = (char*)map;
+    mMapLen = st.st_size;
+    mCursor = 0;
+    mDropped = 0;
+    mRangeStart = 0;
+    mRangeEnd = mMapLen;
+    mMapped = true;
+    if(mMap[mMapLen-1] != '\n')
+        mHasNoLineBreakAtEnd = true;
+    return true;
+}
+
+bool FastqReader::isMapped(){
+    return mMapped;
+}
+
+bool FastqReader::isGzipped(){
+    return mGzip != NULL;
+}
+
+// Pages already parsed are only faulted back in if a view into them is used
+// again, so releasing them is safe and keeps the resident set small
+void FastqReader::dropConsumed(){
+    if(mCursor - mDropped < 2 * (size_t)FQ_DROP_BEHIND)
+        return;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t upTo = (mCursor - FQ_DROP_BEHIND) / page * page;
+    madvise(mMap + mDropped, upTo - mDropped, MADV_DONTNEED);
+    mDropped = upTo;
+}
+
+// Split the next block of the mapping into records. A record cut off at the
+// end of the block is scanned again at the start of the next one.
+bool FastqReader::scanBlock(){
+    mRecords.clear();
+    mRecordIndex = 0;
+    size_t counted = min(mCursor, mRangeEnd);
+    while(mRecords.empty() && mCursor < mMapLen) {
+        size_t block = min(mScanBlock, mMapLen - mCursor);
+        bool final = mCursor + block == mMapLen;
+        size_t used = scanRecords(mMap + mCursor, block, final, mHasQuality ? 4 : 3, mBreaks, mRecords);
+        if(used == 0 && !final) {
+            // not even one record fits, try a larger block
+            if(mScanBlock >= ((size_t)1<<31))
+                error_exit("FASTQ record too long in file: " + mFilename);
+            mScanBlock *= 2;
+            continue;
+        }
+        mBlockStart = mCursor;
+        mCursor += final ? block : used;
+    }
+    sBytesRead += min(mCursor, mRangeEnd) - counted;
+    dropConsumed();
+    return !mRecords.empty();
+}
+
+// Start of the line after the one at pos, len is set to the length of the
+// line at pos without its line break
+size_t FastqReader::nextLine(size_t pos, size_t& len){
+    len = findLineBreak(mMap + pos, mMapLen - pos);
+    size_t next = pos + len;
+    if(next < mMapLen && mMap[next] == '\r')
+        next++;
+    if(next < mMapLen && mMap[next] == '\n')
+        next++;
+    return next;
+}
+
+// First record starting at or after pos. A quality line can start with '@'
+// too, so a name line is only taken as one if the line two below it starts
+// with '+' (below a quality line is a name and then a sequence) and the
+// quality line is as long as the sequence
+size_t FastqReader::findRecordStart(size_t pos){
+    if(pos == 0 || pos >= mMapLen)
+        return min(pos, mMapLen);
+
+    size_t len;
+    bool lineStart = mMap[pos-1] == '\n' || (mMap[pos-1] == '\r' && mMap[pos] != '\n');
+    if(!lineStart)
+        pos = nextLine(pos, len);
+
+    while(pos < mMapLen) {
+        size_t starts[4], lens[4];
+        size_t line = pos;
+        int lines = 0;
+        for(; lines < 4 && line < mMapLen; lines++) {
+            starts[lines] = line;
+            line = nextLine(line, lens[lines]);
+        }
+        if(lines == 4 && mMap[pos] == '@' && lens[2] > 0 && mMap[starts[2]] == '+' && lens[1] == lens[3])
+            return pos;
+        pos = lines > 1 ? starts[1] : mMapLen;
+    }
+    return mMapLen;
+}
+
+bool FastqReader::setRange(size_t start, size_t end){
+    if(!mMapped || !mHasQuality)
+        return false;
+
+    mRangeStart = findRecordStart(start);
+    mRangeEnd = max(mRangeStart, findRecordStart(end));
+    mCursor = mRangeStart;
+    mRecords.clear();
+    mRecordIndex = 0;
+    size_t page = sysconf(_SC_PAGESIZE);
+    mDropped = mCursor / page * page;
+    return true;
+}
+
+void FastqReader::setRecordRange(long first, long count){
+    FastqRecord rec;
+    for(long i=0; i<first && next(rec); i++)
+        ;
+    mRecordsLeft = count;
+}
+
+size_t FastqReader::recordOffset(){
+    return mRecordOffset;
 }
 
 void FastqReader::getBytes(size_t& bytesRead, size_t& bytesTotal) {
 
-    bytesRead = ftell(mFile);//mFile.tellg();
+    if(mMapped) {
+        // relative to the range when the file is split
+        bytesRead = min(mCursor, mRangeEnd) - mRangeStart;
+        bytesTotal = mRangeEnd - mRangeStart;
+        return;
+    }
+    if(mGzip) {
+        bytesRead = mGzip->bytesRead();
+        bytesTotal = mGzip->bytesTotal();
+        return;
+    }
 
-    // use another ifstream to not affect current reader
-    ifstream is(mFilename);
-    is.seekg (0, is.end);
-    bytesTotal = is.tellg();
+    bytesRead = ftell(mFile);//mFile.tellg();
+    bytesTotal = mFileSize;
 }
 
 void FastqReader::clearLineBreaks(char* line) {
@@ -102,19 +287,10 @@ void FastqReader::clearLineBreaks(char* line) {
 }
 
 string FastqReader::getLine(){
-    static int c=0;
-    c++;
     int copied = 0;
 
     int start = mBufUsedLen;
-    int end = start;
-
-    while(end < mBufDataLen) {
-        if(mBuf[end] != '\r' && mBuf[end] != '\n')
-            end++;
-        else
-            break;
-    }
+    int end = start + findLineBreak(mBuf + start, mBufDataLen - start);
 
     // this line well contained in this buf, or this is the last buf
     if(end < mBufDataLen || mBufDataLen < FQ_BUF_SIZE) {
@@ -138,13 +314,7 @@ string FastqReader::getLine(){
     while(true) {
         readToBuf();
         start = 0;
-        end = 0;
-        while(end < mBufDataLen) {
-            if(mBuf[end] != '\r' && mBuf[end] != '\n')
-                end++;
-            else
-                break;
-        }
+        end = findLineBreak(mBuf, mBufDataLen);
         // this line well contained in this buf, we need to read new buf
         if(end < mBufDataLen || mBufDataLen < FQ_BUF_SIZE) {
             int len = end - start;
@@ -168,61 +338,205 @@ string FastqReader::getLine(){
 
 bool FastqReader::eof() {
 
+    if(mMapped)
+        return mCursor >= mMapLen && mRecordIndex >= mRecords.size();
+    if(mGzip)
+        return mGzip->eof();
     return feof(mFile);//mFile.eof();
 }
 
-Read* FastqReader::read(){
+bool FastqReader::next(FastqRecord& rec){
 
-    if(mBufUsedLen >= mBufDataLen && eof()) {
-        return NULL;
+    if(mRecordsLeft == 0)
+        return false;
+    if(mRecordsLeft > 0)
+        mRecordsLeft--;
+
+    if(!mMapped) {
+        // buffered backend, the views point at the copies in mLines
+        if(!mBufFilled) {
+            readToBuf();
+            mBufFilled = true;
+        }
+        if(mBufUsedLen >= mBufDataLen && eof())
+            return false;
+
+        mLines[0] = getLine();
+        // name should start with @
+        while((mLines[0].empty() && !(mBufUsedLen >= mBufDataLen && eof())) || (!mLines[0].empty() && mLines[0][0]!='@')){
+            mLines[0] = getLine();
+        }
+        if(mLines[0].empty())
+            return false;
+
+        mLines[1] = getLine();
+        mLines[2] = getLine();
+        if(mHasQuality)
+            mLines[3] = getLine();
+        else
+            mLines[3] = string(mLines[1].length(), 'K');
+
+        rec.name = mLines[0].data();
+        rec.nameLen = mLines[0].length();
+        rec.seq = mLines[1].data();
+        rec.seqLen = mLines[1].length();
+        rec.strand = mLines[2].data();
+        rec.strandLen = mLines[2].length();
+        rec.quality = mLines[3].data();
+        rec.qualityLen = mLines[3].length();
+    } else {
+        if(mRecordIndex >= mRecords.size() && !scanBlock())
+            return false;
+
+        const RecordOffsets& offsets = mRecords[mRecordIndex++];
+        if(mBlockStart + offsets.start[0] >= mRangeEnd) {
+            // first record of the next range
+            mRecords.clear();
+            mRecordIndex = 0;
+            mCursor = mMapLen;
+            return false;
+        }
+        mRecordOffset = mBlockStart + offsets.start[0];
+        const char* base = mMap + mBlockStart;
+        rec.name = base + offsets.start[0];
+        rec.nameLen = offsets.len[0];
+        rec.seq = base + offsets.start[1];
+        rec.seqLen = offsets.len[1];
+        rec.strand = base + offsets.start[2];
+        rec.strandLen = offsets.len[2];
+        if(mHasQuality) {
+            rec.quality = base + offsets.start[3];
+            rec.qualityLen = offsets.len[3];
+        } else {
+            mLines[3] = string(rec.seqLen, 'K');
+            rec.quality = mLines[3].data();
+            rec.qualityLen = rec.seqLen;
+        }
     }
 
-    string name = getLine();
-    // name should start with @
-    while((name.empty() && !(mBufUsedLen >= mBufDataLen && eof())) || (!name.empty() && name[0]!='@')){
-        name = getLine();
+    if(rec.qualityLen != rec.seqLen) {
+        cerr << "ERROR: sequence and quality have different length:" << endl;
+        cerr << string(rec.name, rec.nameLen) << endl;
+        cerr << string(rec.seq, rec.seqLen) << endl;
+        cerr << string(rec.strand, rec.strandLen) << endl;
+        cerr << string(rec.quality, rec.qualityLen) << endl;
+        return false;
     }
+    return true;
+}
 
-    if(name.empty())
-        return NULL;
+Read* FastqReader::read(){
 
-    string sequence = getLine();
-    string strand = getLine();
-
-    // WAR for FQ with no quality
-    if (!mHasQuality){
-        string quality = string(sequence.length(), 'K');
-        return new Read(name, sequence, strand, quality, mPhred64);
-    }
-    else {
-        string quality = getLine();
-        if(quality.length() != sequence.length()) {
-            cerr << "ERROR: sequence and quality have different length:" << endl;
-            cerr << name << endl;
-            cerr << sequence << endl;
-            cerr << strand << endl;
-            cerr << quality << endl;
-            return NULL;
-        }
-        return new Read(name, sequence, strand, quality, mPhred64);
-    }
+    FastqRecord rec;
+    if(!next(rec))
+        return NULL;
 
-    return NULL;
+    return new Read(string(rec.name, rec.nameLen), string(rec.seq, rec.seqLen),
+        string(rec.strand, rec.strandLen), string(rec.quality, rec.qualityLen), mPhred64);
 }
 
 void FastqReader::close(){
 
+    if (mMapped){
+        munmap(mMap, mMapLen);
+        mMap = NULL;
+        mMapped = false;
+    }
+    if (mGzip){
+        delete mGzip;
+        mGzip = NULL;
+    }
     if (mFile){
         fclose(mFile);//mFile.close();
         mFile = NULL;
     }
 }
 
+size_t FastqReader::totalBytesRead(){
+    return sBytesRead;
+}
+
 bool FastqReader::isFastq(string filename) {
     if (ends_with(filename, ".fastq"))
         return true;
     else if (ends_with(filename, ".fq"))
         return true;
+    else if (ends_with(filename, ".fastq.gz"))
+        return true;
+    else if (ends_with(filename, ".fq.gz"))
+        return true;
+    else
+        return false;
+}
+
+FastqReaderPair::FastqReaderPair(FastqReader* left, FastqReader* right){
+    mLeft = left;
+    mRight = right;
+    mInterleaved = false;
+}
+
+FastqReaderPair::FastqReaderPair(string leftName, string rightName, bool hasQuality, bool phred64, bool interleaved, int threads){
+    mInterleaved = interleaved;
+    mLeft = new FastqReader(leftName, hasQuality, phred64, threads);
+    if(mInterleaved)
+        mRight = NULL;
+    else
+        mRight = new FastqReader(rightName, hasQuality, phred64, threads);
+}
+
+FastqReaderPair::~FastqReaderPair(){
+    if(mLeft){
+        delete mLeft;
+        mLeft = NULL;
+    }
+    if(mRight){
+        delete mRight;
+        mRight = NULL;
+    }
+}
+
+ReadPair* FastqReaderPair::read(){
+    Read* l = mLeft->read();
+    Read* r = NULL;
+    if(mInterleaved)
+        r = mLeft->read();
     else
+        r = mRight->read();
+
+    if(l == NULL && r == NULL)
+        return NULL;
+
+    // one file ran out before the other, the two are not in lockstep
+    if(l == NULL || r == NULL) {
+        delete l;
+        delete r;
+        error_exit("Paired files have a different number of reads");
+    }
+
+    return new ReadPair(l, r);
+}
+
+bool FastqReaderPair::next(FastqRecord& left, FastqRecord& right){
+    bool hasLeft = mLeft->next(left);
+    bool hasRight = mInterleaved ? mLeft->next(right) : mRight->next(right);
+
+    if(!hasLeft && !hasRight)
         return false;
+
+    // one file ran out before the other, the two are not in lockstep
+    if(!hasLeft || !hasRight)
+        error_exit("Paired files have a different number of reads");
+
+    return true;
+}
+
+void appendRecord(string& out, const FastqRecord& rec){
+    out.append(rec.name, rec.nameLen);
+    out.push_back('\n');
+    out.append(rec.seq, rec.seqLen);
+    out.push_back('\n');
+    out.append(rec.strand, rec.strandLen);
+    out.push_back('\n');
+    out.append(rec.quality, rec.qualityLen);
+    out.push_back('\n');
 }
@@ -28,25 +28,60 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "read.h"
+#include "linescanner.h"
+#include "gzipreader.h"
 #include <iostream>
 #include <fstream>
 
 using namespace std;
 
+// One FASTQ record as pointer + length views, valid until the next call to
+// FastqReader::next() (or for as long as the reader is open when mapped)
+struct FastqRecord{
+    const char* name;
+    int nameLen;
+    const char* seq;
+    int seqLen;
+    const char* strand;
+    int strandLen;
+    const char* quality;
+    int qualityLen;
+};
+
+// the four lines of the record, appended to out
+void appendRecord(string& out, const FastqRecord& rec);
+
 class FastqReader{
 public:
-    FastqReader(string filename, bool hasQuality = true, bool phred64=false);
+    // threads is the size of the decompression pool for gzip input
+    FastqReader(string filename, bool hasQuality = true, bool phred64=false, int threads = 1);
     ~FastqReader();
 
+    // bytesTotal is that of the range when the file is split, 0 for pipes
     void getBytes(size_t& bytesRead, size_t& bytesTotal);
 
     //this function is not thread-safe
     //do not call read() of a same FastqReader object from different threads concurrently
     Read* read();
+    // zero-copy alternative to read(), false at the end of input
+    bool next(FastqRecord& rec);
+    // limit a mapped file to the records that start in [start, end), both ends
+    // moved forward to the next record; call before the first next()
+    // false if the input can only be read from the start (gzip, pipes)
+    bool setRange(size_t start, size_t end);
+    // skip the first records and stop count records later, for inputs that can
+    // not be split by bytes; call before the first next()
+    void setRecordRange(long first, long count);
+    // byte offset of the record last returned by next(), mapped files only
+    size_t recordOffset();
     bool eof();
+    bool isMapped();
+    bool isGzipped();
     bool hasNoLineBreakAtEnd();
 
 public:
+    // bytes of input consumed by every reader of the process so far
+    static size_t totalBytesRead();
     static bool isFastq(string filename);
     static bool test();
 
@@ -54,8 +89,13 @@ private:
     void init();
     void close();
     string getLine();
+    bool scanBlock();
+    size_t nextLine(size_t pos, size_t& len);
+    size_t findRecordStart(size_t pos);
     void clearLineBreaks(char* line);
     void readToBuf();
+    bool mapFile();
+    void dropConsumed();
 
 private:
     string mFilename;
@@ -65,17 +105,47 @@ private:
     char* mBuf;
     int mBufDataLen;
     int mBufUsedLen;
+    // filled on the first next(), so its bytes count toward the stage that
+    // reads the records, not the one that opened the file
+    bool mBufFilled;
     bool mStdinMode;
     bool mHasNoLineBreakAtEnd;
+    int mThreads;
+    // gzip input is inflated into mBuf
+    GzipReader* mGzip;
+    size_t mGzipCounted;
+    // size of a regular file, taken when it is opened
+    size_t mFileSize;
+    // regular files are memory-mapped instead of read through mBuf
+    bool mMapped;
+    char* mMap;
+    size_t mMapLen;
+    size_t mCursor;
+    size_t mDropped;
+    // records of the block at mBlockStart, scanned ahead of next()
+    size_t mBlockStart;
+    size_t mScanBlock;
+    vector<uint32_t> mBreaks;
+    vector<RecordOffsets> mRecords;
+    size_t mRecordIndex;
+    size_t mRecordOffset;
+    // byte range set by setRange(), the whole mapping by default
+    size_t mRangeStart;
+    size_t mRangeEnd;
+    // records still to be returned after setRecordRange(), -1 for no limit
+    long mRecordsLeft;
+    // backing store for the views of the buffered backend
+    string mLines[4];
 
 };
 
 class FastqReaderPair{
 public:
     FastqReaderPair(FastqReader* left, FastqReader* right);
-    FastqReaderPair(string leftName, string rightName, bool hasQuality = true, bool phred64 = false, bool interleaved = false);
+    FastqReaderPair(string leftName, string rightName, bool hasQuality = true, bool phred64 = false, bool interleaved = false, int threads = 1);
     ~FastqReaderPair();
     ReadPair* read();
+    bool next(FastqRecord& left, FastqRecord& right);
 public:
     FastqReader* mLeft;
     FastqReader* mRight;
@@ -0,0 +1,401 @@
+//
+//  gzipreader.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "gzipreader.h"
+#include "util.h"
+#include <string.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// a job inflating to more than this is left to the sequential decoder
+#define GZ_JOB_MAX_OUT (64 * GZ_JOB_SIZE)
+// speculative member starts that did not line up before giving up on them
+#define GZ_MAX_FAILED_JOBS 4
+// mapped pages further than this behind the cursor are released
+#define GZ_DROP_BEHIND (64<<20)
+
+GzipReader::GzipReader(FILE* file, string filename, int threads){
+    mFilename = filename;
+    mFile = file;
+    mThreads = threads > 1 ? threads : 1;
+    mBgzf = false;
+    mFinished = false;
+    mMap = NULL;
+    mMapLen = 0;
+    mDropped = 0;
+    mPos = 0;
+    mCutPos = 0;
+    mStreaming = true;
+    mStreamOpen = false;
+    mIn = NULL;
+    mPendingUsed = 0;
+    mQueue = NULL;
+    mFailedJobs = 0;
+
+    if(!mapFile()) {
+        mIn = new char[GZ_JOB_SIZE];
+        return;
+    }
+    detectBgzf();
+    if(mThreads > 1) {
+        mStreaming = false;
+        mQueue = new BoundedQueue<GzipJob*>(mThreads * GZ_JOBS_PER_THREAD);
+        for(int t=0; t<mThreads; t++)
+            mWorkers.push_back(thread(&GzipReader::worker, this));
+    }
+}
+
+GzipReader::~GzipReader(){
+    if(mQueue) {
+        {
+            lock_guard<mutex> lock(mMtx);
+            for(size_t j=0; j<mJobs.size(); j++)
+                mJobs[j]->ok = false;
+        }
+        mQueue->close();
+        for(size_t t=0; t<mWorkers.size(); t++)
+            mWorkers[t].join();
+        for(size_t j=0; j<mJobs.size(); j++)
+            delete mJobs[j];
+        delete mQueue;
+    }
+    if(mStreamOpen)
+        inflateEnd(&mStream);
+    if(mMap)
+        munmap(mMap, mMapLen);
+    delete[] mIn;
+}
+
+// gzip starts with 0x1f 0x8b, FASTQ with '@'; the second byte is checked by zlib
+bool GzipReader::isGzip(FILE* file){
+    int c = getc(file);
+    if(c == EOF)
+        return false;
+    ungetc(c, file);
+    return c == 0x1f;
+}
+
+bool GzipReader::mapFile(){
+    struct stat st;
+    if(fstat(fileno(mFile), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return false;
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(mFile), 0);
+    if(map == MAP_FAILED)
+        return false;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    mMap = (char*)map;
+    mMapLen = st.st_size;
+    return true;
+}
+
+void GzipReader::detectBgzf(){
+    mBgzf = bgzfBlockSize(0) > 0;
+}
+
+// Size of the BGZF block at pos, taken from its BC extra subfield, 0 if
+// there is no complete BGZF block there
+size_t GzipReader::bgzfBlockSize(size_t pos){
+    const unsigned char* p = (const unsigned char*)mMap + pos;
+    if(pos + 18 > mMapLen || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4))
+        return 0;
+
+    size_t xlen = p[10] | (p[11] << 8);
+    if(pos + 12 + xlen > mMapLen)
+        return 0;
+    for(size_t x=12; x + 4 <= 12 + xlen; ) {
+        size_t slen = p[x+2] | (p[x+3] << 8);
+        if(p[x] == 'B' && p[x+1] == 'C' && slen == 2 && x + 6 <= 12 + xlen) {
+            size_t size = (p[x+4] | (p[x+5] << 8)) + 1;
+            if(pos + size > mMapLen)
+                return 0;
+            return size;
+        }
+        x += 4 + slen;
+    }
+    return 0;
+}
+
+// First offset from pos that looks like the start of a gzip member
+size_t GzipReader::nextMemberCandidate(size_t pos){
+    while(pos + 4 <= mMapLen) {
+        const char* hit = (const char*)memchr(mMap + pos, 0x1f, mMapLen - pos - 3);
+        if(hit == NULL)
+            break;
+        pos = hit - mMap;
+        const unsigned char* p = (const unsigned char*)hit;
+        if(p[1] == 0x8b && p[2] == 8 && (p[3] & 0xe0) == 0)
+            return pos;
+        pos++;
+    }
+    return mMapLen;
+}
+
+// Queue jobs of whole members from mCutPos until the window is full
+void GzipReader::cutJobs(){
+    while(mJobs.size() < (size_t)mThreads * GZ_JOBS_PER_THREAD && mCutPos < mMapLen) {
+        size_t end = mCutPos;
+        if(mBgzf) {
+            while(end < mMapLen && end - mCutPos < GZ_JOB_SIZE) {
+                size_t size = bgzfBlockSize(end);
+                if(size == 0)
+                    break;
+                end += size;
+            }
+            // not a BGZF block, let the sequential decoder report it
+            if(end == mCutPos) {
+                mCutPos = mMapLen;
+                break;
+            }
+        } else {
+            if(mFailedJobs >= GZ_MAX_FAILED_JOBS)
+                break;
+            end = mCutPos + GZ_JOB_SIZE < mMapLen ? nextMemberCandidate(mCutPos + GZ_JOB_SIZE) : mMapLen;
+            // most likely one large member, which only inflates sequentially
+            if(end == mMapLen && end - mCutPos > 4 * GZ_JOB_SIZE)
+                break;
+        }
+
+        GzipJob* job = new GzipJob();
+        job->start = mCutPos;
+        job->end = end;
+        job->ok = true;
+        job->done = false;
+        mJobs.push_back(job);
+        mQueue->push(job);
+        mCutPos = end;
+    }
+}
+
+void GzipReader::worker(){
+    GzipJob* job;
+    while(mQueue->pop(job)) {
+        bool wanted;
+        {
+            lock_guard<mutex> lock(mMtx);
+            wanted = job->ok;
+        }
+        bool ok = wanted && inflateJob(mMap, job);
+
+        lock_guard<mutex> lock(mMtx);
+        job->ok = ok;
+        job->done = true;
+        mDone.notify_all();
+    }
+}
+
+// Inflate the members in [start, end). Fails unless the last member ends
+// exactly at end, which is how a wrong member start is caught.
+bool GzipReader::inflateJob(const char* data, GzipJob* job){
+    z_stream s;
+    memset(&s, 0, sizeof(s));
+    if(inflateInit2(&s, 16 + MAX_WBITS) != Z_OK)
+        return false;
+
+    s.next_in = (Bytef*)(data + job->start);
+    s.avail_in = job->end - job->start;
+    job->out.resize(min(4 * (job->end - job->start) + (1<<16), (size_t)GZ_JOB_MAX_OUT));
+    size_t produced = 0;
+    bool ok = false;
+    while(true) {
+        if(job->out.size() - produced < (1<<16)) {
+            if(job->out.size() >= GZ_JOB_MAX_OUT)
+                break;
+            job->out.resize(2 * job->out.size());
+        }
+        s.next_out = (Bytef*)&job->out[produced];
+        s.avail_out = job->out.size() - produced;
+        int ret = inflate(&s, Z_NO_FLUSH);
+        produced = job->out.size() - s.avail_out;
+        if(ret == Z_STREAM_END) {
+            if(s.avail_in == 0) {
+                ok = true;
+                break;
+            }
+            inflateReset(&s);
+        } else if(ret != Z_OK) {
+            break;
+        }
+    }
+    inflateEnd(&s);
+    job->out.resize(ok ? produced : 0);
+    return ok;
+}
+
+// (Re)start sequential decoding at mPos
+void GzipReader::startStream(){
+    if(!mStreamOpen) {
+        memset(&mStream, 0, sizeof(mStream));
+        if(inflateInit2(&mStream, 16 + MAX_WBITS) != Z_OK)
+            error_exit("Failed to initialize zlib for file: " + mFilename);
+        mStreamOpen = true;
+    } else {
+        inflateReset(&mStream);
+    }
+    if(mMap) {
+        mStream.next_in = (Bytef*)(mMap + mPos);
+        mStream.avail_in = 0;
+    }
+}
+
+size_t GzipReader::inflateStream(char* buf, size_t len){
+    if(mStream.avail_in == 0) {
+        if(mMap) {
+            if(mPos >= mMapLen)
+                error_exit("Truncated gzip file: " + mFilename);
+            mStream.next_in = (Bytef*)(mMap + mPos);
+            mStream.avail_in = min(mMapLen - mPos, (size_t)1<<30);
+        } else {
+            size_t n = fread(mIn, 1, GZ_JOB_SIZE, mFile);
+            if(n == 0) {
+                // the input ends here, which is only fine between members
+                if(mStream.total_in != 0)
+                    error_exit("Truncated gzip file: " + mFilename);
+                mFinished = true;
+                return 0;
+            }
+            mStream.next_in = (Bytef*)mIn;
+            mStream.avail_in = n;
+        }
+    }
+
+    size_t availIn = mStream.avail_in;
+    mStream.next_out = (Bytef*)buf;
+    mStream.avail_out = min(len, (size_t)UINT_MAX);
+    size_t availOut = mStream.avail_out;
+    int ret = inflate(&mStream, Z_NO_FLUSH);
+    mPos += availIn - mStream.avail_in;
+    size_t produced = availOut - mStream.avail_out;
+
+    if(ret == Z_STREAM_END) {
+        // keep the rest of the input for the next member
+        Bytef* nextIn = mStream.next_in;
+        uInt availRest = mStream.avail_in;
+        inflateReset(&mStream);
+        mStream.next_in = nextIn;
+        mStream.avail_in = availRest;
+
+        if(mMap) {
+            if(mPos >= mMapLen) {
+                mFinished = true;
+            } else if(mQueue) {
+                // jobs behind mPos were decoded here, drop them
+                while(!mJobs.empty() && mJobs.front()->start < mPos) {
+                    GzipJob* job = mJobs.front();
+                    unique_lock<mutex> lock(mMtx);
+                    job->ok = false;
+                    mDone.wait(lock, [job]{ return job->done; });
+                    lock.unlock();
+                    mJobs.pop_front();
+                    delete job;
+                }
+                // a member boundary, hand back to the thread pool
+                if(mJobs.empty() ? mFailedJobs < GZ_MAX_FAILED_JOBS || mBgzf : mJobs.front()->start == mPos) {
+                    if(mJobs.empty())
+                        mCutPos = mPos;
+                    mStreaming = false;
+                }
+            }
+            dropConsumed();
+        }
+    } else if(ret == Z_BUF_ERROR) {
+        // no progress without more input, refilled on the next call
+        if(mStream.avail_in != 0)
+            error_exit("Corrupt gzip file: " + mFilename);
+    } else if(ret != Z_OK) {
+        error_exit("Corrupt gzip file: " + mFilename + (mStream.msg ? string(" (") + mStream.msg + ")" : ""));
+    }
+    return produced;
+}
+
+size_t GzipReader::read(char* buf, size_t len){
+    size_t filled = 0;
+    while(filled < len) {
+        if(mPendingUsed < mPending.size()) {
+            size_t n = min(len - filled, mPending.size() - mPendingUsed);
+            memcpy(buf + filled, mPending.data() + mPendingUsed, n);
+            mPendingUsed += n;
+            filled += n;
+            continue;
+        }
+        if(mFinished)
+            break;
+
+        if(mStreaming) {
+            if(!mStreamOpen)
+                startStream();
+            filled += inflateStream(buf + filled, len - filled);
+            continue;
+        }
+
+        cutJobs();
+        if(mJobs.empty()) {
+            if(mPos >= mMapLen) {
+                mFinished = true;
+            } else {
+                mStreaming = true;
+                startStream();
+            }
+            continue;
+        }
+
+        GzipJob* job = mJobs.front();
+        {
+            unique_lock<mutex> lock(mMtx);
+            mDone.wait(lock, [job]{ return job->done; });
+        }
+        mJobs.pop_front();
+        if(job->ok) {
+            mPending.swap(job->out);
+            mPendingUsed = 0;
+            mPos = job->end;
+            mFailedJobs = 0;
+            if(mPos >= mMapLen)
+                mFinished = true;
+            dropConsumed();
+        } else {
+            // the job did not line up with a member end, decode from mPos here
+            mFailedJobs++;
+            mStreaming = true;
+            startStream();
+        }
+        delete job;
+    }
+    return filled;
+}
+
+bool GzipReader::eof(){
+    return mFinished && mPendingUsed >= mPending.size();
+}
+
+size_t GzipReader::bytesRead(){
+    return mPos;
+}
+
+size_t GzipReader::bytesTotal(){
+    return mMapLen;
+}
+
+bool GzipReader::isBgzf(){
+    return mBgzf;
+}
+
+bool GzipReader::isParallel(){
+    return mQueue != NULL;
+}
+
+void GzipReader::dropConsumed(){
+    if(mPos - mDropped < 2 * (size_t)GZ_DROP_BEHIND)
+        return;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t upTo = (mPos - GZ_DROP_BEHIND) / page * page;
+    madvise(mMap + mDropped, upTo - mDropped, MADV_DONTNEED);
+    mDropped = upTo;
+}
@@ -0,0 +1,105 @@
+//
+//  gzipreader.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef GZIP_READER_H
+#define GZIP_READER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <zlib.h>
+#include "boundedqueue.h"
+
+using namespace std;
+
+// Compressed bytes inflated by one job of the thread pool
+#define GZ_JOB_SIZE (1<<20)
+
+// Jobs in flight per decompression thread
+#define GZ_JOBS_PER_THREAD 4
+
+// Whole gzip members inflated by a worker, delivered in order
+struct GzipJob{
+    size_t start;
+    size_t end;
+    string out;
+    bool ok;
+    bool done;
+};
+
+// Streams the decompressed bytes of a gzip file.
+// Regular files are memory-mapped and, with more than one thread, cut into
+// jobs of whole gzip members that are inflated on a thread pool: exactly
+// for BGZF, whose headers carry the block size, and speculatively for other
+// multi-member files, whose member starts are guessed from the gzip magic
+// and confirmed by the CRC and length trailer. A job that does not line up
+// with the previous one is decoded on the calling thread instead.
+// Pipes and stdin are inflated sequentially.
+class GzipReader{
+public:
+    GzipReader(FILE* file, string filename, int threads = 1);
+    ~GzipReader();
+
+    // fills buf unless the end of the file is reached, 0 at the end
+    size_t read(char* buf, size_t len);
+    bool eof();
+    // compressed bytes consumed so far
+    size_t bytesRead();
+    size_t bytesTotal();
+    bool isBgzf();
+    bool isParallel();
+
+    static bool isGzip(FILE* file);
+
+private:
+    bool mapFile();
+    void detectBgzf();
+    size_t bgzfBlockSize(size_t pos);
+    size_t nextMemberCandidate(size_t pos);
+    void cutJobs();
+    void worker();
+    static bool inflateJob(const char* data, GzipJob* job);
+    void startStream();
+    size_t inflateStream(char* buf, size_t len);
+    void dropConsumed();
+
+private:
+    string mFilename;
+    FILE* mFile;
+    int mThreads;
+    bool mBgzf;
+    bool mFinished;
+    // mapping of a regular file, NULL for pipes
+    char* mMap;
+    size_t mMapLen;
+    size_t mDropped;
+    // compressed offset of the next byte to deliver, and of the next job
+    size_t mPos;
+    size_t mCutPos;
+    // sequential decoding on the calling thread
+    bool mStreaming;
+    bool mStreamOpen;
+    z_stream mStream;
+    char* mIn;
+    // output of the job being delivered
+    string mPending;
+    size_t mPendingUsed;
+    // thread pool, jobs are kept in cut order
+    deque<GzipJob*> mJobs;
+    BoundedQueue<GzipJob*>* mQueue;
+    vector<thread> mWorkers;
+    int mFailedJobs;
+    mutex mMtx;
+    condition_variable mDone;
+};
+
+#endif
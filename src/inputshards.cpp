@@ -0,0 +1,135 @@
+//
+//  inputshards.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "inputshards.h"
+#include "namecodec.h"
+#include "util.h"
+#include <algorithm>
+
+vector<size_t> shardOffsets(string fileName, int shards, size_t begin, size_t end){
+    vector<size_t> offsets;
+    FastqReader probe(fileName);
+    if(!probe.isMapped())
+        return offsets;
+    size_t bytesRead, bytesTotal;
+    probe.getBytes(bytesRead, bytesTotal);
+    end = min(end, bytesTotal);
+    offsets.push_back(begin);
+    for(int i=1; i<shards; i++) {
+        FastqReader reader(fileName);
+        FastqRecord rec;
+        if(!reader.setRange(begin + (end - begin) / shards * i, end))
+            return vector<size_t>();
+        offsets.push_back(reader.next(rec) ? reader.recordOffset() : end);
+    }
+    offsets.push_back(end);
+    return offsets;
+}
+
+size_t findReadName(string fileName, const FastqRecord& target, size_t hint, size_t fileSize){
+    for(size_t window = SHARD_SEARCH_WINDOW; ; window *= 2) {
+        size_t from = hint > window ? hint - window : 0;
+        size_t to = min(fileSize, hint + window);
+        FastqReader reader(fileName);
+        FastqRecord rec;
+        reader.setRange(from, to);
+        while(reader.next(rec)) {
+            if(sameMateName(rec.name, rec.nameLen, target.name, target.nameLen))
+                return reader.recordOffset();
+        }
+        if(from == 0 && to == fileSize)
+            return string::npos;
+    }
+}
+
+vector<size_t> alignShards(string indexFile, const vector<size_t>& indexOffsets, string readsFile, string files){
+    vector<size_t> offsets;
+    FastqReader indexProbe(indexFile);
+    FastqReader readsProbe(readsFile);
+    if(!indexProbe.isMapped() || !readsProbe.isMapped())
+        return offsets;
+    size_t bytesRead, indexSize, readsSize;
+    indexProbe.getBytes(bytesRead, indexSize);
+    readsProbe.getBytes(bytesRead, readsSize);
+    for(int i=0; i<indexOffsets.size(); i++) {
+        FastqReader indexReader(indexFile);
+        FastqRecord rec;
+        indexReader.setRange(indexOffsets[i], indexSize);
+        if(indexOffsets[i] == 0 || !indexReader.next(rec)) {
+            offsets.push_back(indexOffsets[i] == 0 ? 0 : readsSize);
+            continue;
+        }
+        // records of both files have similar sizes, so the match is close to
+        // the same share of the reads file
+        size_t hint = (double)indexOffsets[i] / indexSize * readsSize;
+        size_t offset = findReadName(readsFile, rec, hint, readsSize);
+        if(offset == string::npos || (!offsets.empty() && offset < offsets.back()))
+            error_exit(files + " are out of order at read " + string(rec.name, rec.nameLen));
+        offsets.push_back(offset);
+    }
+    return offsets;
+}
+
+InputSlice sliceInputs(string indexFile, string index2File, string readsFile, string reads2File, bool streamMode,
+        int shard, int shards, int threads){
+    InputSlice slice = {0, string::npos, 0, string::npos, 0, string::npos, 0, string::npos, 0, -1};
+    if(shards == 1)
+        return slice;
+    vector<size_t> offsets = shardOffsets(streamMode ? indexFile : readsFile, shards);
+    vector<size_t> readsOffsets = offsets;
+    vector<size_t> index2Offsets, reads2Offsets;
+    if(streamMode && !offsets.empty())
+        readsOffsets = alignShards(indexFile, offsets, readsFile);
+    if(index2File != "" && !readsOffsets.empty())
+        index2Offsets = alignShards(indexFile, offsets, index2File, "Index and index 2 files");
+    if(reads2File != "" && !readsOffsets.empty())
+        reads2Offsets = alignShards(readsFile, readsOffsets, reads2File, "Reads and reads2 files");
+    if(!readsOffsets.empty() && (index2File == "" || !index2Offsets.empty()) && (reads2File == "" || !reads2Offsets.empty())) {
+        if(streamMode) {
+            slice.indexBegin = offsets[shard - 1];
+            slice.indexEnd = offsets[shard];
+        }
+        if(index2File != "") {
+            slice.index2Begin = index2Offsets[shard - 1];
+            slice.index2End = index2Offsets[shard];
+        }
+        if(reads2File != "") {
+            slice.reads2Begin = reads2Offsets[shard - 1];
+            slice.reads2End = reads2Offsets[shard];
+        }
+        slice.readsBegin = readsOffsets[shard - 1];
+        slice.readsEnd = readsOffsets[shard];
+        return slice;
+    }
+
+    // compressed input is cut by record number, which takes a pass to count
+    FastqReader counter(readsFile, true, false, threads);
+    FastqRecord rec;
+    long total = 0;
+    while(counter.next(rec))
+        total++;
+    slice.firstRecord = total * (shard - 1) / shards;
+    slice.records = total * shard / shards - slice.firstRecord;
+    return slice;
+}
+
+void applySlice(FastqReader* reader, const InputSlice& slice, size_t begin, size_t end){
+    if(slice.records >= 0)
+        reader->setRecordRange(slice.firstRecord, slice.records);
+    else if(begin > 0 || end != string::npos)
+        reader->setRange(begin, end);
+}
+
+vector<FastqReader*> openShards(string fileName, const vector<size_t>& offsets){
+    vector<FastqReader*> readers;
+    for(int i=0; i+1<offsets.size(); i++) {
+        FastqReader* reader = new FastqReader(fileName);
+        reader->setRange(offsets[i], offsets[i + 1]);
+        readers.push_back(reader);
+    }
+    return readers;
+}
@@ -0,0 +1,63 @@
+//
+//  inputshards.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef INPUT_SHARDS_H
+#define INPUT_SHARDS_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "fastqreader.h"
+
+using namespace std;
+
+// Bytes either side of the expected offset searched first when the reads
+// file is cut at the same records as the index file
+#define SHARD_SEARCH_WINDOW (1<<20)
+
+// Record-aligned byte offsets cutting [begin, end) of a FASTQ file into shards
+// ranges; empty if the file can only be read from the start
+vector<size_t> shardOffsets(string fileName, int shards, size_t begin = 0, size_t end = string::npos);
+
+// Offset of the record named like target, looked for in a window around hint
+// that doubles until it covers the whole file; string::npos if it is missing
+size_t findReadName(string fileName, const FastqRecord& target, size_t hint, size_t fileSize);
+
+// Offsets of the reads file that start with the same records as the given
+// index file offsets, so each pair of ranges can be read in lockstep; empty
+// if either file can only be read from the start
+// files names the two files in the error for a read that is not found
+vector<size_t> alignShards(string indexFile, const vector<size_t>& indexOffsets, string readsFile,
+    string files = "Index and reads files");
+
+// Part of the inputs processed by --shard i/N: a byte range of each file when
+// they can be split by bytes, otherwise a range of record numbers
+struct InputSlice{
+    size_t indexBegin;
+    size_t indexEnd;
+    size_t index2Begin;
+    size_t index2End;
+    size_t readsBegin;
+    size_t readsEnd;
+    size_t reads2Begin;
+    size_t reads2End;
+    long firstRecord;
+    long records;               // -1 for a byte range
+};
+
+// The shard-th of shards slices of the reads files, and of the index files too
+// in stream mode, where all are cut at the same records
+InputSlice sliceInputs(string indexFile, string index2File, string readsFile, string reads2File, bool streamMode,
+    int shard, int shards, int threads);
+
+// Limit a reader to its part of the slice, [begin, end) for a byte range
+void applySlice(FastqReader* reader, const InputSlice& slice, size_t begin, size_t end);
+
+// One reader per shard, limited to its byte range
+vector<FastqReader*> openShards(string fileName, const vector<size_t>& offsets);
+
+#endif
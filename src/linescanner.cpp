@@ -0,0 +1,224 @@
+//
+//  linescanner.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "linescanner.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_SSE2_SCANNER
+#endif
+
+static size_t findLineBreakScalar(const char* p, size_t len){
+    size_t i = 0;
+    while(i < len && p[i] != '\r' && p[i] != '\n')
+        i++;
+    return i;
+}
+
+static void scanLineBreaksScalar(const char* p, size_t len, size_t offset, vector<uint32_t>& breaks){
+    for(size_t i=0; i<len; i++) {
+        if(p[i] == '\r' || p[i] == '\n')
+            breaks.push_back(offset + i);
+    }
+}
+
+#ifdef HAVE_SSE2_SCANNER
+
+// SSE2 is part of x86-64, so it is the baseline kernel
+static size_t findLineBreakSse2(const char* p, size_t len){
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+        if(mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + findLineBreakScalar(p + i, len - i);
+}
+
+static void scanLineBreaksSse2(const char* p, size_t len, vector<uint32_t>& breaks){
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+        while(mask) {
+            breaks.push_back(i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    scanLineBreaksScalar(p + i, len - i, i, breaks);
+}
+
+__attribute__((target("avx2")))
+static size_t findLineBreakAvx2(const char* p, size_t len){
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, cr)));
+        if(mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + findLineBreakSse2(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void scanLineBreaksAvx2(const char* p, size_t len, vector<uint32_t>& breaks){
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    size_t i = 0;
+    for(; i + 64 <= len; i += 64) {
+        // two registers per step, one 64-bit mask of line breaks
+        __m256i v0 = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)(p + i + 32));
+        uint64_t m0 = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v0, nl), _mm256_cmpeq_epi8(v0, cr)));
+        uint64_t m1 = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v1, nl), _mm256_cmpeq_epi8(v1, cr)));
+        uint64_t mask = m0 | (m1 << 32);
+        while(mask) {
+            breaks.push_back(i + __builtin_ctzll(mask));
+            mask &= mask - 1;
+        }
+    }
+    size_t tail = breaks.size();
+    scanLineBreaksSse2(p + i, len - i, breaks);
+    for(size_t b=tail; b<breaks.size(); b++)
+        breaks[b] += i;
+}
+
+static bool cpuHasAvx2(){
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+
+#endif
+
+size_t findLineBreak(const char* p, size_t len){
+#ifdef HAVE_SSE2_SCANNER
+    if(cpuHasAvx2())
+        return findLineBreakAvx2(p, len);
+    return findLineBreakSse2(p, len);
+#else
+    return findLineBreakScalar(p, len);
+#endif
+}
+
+void scanLineBreaks(const char* p, size_t len, vector<uint32_t>& breaks){
+#ifdef HAVE_SSE2_SCANNER
+    if(cpuHasAvx2()) {
+        scanLineBreaksAvx2(p, len, breaks);
+        return;
+    }
+    scanLineBreaksSse2(p, len, breaks);
+#else
+    scanLineBreaksScalar(p, len, 0, breaks);
+#endif
+}
+
+const char* lineScannerKernel(){
+#ifdef HAVE_SSE2_SCANNER
+    if(cpuHasAvx2())
+        return "avx2";
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+// Walks the line breaks of one block
+class LineCursor{
+public:
+    LineCursor(const char* p, size_t len, bool final, vector<uint32_t>& breaks) : mBreaks(breaks) {
+        mP = p;
+        mLen = len;
+        mFinal = final;
+        mPos = 0;
+        mNext = 0;
+    }
+
+    // false when the line is cut off by the end of a non-final block
+    // at the end of a final block every further line is empty
+    bool next(uint32_t& start, uint32_t& len){
+        if(mNext == mBreaks.size()) {
+            if(!mFinal)
+                return false;
+            start = mPos;
+            len = mLen - mPos;
+            mPos = mLen;
+            return true;
+        }
+        size_t b = mBreaks[mNext++];
+        start = mPos;
+        len = b - mPos;
+        mPos = b + 1;
+        if(mP[b] == '\r') {
+            // \r\n is one line break, which needs the byte after \r
+            if(b + 1 == mLen && !mFinal)
+                return false;
+            if(b + 1 < mLen && mP[b + 1] == '\n') {
+                mPos++;
+                mNext++;
+            }
+        }
+        return true;
+    }
+
+    bool atEnd(){
+        return mPos >= mLen;
+    }
+
+    size_t pos(){
+        return mPos;
+    }
+
+private:
+    const char* mP;
+    size_t mLen;
+    bool mFinal;
+    size_t mPos;
+    size_t mNext;
+    vector<uint32_t>& mBreaks;
+};
+
+size_t scanRecords(const char* p, size_t len, bool final, int linesPerRecord,
+    vector<uint32_t>& breaks, vector<RecordOffsets>& records){
+
+    breaks.clear();
+    scanLineBreaks(p, len, breaks);
+
+    LineCursor cursor(p, len, final, breaks);
+    size_t consumed = 0;
+    while(!cursor.atEnd()) {
+        RecordOffsets rec;
+
+        // name should start with @
+        if(!cursor.next(rec.start[0], rec.len[0]))
+            break;
+        if(rec.len[0] == 0 || p[rec.start[0]] != '@') {
+            consumed = cursor.pos();
+            continue;
+        }
+
+        bool complete = true;
+        for(int l=1; l<linesPerRecord && complete; l++)
+            complete = cursor.next(rec.start[l], rec.len[l]);
+        if(!complete)
+            break;
+        for(int l=linesPerRecord; l<4; l++) {
+            rec.start[l] = rec.start[1];
+            rec.len[l] = 0;
+        }
+
+        records.push_back(rec);
+        consumed = cursor.pos();
+    }
+    return consumed;
+}
@@ -0,0 +1,40 @@
+//
+//  linescanner.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef LINE_SCANNER_H
+#define LINE_SCANNER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+using namespace std;
+
+// Start offset and length of each line of one FASTQ record
+struct RecordOffsets{
+    uint32_t start[4];
+    uint32_t len[4];
+};
+
+// Offset of the first \r or \n in p[0, len), len if there is none
+size_t findLineBreak(const char* p, size_t len);
+
+// Offsets of every \r and \n in p[0, len), appended to breaks
+void scanLineBreaks(const char* p, size_t len, vector<uint32_t>& breaks);
+
+// Split a block into whole records, with the same rules as FastqReader:
+// lines end at \r, \n or \r\n, and lines before the next line starting
+// with '@' are skipped. When final is false the block is followed by more
+// data, so a record cut off at the end of the block is left for the next
+// call. Returns the number of bytes consumed.
+size_t scanRecords(const char* p, size_t len, bool final, int linesPerRecord,
+    vector<uint32_t>& breaks, vector<RecordOffsets>& records);
+
+// Name of the line break kernel chosen for this CPU
+const char* lineScannerKernel();
+
+#endif
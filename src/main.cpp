@@ -15,7 +15,22 @@
 #include <string.h>
 #include <stdio.h>
 #include <vector>
+#include <sys/stat.h>
 #include "fastqreader.h"
+#include "writer.h"
+#include "barcode.h"
+#include "pipeline.h"
+#include "readindex.h"
+#include "namecodec.h"
+#include "shard.h"
+#include "inputshards.h"
+#include "windowjoin.h"
+#include "externaljoin.h"
+#include "assignments.h"
+#include "runstats.h"
+#include "progress.h"
+#include "samplecounts.h"
+#include "util.h"
 #include "cmdline.h"
 
 using namespace std;
@@ -23,23 +38,28 @@ using namespace std;
 // Global variables
 const string DEMULTIPLEX_SATAY_VER = "0.0.1";
 const string UNASSIGNED_VALUE      = "unassigned";
-const string FASTQ_ID_DELIMITER    = " ";
 const string FASTQ_DELIMITER       = ".";
+const string GZIP_SUFFIX           = ".gz";
 const string FASTQ_SUFFIX          = ".fastq";
-const int UPDATE_FREQUENCY         = 1000000;
+// Index reads parsed before the read index is sized from the file size
+const long INDEX_ESTIMATE_RECORDS  = 1 << 18;
+
+// Sample id 0 is reserved for unassigned reads
+const int UNASSIGNED_ID            = 0;
 
 typedef map<string, string> BarcodeMap;
-typedef map<string, vector<string>> IndexMap;
+typedef map<string, int> SampleIdMap;
 
 
 // Timer functions
-clock_t START_TIMER;
+// Wall-clock time, with the CPU time of all threads next to it
+RunStats RUN_STATS;
 
-clock_t start() {
-    return START_TIMER = clock();
+void start() {
+    RUN_STATS.start();
 }
 
-void stop(clock_t start = START_TIMER) {
+void stop() {
     cout.precision(4);
     cout
         << endl
@@ -47,9 +67,28 @@ void stop(clock_t start = START_TIMER) {
         << endl
         << endl
         << "Elapsed time:                                  "
-        << (clock() - start) / (double)CLOCKS_PER_SEC
+        << RUN_STATS.wallSeconds()
         << "s"
         << endl
+        << "CPU time:                                      "
+        << RUN_STATS.cpuSeconds()
+        << "s"
+        << endl;
+    const vector<StageStats>& stages = RUN_STATS.stages();
+    for (int i = 0; i < stages.size(); ++i) {
+        cout
+            << "  "
+            << stages[i].name
+            << ": "
+            << stages[i].wallSeconds
+            << "s wall, "
+            << stages[i].cpuSeconds
+            << "s CPU, "
+            << stages[i].bytesRead / 1000000.0
+            << " MB read"
+            << endl;
+    }
+    cout
         << endl
         << endl;
 }
@@ -65,21 +104,28 @@ void split(const string &s, char delim, vector<string> &elems) {
 }
 
 // Read in header-less, index-less 2d tsv/txt where column 1 is barcode/index and column 2 is sample label
-int readBarcodes(string file_url, vector<string>* index_array, vector<string>* sample_array) {
+// A three-column table is i7 barcode, i5 barcode and sample label, index2_array is left empty otherwise
+int readBarcodes(string file_url, vector<string>* index_array, vector<string>* index2_array, vector<string>* sample_array) {
     cout 
         << "Reading barcodes file..." 
         << endl;
 
     ifstream infile (file_url);
     string line;
-    vector<string> a_array, b_array;
+    vector<string> a_array, b_array, c_array;
 
     // Read each line of tab-delimited file
     while (getline(infile, line)) {
         vector<string> row_values;
         split(line, '\t', row_values);
-        a_array.push_back(row_values.at(0));
-        b_array.push_back(row_values.at(1));
+        if (row_values.size() >= 3) {
+            a_array.push_back(row_values.at(0));
+            c_array.push_back(row_values.at(1));
+            b_array.push_back(row_values.at(2));
+        } else {
+            a_array.push_back(row_values.at(0));
+            b_array.push_back(row_values.at(1));
+        }
     }
 
     // Check array sizes match
@@ -91,6 +137,11 @@ int readBarcodes(string file_url, vector<string>* index_array, vector<string>* s
             << "Column 2: " << b_array.size()
             << endl;
         return 1;
+    } else if (!c_array.empty() && c_array.size() != a_array.size()) {
+        cout
+            << "Barcode rows must all have two columns or all have three"
+            << endl;
+        return 1;
     } else {
         cout 
             << "Read in " << a_array.size() << " barcodes"
@@ -99,64 +150,11 @@ int readBarcodes(string file_url, vector<string>* index_array, vector<string>* s
 
     // return
     *index_array = a_array;
+    *index2_array = c_array;
     *sample_array = b_array;
     return 0;
 }
 
-// Source: https://stackoverflow.com/a/33075485/9571488
-string complementSeq(string seq) {
-    string c;
-    
-    for (int i = 0; i < seq.length(); ++i) {
-        char base = seq.at(i);
-        if (base == 'A') {
-            c = c + "T";
-        } else if (base == 'T') {
-            c = c + "A";
-        } else if (base == 'C') {
-            c = c + "G";
-        } else if (base == 'G') {
-            c = c + "C";
-        } else {
-            c = c + base;
-        }
-    }
-
-    return c;
-}
-
-string reverseSeq(string seq) {
-    reverse(seq.begin(), seq.end());
-    return seq;
-}
-
-string reverseComplement(string seq) {
-
-    string s_seq_c, s_seq_r;
-    s_seq_c = complementSeq(seq);
-    s_seq_r = reverseSeq(s_seq_c);
-    return s_seq_r;
-}
-
-bool fuzzyMatch(string s1, string s2, int threshold) {
-
-    if (s1.length() != s2.length()) {
-        return 1;
-    }
-
-    int mismatch = 0;
-    for (int i = 0; i < s1.length(); ++i) {
-        if (s1.at(i) != s2.at(i)) {
-            ++mismatch;
-        }
-    }
-    if (mismatch <= threshold) {
-        return 0;
-    } else {
-        return 1;
-    }
-}
-
 // Adapted from: https://stackoverflow.com/a/41369185/9571488
 bool isNotAlnum(char c) {
     if (isalnum(c) == 0) {
@@ -187,248 +185,1129 @@ string stripSpecial(string s) {
 }
 
 
-// =============================== //
-// ------------ MAIN ------------- //
-// =============================== //
-int main(int argc, char* argv[]) {
+// Match an index read against the barcode table
+// Precedence is exact, reverse complement, unique fuzzy, unique fuzzy reverse complement
+// qual is the index quality string, NULL if there is none
+int assignSample(const char* index, int len, const char* qual, BarcodeTable& barcode_table, SampleCounts& counts) {
 
-    // Parse user arguments
-    if (argc == 1) {
-        cerr
-            << "demultiplex_satay: demultiplexing for pooled Satay screen reads"
-            << endl
-            << "version "
-            << DEMULTIPLEX_SATAY_VER
-            << endl;
+    BarcodeMatch match = barcode_table.match(index, len, qual);
+    int sample_id = match.barcode < 0 ? UNASSIGNED_ID : match.sampleId;
+    counts.addIndex(sample_id, match);
+    if (sample_id == UNASSIGNED_ID) {
+        counts.addUnknown(index, len);
     }
-    if (argc == 2 && (strcmp(argv[1], "-v")==0 || strcmp(argv[1], "--version")==0)){
-        cerr
-            << "demultiplex_satay "
-            << DEMULTIPLEX_SATAY_VER
-            << endl;
-        return 0;
+    return sample_id;
+}
+
+// Same as assignSample() for an i7 + i5 pair
+int assignDualSample(const char* i7, int len7, const char* qual7, const char* i5, int len5, const char* qual5, DualBarcodeTable& dual_table, SampleCounts& counts) {
+
+    BarcodeMatch match = dual_table.match(i7, len7, i5, len5, qual7, qual5);
+    int sample_id = match.barcode < 0 ? UNASSIGNED_ID : match.sampleId;
+    counts.addIndex(sample_id, match);
+    if (sample_id == UNASSIGNED_ID) {
+        counts.addUnknown(i7, len7, i5, len5);
     }
+    return sample_id;
+}
 
-    cmdline::parser cmd;
-    //input file - sequencing reads
-    cmd.add<string>("reads", 'r', "Input fastq file name", true); 
-    //input file - read indices
-    cmd.add<string>("index", 'i', "Index fastq file name", true); 
-    //input file - read indices
-    cmd.add<string>("barcodes", 'b', "Barcodes table file name (tab-delimited)", true); 
-    //threshold for fuzzy searching of read indices
-    cmd.add<int>("fuzzy-threshold", 'f', "Fuzzy index match threshold", false, 1); 
+// Sample of a read from the index at the end of its name comment,
+// "1:N:0:<i7>" or "1:N:0:<i7>+<i5>" for dual indexes
+int assignHeaderSample(const char* name, int len, bool dual_index, BarcodeTable& barcode_table, DualBarcodeTable& dual_table, SampleCounts& counts) {
 
-    // Parse arguments
-    cmd.parse_check(argc, argv);
+    int key_length = nameKeyLength(name, len);
+    IndexView i7, i5;
+    i7.len = 0;
+    if (key_length < len) {
+        Read::findIndexes(name + key_length + 1, len - key_length - 1, i7, i5);
+    }
+    // no index, or a single index where two are expected
+    if (i7.len == 0 || (dual_index && i5.data == i7.data)) {
+        counts.addIndex(UNASSIGNED_ID, MATCH_NONE, 0, false);
+        return UNASSIGNED_ID;
+    }
+    if (!dual_index) {
+        return assignSample(i7.data, i7.len, NULL, barcode_table, counts);
+    }
+    return assignDualSample(i7.data, i7.len, NULL, i5.data, i5.len, NULL, dual_table, counts);
+}
 
-    if (argc == 1) {
-        cerr << cmd.usage() <<endl;
-        return 0;
+// Compare read names up to NAME_KEY_DELIMITER without copying them
+bool sameReadName(const FastqRecord& r1, const FastqRecord& r2) {
+    int l1 = nameKeyLength(r1.name, r1.nameLen);
+    int l2 = nameKeyLength(r2.name, r2.nameLen);
+    return l1 == l2 && memcmp(r1.name, r2.name, l1) == 0;
+}
+
+// Same as sameReadName() for the two mates of a pair
+bool sameMateName(const FastqRecord& r1, const FastqRecord& r2) {
+    return sameMateName(r1.name, r1.nameLen, r2.name, r2.nameLen);
+}
+
+// Progress of the running pass, on stderr
+ProgressMeter PROGRESS;
+
+void printProgress(long counter) {
+    PROGRESS.update(counter);
+}
+
+// Bytes of input the readers of a pass go through, for the progress meter;
+// 0 if one of them is a pipe of unknown size
+size_t inputBytes(const vector<FastqReader*>& readers) {
+    size_t total = 0;
+    for (int i = 0; i < readers.size(); ++i) {
+        if (readers[i] == NULL) {
+            continue;
+        }
+        size_t bytes_read, bytes_total;
+        readers[i] -> getBytes(bytes_read, bytes_total);
+        if (bytes_total == 0) {
+            return 0;
+        }
+        total += bytes_total;
     }
+    return total;
+}
 
-    string reads_file = cmd.get<string>("reads");
-    string index_file = cmd.get<string>("index");
-    string barcode_file = cmd.get<string>("barcodes");
-    int fuzzy_threshold = cmd.get<int>("fuzzy-threshold");
+void printIndexSummary(long counter_index, long counter_matched_index) {
+    cout.precision(4);
+    cout 
+        << "Read "
+        << counter_index
+        << " total index reads"
+        << endl 
+        << "Matched "
+        << counter_matched_index
+        << " index reads"
+        << endl
+        << "Sample index match rate: "
+        << (double)counter_matched_index / (double)counter_index * 100.00
+        << "%"
+        << endl;
+}
 
-    // Print user inputs
-    cout
-        << "\ndemultiplex_satay v"
-        << DEMULTIPLEX_SATAY_VER << endl << endl;
+void printReadIndexSummary(const ReadIndex& index, const NameCodec& codec, long packed, long total) {
+    cout.precision(4);
     cout
-        << "Provided sequencing reads file name:           "
-        << reads_file << endl;
+        << "Packed Illumina read names: "
+        << packed
+        << " of "
+        << total
+        << (codec.hasPrefix() ? " (prefix " + codec.prefix() + ")" : "")
+        << endl;
     cout
-        << "Provided index reads file name:                "
-        << index_file << endl;
+        << "Index table memory: "
+        << index.bytes() / 1000000.0
+        << " MB ("
+        << (index.size() > 0 ? (double)index.bytes() / index.size() : 0)
+        << " bytes/read, "
+        << index.collisions()
+        << " shared name hashes resolved by name)"
+        << endl;
+}
+
+void printExternalJoinSummary(ExternalJoin& join, SampleOutputs& outputs, const NameCodec& codec, long packed, long total) {
+    cout.precision(4);
     cout
-        << "Provided barcode file name:                    "
-        << barcode_file << endl;
+        << "Memory budget: "
+        << join.maxBytes() / 1000000.0
+        << " MB join, "
+        << outputs.memoryBytes() / 1000000.0
+        << " MB sample files ("
+        << outputs.maxOpen()
+        << " open at once, "
+        << outputs.bufferSize() / 1024
+        << " KB buffers)"
+        << endl;
     cout
-        << "Provided fuzzy mapping threshold:              "
-        << fuzzy_threshold << endl << endl;
-    cout 
-        << "--------------------------------------------------------------"
-        << endl
+        << "Packed Illumina read names: "
+        << packed
+        << " of "
+        << total
+        << (codec.hasPrefix() ? " (prefix " + codec.prefix() + ")" : "")
         << endl;
     cout
-        << "Demultiplexing reads...\n" << endl;
+        << "Index runs on disk: "
+        << join.runs()
+        << " ("
+        << join.spilledBytes() / 1000000.0
+        << " MB)"
+        << endl;
+}
 
-    // Check the inputs and exit if one doesn't work
-    if (reads_file == index_file) {
-        cout
-            << "Error: Reads and index file names can not be identical"
-            << endl;
-        return 1;
+// Output files of reads.fastq (or reads.fastq.gz) are reads_<sample>.fastq
+string outputPrefix(string reads_file) {
+    string reads_base = ends_with(reads_file, GZIP_SUFFIX) ? reads_file.substr(0, reads_file.length() - GZIP_SUFFIX.length()) : reads_file;
+    return reads_base.substr(0, reads_base.find_last_of(FASTQ_DELIMITER));
+}
+
+// Expected number of index reads from the share of the file parsed so far
+size_t estimateRecords(FastqReader& reader, long records) {
+    size_t bytes_read, bytes_total;
+    if (!reader.isMapped() && !reader.isGzipped()) {
+        return 0;
     }
-    if (reads_file == "") {
-        cout
-            << "Error: Reads file name cannot be blank"
-            << endl;
-        return 1;
+    reader.getBytes(bytes_read, bytes_total);
+    if (bytes_read == 0 || bytes_total <= bytes_read) {
+        return 0;
     }
-    if (index_file == "") {
-        cout
-            << "Error: Index file name cannot be blank"
-            << endl;
-        return 1;
+    return (double)records * bytes_total / bytes_read * 1.05;
+}
+
+// Read number for error messages, counted within the shard of a split input
+string readOrdinal(long read, int shard) {
+    return to_string(read) + (shard > 0 ? " of input shard " + to_string(shard + 1) : "");
+}
+
+// Exit unless the records of pair number read are mates
+void checkMates(const FastqRecord& r1, const FastqRecord& r2, long read) {
+    if (!sameMateName(r1, r2)) {
+        error_exit("Reads and reads2 files are out of order at read "
+            + to_string(read) + " (" + string(r1.name, r1.nameLen) + " vs "
+            + string(r2.name, r2.nameLen) + ")");
     }
-    if (barcode_file == "") {
-        cout
-            << "Error: Barcode file name cannot be blank"
-            << endl;
-        return 1;
+}
+
+// The inputs read in lockstep over one byte range: the reads, with the
+// second reads of a paired-end run, and in stream mode the index reads,
+// with the i5 of a dual-index run; NULL for the inputs not read
+struct LockstepInputs {
+    FastqReader* reads;
+    FastqReader* reads2;
+    FastqReader* index;
+    FastqReader* index2;
+};
+
+// One record of each of the inputs, views into the input or into the reads
+// of a batch
+struct LockstepRecords {
+    FastqRecord read;
+    FastqRecord mate;
+    FastqRecord index;
+    FastqRecord index2;
+};
+
+// Sample id of a read from its records, called from every worker thread
+typedef function<int(const LockstepRecords&, SampleCounts&)> ReadAssigner;
+
+// Readers of the given files, "" for those not read, limited to the slice
+LockstepInputs openInputs(string reads_file, string reads2_file, string index_file, string index2_file, int threads, const InputSlice& slice) {
+    LockstepInputs inputs = {NULL, NULL, NULL, NULL};
+    inputs.reads = new FastqReader(reads_file, true, false, threads);
+    applySlice(inputs.reads, slice, slice.readsBegin, slice.readsEnd);
+    if (reads2_file != "") {
+        inputs.reads2 = new FastqReader(reads2_file, true, false, threads);
+        applySlice(inputs.reads2, slice, slice.reads2Begin, slice.reads2End);
     }
-    if (fuzzy_threshold < 0) {
-        cout
-            << "Fuzzy mapping threshold cannot be less than 0"
-            << endl;
-        return 1;
+    if (index_file != "") {
+        inputs.index = new FastqReader(index_file, true, false, threads);
+        applySlice(inputs.index, slice, slice.indexBegin, slice.indexEnd);
     }
+    if (index2_file != "") {
+        inputs.index2 = new FastqReader(index2_file, true, false, threads);
+        applySlice(inputs.index2, slice, slice.index2Begin, slice.index2End);
+    }
+    return inputs;
+}
 
-    // Begin processing file
-    
-    start(); // start elapsed time
+void closeInputs(LockstepInputs& inputs) {
+    delete inputs.reads;
+    delete inputs.reads2;
+    delete inputs.index;
+    delete inputs.index2;
+}
 
-    // Read barcode file
-    vector<string> barcodeindex, barcode_sample;
-    int success = readBarcodes(barcode_file, &barcodeindex, &barcode_sample);
-    if (success == 1) {
-        return 1;
+void closeInputs(vector<LockstepInputs>& shards) {
+    for (int i = 0; i < shards.size(); ++i) {
+        closeInputs(shards[i]);
     }
-    int barcode_number = barcodeindex.size();
+}
 
-    // Populate barcode map
-    BarcodeMap barcode_dictionary;
-    for (int i = 0; i < barcodeindex.size(); ++i) {
-        barcode_dictionary[barcodeindex[i]] = stripSpecial(barcode_sample[i]);
+// One set of inputs per shard of the reads file, with the second reads of a
+// paired-end run cut at the same records; empty if the file can't be split
+vector<LockstepInputs> openReadShards(string reads_file, string reads2_file, int shards, size_t begin, size_t end) {
+    vector<LockstepInputs> inputs;
+    vector<size_t> reads_offsets = shardOffsets(reads_file, shards, begin, end);
+    vector<size_t> reads2_offsets;
+    if (reads2_file != "" && !reads_offsets.empty()) {
+        reads2_offsets = alignShards(reads_file, reads_offsets, reads2_file, "Reads and reads2 files");
+    }
+    if (reads_offsets.empty() || (reads2_file != "" && reads2_offsets.empty())) {
+        return inputs;
+    }
+    vector<FastqReader*> reads_shards = openShards(reads_file, reads_offsets);
+    vector<FastqReader*> reads2_shards;
+    if (reads2_file != "") {
+        reads2_shards = openShards(reads2_file, reads2_offsets);
+    }
+    for (int i = 0; i < reads_shards.size(); ++i) {
+        LockstepInputs shard = {reads_shards[i], reads2_file != "" ? reads2_shards[i] : NULL, NULL, NULL};
+        inputs.push_back(shard);
     }
+    return inputs;
+}
 
-    // Read index fastq file
-    FastqReader reader1 (index_file); // initialize input FASTQ file
-    Read* r1 = NULL;
+// One set of inputs per shard of the index file, with the reads, index 2 and
+// second reads cut at the same records; empty if a file can't be split
+vector<LockstepInputs> openStreamShards(string index_file, string index2_file, string reads_file, string reads2_file, int shards, size_t begin, size_t end) {
+    vector<LockstepInputs> inputs;
+    vector<size_t> index_offsets = shardOffsets(index_file, shards, begin, end);
+    vector<size_t> reads_offsets, index2_offsets, reads2_offsets;
+    if (!index_offsets.empty()) {
+        reads_offsets = alignShards(index_file, index_offsets, reads_file);
+    }
+    if (index2_file != "" && !reads_offsets.empty()) {
+        index2_offsets = alignShards(index_file, index_offsets, index2_file, "Index and index 2 files");
+    }
+    if (reads2_file != "" && !reads_offsets.empty()) {
+        reads2_offsets = alignShards(index_file, index_offsets, reads2_file, "Index and reads2 files");
+    }
+    if (reads_offsets.empty() || (index2_file != "" && index2_offsets.empty()) || (reads2_file != "" && reads2_offsets.empty())) {
+        return inputs;
+    }
+    vector<FastqReader*> index_shards = openShards(index_file, index_offsets);
+    vector<FastqReader*> reads_shards = openShards(reads_file, reads_offsets);
+    vector<FastqReader*> index2_shards, reads2_shards;
+    if (index2_file != "") {
+        index2_shards = openShards(index2_file, index2_offsets);
+    }
+    if (reads2_file != "") {
+        reads2_shards = openShards(reads2_file, reads2_offsets);
+    }
+    for (int i = 0; i < index_shards.size(); ++i) {
+        LockstepInputs shard = {reads_shards[i], reads2_file != "" ? reads2_shards[i] : NULL, index_shards[i], index2_file != "" ? index2_shards[i] : NULL};
+        inputs.push_back(shard);
+    }
+    return inputs;
+}
+
+// Exit if a file read in lockstep with the leading one (the index file in
+// stream mode, the reads file otherwise) ends before or after it
+void checkLockstepEnd(bool has_record, bool lead_has_record, const char* file, const char* lead) {
+    if (has_record != lead_has_record) {
+        error_exit(string(file) + " file has " + (has_record ? "more" : "fewer") + " reads than the " + lead + " file");
+    }
+}
 
-    // Initialize index matrix
-    IndexMap index_dictionary;
+// Next record of each input, false at the end of the inputs
+bool nextRecords(const LockstepInputs& inputs, LockstepRecords& records) {
+    const char* lead = inputs.index != NULL ? "index" : "reads";
+    bool more;
+    if (inputs.index != NULL) {
+        more = inputs.index -> next(records.index);
+        checkLockstepEnd(inputs.reads -> next(records.read), more, "Reads", lead);
+    } else {
+        more = inputs.reads -> next(records.read);
+    }
+    if (inputs.index2 != NULL) {
+        checkLockstepEnd(inputs.index2 -> next(records.index2), more, "Index 2", lead);
+    }
+    if (inputs.reads2 != NULL) {
+        checkLockstepEnd(inputs.reads2 -> next(records.mate), more, "Reads2", lead);
+    }
+    return more;
+}
 
-    // Process reads from index FASTQ file to identify read sample indices
-    int counter_index = 0;
-    int counter_matched_index = 0;
-    cout 
-        << endl
-        << "Reading index file..."
-        << endl;
-    while (true) {
-        
-        r1 = reader1.read();
+// Fill a batch from the inputs, copying the records into its arena: the
+// reads, the second reads in reads2, the index reads in mates and the index 2
+// reads in mates2
+bool readLockstepBatch(const LockstepInputs& inputs, ReadBatch* batch) {
+    LockstepRecords records;
+    while (batch -> reads.size() < PIPELINE_BATCH_SIZE && nextRecords(inputs, records)) {
+        batch -> reads.push_back(batch -> arena.copy(records.read));
+        if (inputs.reads2 != NULL) {
+            batch -> reads2.push_back(batch -> arena.copy(records.mate));
+        }
+        if (inputs.index != NULL) {
+            batch -> mates.push_back(batch -> arena.copy(records.index));
+        }
+        if (inputs.index2 != NULL) {
+            batch -> mates2.push_back(batch -> arena.copy(records.index2));
+        }
+    }
+    return !batch -> reads.empty();
+}
 
-        if (r1 == NULL) {
-            break;
-        } else {
-            ++counter_index;
-            if (counter_index % UPDATE_FREQUENCY == 0) {
-                cout 
-                    << counter_index
-                    << " reads processed"
-                    << endl;
-            }
+// Whether the records of read number read are of the same read, with the
+// reason in error if not; the index records are only compared when read
+bool sameRead(const LockstepRecords& records, bool index, bool index2, bool paired, long read, int shard, string& error) {
+    const FastqRecord& r = records.read;
+    if (index && !sameReadName(records.index, r)) {
+        error = "Index and reads files are out of order at read " + readOrdinal(read, shard)
+            + " (" + string(records.index.name, records.index.nameLen) + " vs " + string(r.name, r.nameLen)
+            + "), run again without --stream";
+        return false;
+    }
+    if (index2 && !sameReadName(records.index2, r)) {
+        error = "Index 2 and reads files are out of order at read " + readOrdinal(read, shard)
+            + " (" + string(records.index2.name, records.index2.nameLen) + " vs " + string(r.name, r.nameLen) + ")";
+        return false;
+    }
+    if (paired && !sameMateName(r, records.mate)) {
+        error = "Reads and reads2 files are out of order at read " + readOrdinal(read, shard)
+            + " (" + string(r.name, r.nameLen) + " vs " + string(records.mate.name, records.mate.nameLen) + ")";
+        return false;
+    }
+    return true;
+}
 
-            r1 -> toString();
-            string full_name = r1 -> mName;
-            string name = full_name.substr(0, full_name.find(FASTQ_ID_DELIMITER));
-            string index = r1 -> mSeq.mStr;
+// Counters of a run, for its summaries and the files written at its end
+struct RunTotals {
+    long index;
+    long matched_index;
+    long reads;
+    long matched_reads;
+    double reads_seconds;
+    size_t spilled_bytes;       // join files of --external
+};
 
-            // Fuzzy search index against barcodes for sample labels
-            string matched_index, sample_name;
-
-            // Check if reverse complement in barcode dictionary
-            string rev_comp = reverseComplement(index);
-
-            // Check if fuzzy index in barcode_dictionary
-            string fuzzy_string;
-            vector<string> fuzzy_indices, fuzzy_samples;
-            for (auto it = barcode_dictionary.begin(); it != barcode_dictionary.end(); ++it) {
-                auto key = it -> first;
-                auto value = it -> second;
-                if (fuzzyMatch(index, key, fuzzy_threshold) == 0) {
-                    fuzzy_indices.push_back(key);
-                    fuzzy_samples.push_back(value);
-                }
-            }
+// The reads pass: each read of the inputs gets a sample from assign() and
+// is written, with its mate, to that sample's files
+// One thread reads the records in place and writes them as it goes; more
+// run batches through a Pipeline to a WriterPool, with a reader thread per
+// shard of the inputs, or one on the whole inputs if there are no shards
+// The second reads of sample id i go to output mate_offset + i
+// Returns the seconds of the pass
+double demultiplexReads(LockstepInputs& inputs, vector<LockstepInputs>& shards, int threads, bool deterministic, ReadAssigner assign,
+        SampleOutputs& outputs, int mate_offset, SampleCountsSet& sample_counts, RunTotals& totals) {
+    bool paired = inputs.reads2 != NULL;
+    bool index = inputs.index != NULL;
+    bool index2 = inputs.index2 != NULL;
+    RUN_STATS.startStage("reads_pass");
+    PROGRESS.start("Reads pass", inputBytes({inputs.index, inputs.reads, inputs.index2, inputs.reads2}));
 
-            // Check if fuzzy reverse complement in barcode dictionary
-            string fuzzy_rev_comp;
-            vector<string> fuzzy_rev_comp_indices, fuzzy_rev_comp_samples;
-            for (auto it_f = barcode_dictionary.begin(); it_f != barcode_dictionary.end(); ++it_f) {
-                auto key_f = it_f -> first;
-                auto value_f = it_f -> second;
-                if (fuzzyMatch(rev_comp, key_f, fuzzy_threshold) == 0) {
-                    fuzzy_rev_comp_indices.push_back(key_f);
-                    fuzzy_rev_comp_samples.push_back(value_f);
-                }
-            }
+    if (threads > 1) {
 
-            // Update values
-            if (barcode_dictionary.count(index) > 0) {
-                matched_index = index;
-                sample_name = barcode_dictionary[index];
-                ++counter_matched_index;
-            } else if (barcode_dictionary.count(rev_comp) > 0) {
-                matched_index = rev_comp;
-                sample_name = barcode_dictionary[rev_comp];
-                ++counter_matched_index;
-            } else if (fuzzy_indices.size() == 1) {
-                // add if fuzzy match array is 1
-                matched_index = fuzzy_indices.at(0);
-                sample_name = fuzzy_samples.at(0);
-                ++counter_matched_index;
-            } else if (fuzzy_rev_comp_indices.size() == 1) {
-                // add if fuzzy match array is 1
-                matched_index = fuzzy_rev_comp_indices.at(0);
-                sample_name = fuzzy_rev_comp_samples.at(0);
-                ++counter_matched_index;
-            } else {
-                matched_index = UNASSIGNED_VALUE;
-                sample_name = UNASSIGNED_VALUE;
-            }
+        vector<function<bool(ReadBatch*)>> readers;
+        for (int i = 0; i < shards.size(); ++i) {
+            LockstepInputs shard = shards[i];
+            readers.push_back([shard](ReadBatch* batch) {
+                return readLockstepBatch(shard, batch);
+            });
+        }
+        if (readers.empty()) {
+            readers.push_back([&inputs](ReadBatch* batch) {
+                return readLockstepBatch(inputs, batch);
+            });
+        }
 
-            vector<string> strVec;
-            strVec.push_back(index);
-            strVec.push_back(matched_index);
-            strVec.push_back(sample_name);
-            index_dictionary[name] = strVec;
+        // Reader threads -> matching/serialising workers -> writer threads
+        Pipeline pipeline (threads, deterministic);
+        string error;
+        WriterPool writers (&outputs, min(threads, outputs.size()));
+        pipeline.run(
+            readers,
+            [&](ReadBatch* batch) {
+                batch -> chunks.resize(outputs.size());
+                SampleCounts& counts = sample_counts.local();
+                LockstepRecords records;
+                for (int i = 0; i < batch -> reads.size(); ++i) {
+                    records.read = batch -> reads[i];
+                    if (paired) {
+                        records.mate = batch -> reads2[i];
+                    }
+                    if (index) {
+                        records.index = batch -> mates[i];
+                    }
+                    if (index2) {
+                        records.index2 = batch -> mates2[i];
+                    }
+                    if (batch -> error.empty()) {
+                        sameRead(records, index, index2, paired, batch -> first + i + 1, batch -> shard, batch -> error);
+                    }
+                    int sample_id = assign(records, counts);
+                    counts.addRead(sample_id);
+                    appendRecord(batch -> chunks[sample_id], records.read);
+                    if (paired) {
+                        appendRecord(batch -> chunks[sample_id + mate_offset], records.mate);
+                    }
+                    if (sample_id != UNASSIGNED_ID) {
+                        ++batch -> matched;
+                    }
+                }
+                // the records are serialised, only the chunks go to the writers
+                batch -> reads.clear();
+                batch -> reads2.clear();
+                batch -> mates.clear();
+                batch -> mates2.clear();
+                batch -> arena.clear();
+            },
+            [&](ReadBatch* batch) {
+                if (!batch -> error.empty()) {
+                    error = batch -> error;
+                    pipeline.stop();
+                    delete batch;
+                    return;
+                }
+                totals.reads += batch -> records;
+                totals.matched_reads += batch -> matched;
+                printProgress(totals.reads);
+                writers.write(batch);
+            });
+        writers.finish();
+        // reported once every thread is joined
+        if (!error.empty()) {
+            error_exit(error);
         }
+    } else {
+
+        // Records are views into the input, nothing is copied until output
+        LockstepRecords records;
+        SampleCounts& counts = sample_counts.local();
+        while (nextRecords(inputs, records)) {
 
-        delete r1;
+            ++totals.reads;
+            printProgress(totals.reads);
+
+            string error;
+            if (!sameRead(records, index, index2, paired, totals.reads, 0, error)) {
+                error_exit(error);
+            }
+            int sample_id = assign(records, counts);
+            counts.addRead(sample_id);
+            outputs.write(sample_id, records.read);
+            if (paired) {
+                outputs.write(sample_id + mate_offset, records.mate);
+            }
+            if (sample_id != UNASSIGNED_ID) {
+                ++totals.matched_reads;
+            }
+        }
     }
 
+    outputs.closeAll();
+    double seconds = RUN_STATS.stopStage(totals.reads);
+    PROGRESS.finish(totals.reads);
+    return seconds;
+}
+
+void printReadSummary(long counter_read, long counter_matched_read, double reads_elapsed) {
     cout.precision(4);
     cout 
         << "Read "
-        << counter_index
-        << " total index reads"
+        << counter_read
+        << " total sequencing reads"
         << endl 
         << "Matched "
-        << counter_matched_index
-        << " index reads"
+        << counter_matched_read
+        << " sequencing reads"
         << endl
-        << "Sample index match rate: "
-        << (double)counter_matched_index / (double)counter_index * 100.00
+        << "Sequencing read match rate: "
+        << (double)counter_matched_read / (double)counter_read * 100.00
         << "%"
+        << endl
+        << "Sequencing read throughput: "
+        << (long)(reads_elapsed > 0 ? counter_read / reads_elapsed : 0)
+        << " reads/s"
+        << endl
         << endl;
+}
 
-    // Parse out samples from main FASTQ read file
-
-    // Get list of barcode_dictionary + UNASSIGNED_VALUE
-    // Open files
-    string output_prefix = reads_file.substr(0, reads_file.find_last_of(FASTQ_DELIMITER));
+void printCompressionSummary(BgzfCompressor& compressor) {
+    cout.precision(4);
+    cout
+        << "Output compression time: "
+        << compressor.seconds()
+        << " s across all threads ("
+        << compressor.bytesIn() / 1000000.0
+        << " MB to "
+        << compressor.bytesOut() / 1000000.0
+        << " MB)"
+        << endl;
+}
+
+// The counters of a run next to the stage timers, for --stats-json
+void saveRunStats(string stats_json_file, string mode, const RunTotals& totals, SampleOutputs& outputs, BgzfCompressor* compressor) {
+    RUN_STATS.setCounter("index_records", totals.index);
+    RUN_STATS.setCounter("matched_index_records", totals.matched_index);
+    RUN_STATS.setCounter("records", totals.reads);
+    RUN_STATS.setCounter("matched_records", totals.matched_reads);
+    RUN_STATS.setCounter("output_bytes", outputs.bytesWritten());
+    // what went to the disk: compressed outputs and join files included
+    RUN_STATS.setCounter("bytes_written", (compressor != NULL ? compressor -> bytesOut() : outputs.bytesWritten()) + totals.spilled_bytes);
+    if (!RUN_STATS.writeJson(stats_json_file, mode)) {
+        error_exit("Failed to write to file: " + stats_json_file);
+    }
+    cout
+        << "Run statistics written to "
+        << stats_json_file
+        << endl;
+}
+
+// Per-sample counts of the run, as TSV and/or JSON
+void saveSampleReport(SampleCountsSet& sample_counts, string report_tsv_file, string report_json_file, string unknown_tsv_file, int unknown_top,
+        const vector<string>& sample_names, const vector<vector<string>>& sample_barcodes) {
+    SampleCounts counts = sample_counts.merged();
+    if (report_tsv_file != "") {
+        if (!counts.writeTsv(report_tsv_file, sample_names, sample_barcodes)) {
+            error_exit("Failed to write to file: " + report_tsv_file);
+        }
+        cout
+            << "Per-sample report written to "
+            << report_tsv_file
+            << endl;
+    }
+    if (report_json_file != "") {
+        if (!counts.writeJson(report_json_file, sample_names, sample_barcodes)) {
+            error_exit("Failed to write to file: " + report_json_file);
+        }
+        cout
+            << "Per-sample report written to "
+            << report_json_file
+            << endl;
+    }
+    if (unknown_tsv_file != "") {
+        const UnknownIndexes& unknown = counts.unknown();
+        if (!unknown.writeTsv(unknown_tsv_file, sample_names, sample_barcodes, unknown_top)) {
+            error_exit("Failed to write to file: " + unknown_tsv_file);
+        }
+        cout
+            << "Top unassigned indexes of "
+            << unknown.total()
+            << " ("
+            << unknown.unpacked()
+            << " too long or not ACGTN) written to "
+            << unknown_tsv_file
+            << endl;
+    }
+}
+
+void saveShardSummary(ShardSummary& summary, string shard_dir, const RunTotals& totals) {
+    summary.mIndexReads = totals.index;
+    summary.mMatchedIndexReads = totals.matched_index;
+    summary.mReads = totals.reads;
+    summary.mMatchedReads = totals.matched_reads;
+    summary.mReadsSeconds = totals.reads_seconds;
+    summary.save(shard_dir);
+    cout
+        << "Shard outputs and summary written to "
+        << shard_dir
+        << endl;
+}
+
+// Files written at the end of a run besides the sample files, "" for none
+struct RunReports {
+    string report_tsv_file;
+    string report_json_file;
+    string unknown_tsv_file;
+    int unknown_top;
+    string stats_json_file;
+    ShardSummary* shard_summary;    // NULL unless --shard
+    string shard_dir;
+};
+
+// The end of every mode: the read summary, the reports asked for and the
+// elapsed time
+void finishRun(string mode, const RunTotals& totals, const RunReports& reports, SampleOutputs& outputs, BgzfCompressor* compressor,
+        SampleCountsSet& sample_counts, const vector<string>& sample_names, const vector<vector<string>>& sample_barcodes) {
+    printReadSummary(totals.reads, totals.matched_reads, totals.reads_seconds);
+    if (compressor != NULL) {
+        printCompressionSummary(*compressor);
+    }
+
+    if (reports.shard_summary != NULL) {
+        saveShardSummary(*reports.shard_summary, reports.shard_dir, totals);
+    }
+    if (reports.report_tsv_file != "" || reports.report_json_file != "" || reports.unknown_tsv_file != "") {
+        saveSampleReport(sample_counts, reports.report_tsv_file, reports.report_json_file, reports.unknown_tsv_file, reports.unknown_top, sample_names, sample_barcodes);
+    }
+    if (reports.stats_json_file != "") {
+        saveRunStats(reports.stats_json_file, mode, totals, outputs, compressor);
+    }
+
+    // Exit
+    stop(); // stop and print elapsed time
+    cout.flush();
+}
+
+// demultiplex_satay merge [-o prefix] <shard directory> ...
+int mergeMain(int argc, char* argv[]) {
+
+    cmdline::parser cmd;
+    //prefix of the merged sample files
+    cmd.add<string>("output-prefix", 'o', "Prefix of the merged sample files (default: that of a single-node run)", false, "");
+    cmd.add<string>("output-prefix2", 'O', "Prefix of the merged second read files of paired-end shards (default: that of a single-node run)", false, "");
+    cmd.footer("<shard directory> ...");
+    cmd.parse_check(argc, argv);
+
+    if (cmd.rest().empty()) {
+        cerr << cmd.usage() << endl;
+        return 1;
+    }
+
+    cout
+        << "\ndemultiplex_satay v"
+        << DEMULTIPLEX_SATAY_VER << endl << endl;
+    cout
+        << "Merging shards...\n" << endl;
+
+    start(); // start elapsed time
+
+    vector<ShardSummary> shards;
+    for (int i = 0; i < cmd.rest().size(); ++i) {
+        shards.push_back(ShardSummary::load(cmd.rest()[i]));
+    }
+    string prefix = cmd.get<string>("output-prefix");
+    string prefix2 = cmd.get<string>("output-prefix2");
+    if (prefix == "") {
+        prefix = shards[0].mOutputPrefix;
+    }
+    if (prefix2 == "") {
+        prefix2 = shards[0].mOutputPrefix2;
+    }
+    if (shards[0].mOutputPrefix2 != "" && prefix2 == prefix) {
+        error_exit("Reads and reads2 files would be merged into the same files: " + prefix + "_<sample>" + shards[0].mSuffix);
+    }
+    ShardSummary merged = mergeShards(shards, prefix, prefix2);
+
+    cout
+        << "Merged "
+        << merged.mShards
+        << " shards into "
+        << merged.mOutputPrefix
+        << "_<sample>"
+        << merged.mSuffix
+        << (merged.mOutputPrefix2 != "" ? " and " + merged.mOutputPrefix2 + "_<sample>" + merged.mSuffix : "")
+        << endl
+        << endl;
+    printIndexSummary(merged.mIndexReads, merged.mMatchedIndexReads);
+    cout << endl;
+    printReadSummary(merged.mReads, merged.mMatchedReads, merged.mReadsSeconds);
+
+    stop(); // stop and print elapsed time
+    cout.flush();
+    return 0;
+}
+
+// =============================== //
+// ------------ MAIN ------------- //
+// =============================== //
+int main(int argc, char* argv[]) {
+
+    // Parse user arguments
+    if (argc == 1) {
+        cerr
+            << "demultiplex_satay: demultiplexing for pooled Satay screen reads"
+            << endl
+            << "version "
+            << DEMULTIPLEX_SATAY_VER
+            << endl;
+    }
+    if (argc == 2 && (strcmp(argv[1], "-v")==0 || strcmp(argv[1], "--version")==0)){
+        cerr
+            << "demultiplex_satay "
+            << DEMULTIPLEX_SATAY_VER
+            << endl;
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "merge") == 0) {
+        return mergeMain(argc - 1, argv + 1);
+    }
+
+    cmdline::parser cmd;
+    //input file - sequencing reads
+    cmd.add<string>("reads", 'r', "Input fastq file name", true); 
+    //input file - mates of paired-end sequencing reads
+    cmd.add<string>("reads2", 'R', "Input fastq file name of the second reads of pairs, written to paired outputs", false, ""); 
+    //input file - read indices
+    cmd.add<string>("index", 'i', "Index fastq file name", false, ""); 
+    //input file - second (i5) read indices
+    cmd.add<string>("index2", 'I', "Index 2 (i5) fastq file name, for a three-column i7/i5/sample barcodes table", false, "");
+    //index sequences from the read name comments instead of index files
+    cmd.add("index-from-header", 'H', "Take the index (and +-separated i5) from the comment of each read name instead of an index file");
+    //input file - read indices
+    cmd.add<string>("barcodes", 'b', "Barcodes table file name (tab-delimited)", true); 
+    //threshold for fuzzy searching of read indices
+    cmd.add<int>("fuzzy-threshold", 'f', "Fuzzy index match threshold", false, 1); 
+    //threshold for the i5 index of dual-index barcodes
+    cmd.add<int>("fuzzy-threshold2", '\0', "Fuzzy index 2 (i5) match threshold (default: same as --fuzzy-threshold)", false, -1);
+    //low-quality index bases as wildcards
+    cmd.add<int>("min-index-qual", '\0', "Treat N and index bases below this Phred quality as wildcards when matching (0 for off)", false, 0);
+    //single pass over reads and index files written in the same read order
+    cmd.add("stream", 's', "Read the reads and index files in lockstep (files must be in the same read order)");
+    //lockstep join of files that are nearly in the same read order
+    cmd.add<int>("window", 'w', "Read the reads and index files in lockstep, joining reads up to this many records from their index and the rest at the end (0 for off)", false, 0);
+    //parallel matching and writing
+    cmd.add<int>("threads", 't', "Number of worker threads", false, 1);
+    //multithreaded output in input order
+    cmd.add("deterministic", 'd', "Write multithreaded output in input order (identical to --threads 1)");
+    //gzip level of the per-sample outputs
+    cmd.add<int>("output-compression", 'z', "Write BGZF-compressed .fastq.gz outputs at this gzip level (1-9, 0 for plain .fastq)", false, 0);
+    //memory budget for the read index of the two-pass mode
+    cmd.add<int>("max-memory", 'm', "Memory budget in MB for the read name index (0 for no limit)", false, 0);
+    //read name index on disk for files bigger than the memory budget
+    cmd.add("external", 'x', "Join reads to their indexes through sorted runs on disk, within --max-memory");
+    //index pass results kept for later runs
+    cmd.add<string>("save-assignments", '\0', "Write the barcode matched to each index read to this binary file, for --load-assignments", false, "");
+    cmd.add<string>("load-assignments", '\0', "Take the index assignments from a file of --save-assignments instead of the index file", false, "");
+    //raw index and matched barcode of every index read
+    cmd.add<string>("debug-index", '\0', "Write the raw index, matched barcode and sample of each index read to this TSV file", false, "");
+    //one slice of the input per node, put back together by the merge subcommand
+    cmd.add<string>("shard", '\0', "Process only slice i of N of the input (i/N, from 1/N), for the merge subcommand", false, "");
+    cmd.add<string>("shard-dir", '\0', "Directory for the outputs and summary of --shard (default: <prefix>_shard_<i>_of_<N>)", false, "");
+    //per-sample read counts and match types
+    cmd.add<string>("report-tsv", '\0', "Write the reads of each sample and how their indexes matched (exact, reverse complement, fuzzy by mismatches, ambiguous) to this TSV file", false, "");
+    cmd.add<string>("report-json", '\0', "Write the same per-sample report as JSON to this file", false, "");
+    //most frequent indexes of the unassigned reads
+    cmd.add<string>("unknown-tsv", '\0', "Write the most frequent index sequences of the unassigned reads, with their nearest barcode, to this TSV file", false, "");
+    cmd.add<int>("unknown-top", '\0', "Number of index sequences listed by --unknown-tsv", false, 50);
+    //stage timers and counters of the run
+    cmd.add<string>("stats-json", '\0', "Write the wall and CPU time of each stage, bytes read and written, records and allocations to this JSON file", false, "");
+
+    // Parse arguments
+    cmd.parse_check(argc, argv);
+
+    if (argc == 1) {
+        cerr << cmd.usage() <<endl;
+        return 0;
+    }
+
+    string reads_file = cmd.get<string>("reads");
+    string reads2_file = cmd.get<string>("reads2");
+    string index_file = cmd.get<string>("index");
+    string index2_file = cmd.get<string>("index2");
+    bool index_from_header = cmd.exist("index-from-header");
+    string barcode_file = cmd.get<string>("barcodes");
+    int fuzzy_threshold = cmd.get<int>("fuzzy-threshold");
+    int fuzzy_threshold2 = cmd.exist("fuzzy-threshold2") ? cmd.get<int>("fuzzy-threshold2") : fuzzy_threshold;
+    int min_index_qual = cmd.get<int>("min-index-qual");
+    // the three index and reads files are always read in lockstep
+    bool stream_mode = cmd.exist("stream") || index2_file != "";
+    int window = cmd.get<int>("window");
+    int threads = cmd.get<int>("threads");
+    bool deterministic = cmd.exist("deterministic");
+    int compression_level = cmd.get<int>("output-compression");
+    int max_memory = cmd.get<int>("max-memory");
+    bool external = cmd.exist("external");
+    string save_assignments_file = cmd.get<string>("save-assignments");
+    string load_assignments_file = cmd.get<string>("load-assignments");
+    string debug_index_file = cmd.get<string>("debug-index");
+    string shard_option = cmd.get<string>("shard");
+    string shard_dir = cmd.get<string>("shard-dir");
+    string stats_json_file = cmd.get<string>("stats-json");
+    string report_tsv_file = cmd.get<string>("report-tsv");
+    string report_json_file = cmd.get<string>("report-json");
+    string unknown_tsv_file = cmd.get<string>("unknown-tsv");
+    int unknown_top = cmd.get<int>("unknown-top");
+    int shard = 0;
+    int shard_count = 0;
+    if (shard_option != "") {
+        sscanf(shard_option.c_str(), "%d/%d", &shard, &shard_count);
+    }
+
+    // Print user inputs
+    cout
+        << "\ndemultiplex_satay v"
+        << DEMULTIPLEX_SATAY_VER << endl << endl;
+    cout
+        << "Provided sequencing reads file name:           "
+        << reads_file << endl;
+    if (reads2_file != "") {
+        cout
+            << "Provided sequencing reads 2 file name:         "
+            << reads2_file << endl;
+    }
+    cout
+        << "Provided index reads file name:                "
+        << (index_from_header ? "(read name comments)" : load_assignments_file != "" ? "(" + load_assignments_file + ")" : index_file) << endl;
+    if (index2_file != "") {
+        cout
+            << "Provided index 2 reads file name:              "
+            << index2_file << endl;
+    }
+    cout
+        << "Provided barcode file name:                    "
+        << barcode_file << endl;
+    cout
+        << "Provided fuzzy mapping threshold:              "
+        << fuzzy_threshold
+        << (index2_file != "" || index_from_header ? " (index 2: " + to_string(fuzzy_threshold2) + ")" : "") << endl;
+    cout
+        << "Minimum index base quality:                    "
+        << (min_index_qual > 0 ? to_string(min_index_qual) : "off") << endl;
+    cout
+        << "Lockstep streaming mode:                       "
+        << (stream_mode ? "on" : "off") << endl;
+    if (window > 0) {
+        cout
+            << "Lockstep join window (records):                "
+            << window << endl;
+    }
+    cout
+        << "Worker threads:                                "
+        << threads << (deterministic ? " (deterministic)" : "") << endl;
+    cout
+        << "Output compression level:                      "
+        << compression_level << endl;
+    cout
+        << "Memory budget for read index (MB):             "
+        << (max_memory > 0 ? to_string(max_memory) : "unlimited") << endl;
+    if (external) {
+        cout
+            << "External join on disk:                         on" << endl;
+    }
+    cout
+        << "Input shard:                                   "
+        << (shard_count > 0 ? to_string(shard) + " of " + to_string(shard_count) : "all") << endl << endl;
+    cout 
+        << "--------------------------------------------------------------"
+        << endl
+        << endl;
+    cout
+        << "Demultiplexing reads...\n" << endl;
+
+    // Check the inputs and exit if one doesn't work
+    if (reads_file == index_file) {
+        cout
+            << "Error: Reads and index file names can not be identical"
+            << endl;
+        return 1;
+    }
+    if (reads_file == "") {
+        cout
+            << "Error: Reads file name cannot be blank"
+            << endl;
+        return 1;
+    }
+    if (index_file == "" && !index_from_header && load_assignments_file == "") {
+        cout
+            << "Error: Index file name cannot be blank"
+            << endl;
+        return 1;
+    }
+    if (index_from_header && (index_file != "" || index2_file != "")) {
+        cout
+            << "Error: --index-from-header does not take index files"
+            << endl;
+        return 1;
+    }
+    if (barcode_file == "") {
+        cout
+            << "Error: Barcode file name cannot be blank"
+            << endl;
+        return 1;
+    }
+    if (fuzzy_threshold < 0 || fuzzy_threshold2 < 0) {
+        cout
+            << "Fuzzy mapping threshold cannot be less than 0"
+            << endl;
+        return 1;
+    }
+    if (unknown_top < 1 || unknown_top > 100000) {
+        cout
+            << "Error: --unknown-top must be between 1 and 100000"
+            << endl;
+        return 1;
+    }
+    if (min_index_qual < 0 || min_index_qual > 93) {
+        cout
+            << "Error: Minimum index base quality must be between 0 and 93"
+            << endl;
+        return 1;
+    }
+    if (reads2_file != "" && (reads2_file == reads_file || reads2_file == index_file || reads2_file == index2_file)) {
+        cout
+            << "Error: Reads 2 file name must differ from the reads and index file names"
+            << endl;
+        return 1;
+    }
+    if (index2_file != "" && (index2_file == index_file || index2_file == reads_file)) {
+        cout
+            << "Error: Index 2 file name must differ from the reads and index file names"
+            << endl;
+        return 1;
+    }
+    if (threads < 1) {
+        cout
+            << "Number of threads cannot be less than 1"
+            << endl;
+        return 1;
+    }
+    if (compression_level < 0 || compression_level > 9) {
+        cout
+            << "Output compression level must be between 0 and 9"
+            << endl;
+        return 1;
+    }
+    if (max_memory < 0) {
+        cout
+            << "Memory budget cannot be less than 0"
+            << endl;
+        return 1;
+    }
+    if (shard_option != "" && (shard_count < 1 || shard < 1 || shard > shard_count)) {
+        cout
+            << "Shard must be given as i/N with 1 <= i <= N"
+            << endl;
+        return 1;
+    }
+    if (window < 0) {
+        cout
+            << "Join window cannot be less than 0"
+            << endl;
+        return 1;
+    }
+    if (window > 0 && (stream_mode || index_from_header || shard_option != "" || debug_index_file != "")) {
+        cout
+            << "Error: --window cannot be combined with --stream, --index2, --index-from-header, --shard or --debug-index"
+            << endl;
+        return 1;
+    }
+    if (external && (stream_mode || index_from_header || window > 0)) {
+        cout
+            << "Error: --external cannot be combined with --stream, --index2, --index-from-header or --window"
+            << endl;
+        return 1;
+    }
+    if ((save_assignments_file != "" || load_assignments_file != "") && (stream_mode || index_from_header || window > 0 || external)) {
+        cout
+            << "Error: --save-assignments and --load-assignments only work in the default two-pass mode"
+            << endl;
+        return 1;
+    }
+    if (load_assignments_file != "" && (index_file != "" || save_assignments_file != "" || debug_index_file != "")) {
+        cout
+            << "Error: --load-assignments replaces the index file, it cannot be combined with --index, --save-assignments or --debug-index"
+            << endl;
+        return 1;
+    }
+    if (external && max_memory == 0) {
+        cout
+            << "Error: --external needs a --max-memory budget"
+            << endl;
+        return 1;
+    }
+
+    // Begin processing file
+    
+    start(); // start elapsed time
+    if (stats_json_file != "") {
+        RunStats::countAllocations(true);
+    }
+    RUN_STATS.startStage("barcode_load");
+
+    // Read barcode file
+    vector<string> barcodeindex, barcodeindex2, barcode_sample;
+    int success = readBarcodes(barcode_file, &barcodeindex, &barcodeindex2, &barcode_sample);
+    if (success == 1) {
+        return 1;
+    }
+    int barcode_number = barcodeindex.size();
+    bool dual_index = !barcodeindex2.empty();
+    if (!index_from_header && dual_index != (index2_file != "")) {
+        cout
+            << "Error: A three-column barcodes file and --index2 must be given together"
+            << endl;
+        return 1;
+    }
+
+    // Populate barcode map, dual-index barcodes are keyed by i7+i5
+    BarcodeMap barcode_dictionary;
+    for (int i = 0; i < barcodeindex.size(); ++i) {
+        string key = dual_index ? barcodeindex[i] + "+" + barcodeindex2[i] : barcodeindex[i];
+        barcode_dictionary[key] = stripSpecial(barcode_sample[i]);
+    }
+
+    // Number each output sample so the hot loops never handle sample names
+    vector<string> sample_names;
+    SampleIdMap sample_ids;
+    sample_names.push_back(UNASSIGNED_VALUE);
+    sample_ids[UNASSIGNED_VALUE] = UNASSIGNED_ID;
+    for (auto it = barcode_dictionary.begin(); it != barcode_dictionary.end(); ++it) {
+        if (sample_ids.count(it -> second) == 0) {
+            sample_ids[it -> second] = sample_names.size();
+            sample_names.push_back(it -> second);
+        }
+    }
+
+    if (sample_names.size() >= READ_INDEX_MAX_SAMPLES) {
+        error_exit("Too many samples in barcode file: " + barcode_file);
+    }
+
+    // Precompute every sequence within the fuzzy threshold of each barcode
+    // Dual-index barcodes go into a table per index instead
+    vector<string> table_barcodes, table_barcodes2;
+    vector<int> table_sample_ids;
+    for (auto it = barcode_dictionary.begin(); it != barcode_dictionary.end(); ++it) {
+        if (dual_index) {
+            size_t plus = it -> first.find('+');
+            table_barcodes.push_back(it -> first.substr(0, plus));
+            table_barcodes2.push_back(it -> first.substr(plus + 1));
+        } else {
+            table_barcodes.push_back(it -> first);
+        }
+        table_sample_ids.push_back(sample_ids[it -> second]);
+    }
+    // Saved barcode ids are 16 bits, the largest marking unassigned reads
+    if (save_assignments_file != "" && table_barcodes.size() >= ASSIGNMENT_UNASSIGNED) {
+        error_exit("Too many barcodes in barcode file for --save-assignments: " + barcode_file);
+    }
+    // The barcode lookup tables take at most half of the --max-memory budget,
+    // larger ones fall back to scanning the barcodes, and the read index or
+    // the join gets what they leave
+    size_t memory_budget = (size_t)max_memory << 20;
+    BarcodeTable barcode_table (dual_index ? vector<string>() : table_barcodes, dual_index ? vector<int>() : table_sample_ids, fuzzy_threshold, min_index_qual,
+        memory_budget / 2);
+    DualBarcodeTable dual_table (table_barcodes2.empty() ? vector<string>() : table_barcodes, table_barcodes2, table_sample_ids, fuzzy_threshold, fuzzy_threshold2, min_index_qual,
+        memory_budget / 2);
+    size_t index_budget = memory_budget > 0 ? memory_budget - barcode_table.memoryBytes() - dual_table.memoryBytes() : 0;
+    RUN_STATS.stopStage(barcode_number);
+
+    // Reads and index matches per sample id, counted on each thread and
+    // added up at the end; wildcards can make fuzzy matches of 0 mismatches
+    vector<vector<string>> sample_barcodes (sample_names.size());
+    for (auto it = barcode_dictionary.begin(); it != barcode_dictionary.end(); ++it) {
+        sample_barcodes[sample_ids[it -> second]].push_back(it -> first);
+    }
+    SampleCountsSet sample_counts (sample_names.size(), min_index_qual > 0 ? 0 : 1, dual_index ? fuzzy_threshold + fuzzy_threshold2 : fuzzy_threshold,
+        unknown_tsv_file != "" ? unknown_top * UNKNOWN_SLOTS_PER_TOP : 0);
+
+    // Get list of barcode_dictionary + UNASSIGNED_VALUE
+    // Open files
+    // Paired-end runs write the second reads to <reads2 prefix>_<sample>.fastq
+    string output_prefix = outputPrefix(reads_file);
+    string output_prefix2 = reads2_file != "" ? outputPrefix(reads2_file) : "";
+    if (output_prefix2 == output_prefix) {
+        error_exit("Reads and reads2 files would write to the same output files: " + output_prefix + "_<sample>.fastq");
+    }
+
+    // A shard writes into its own directory, under the same file names
+    string output_suffix = FASTQ_SUFFIX + (compression_level > 0 ? GZIP_SUFFIX : "");
+    string file_prefix = output_prefix;
+    string file_prefix2 = output_prefix2;
+    ShardSummary shard_summary;
+    InputSlice slice = {0, string::npos, 0, string::npos, 0, string::npos, 0, string::npos, 0, -1};
+    if (shard_count > 0) {
+        if (shard_dir == "") {
+            shard_dir = output_prefix + "_shard_" + to_string(shard) + "_of_" + to_string(shard_count);
+        }
+        struct stat shard_dir_stat;
+        if (stat(shard_dir.c_str(), &shard_dir_stat) != 0 && mkdir(shard_dir.c_str(), 0755) != 0) {
+            error_exit("Failed to create shard directory: " + shard_dir);
+        }
+        file_prefix = joinpath(shard_dir, basename(output_prefix));
+        if (reads2_file != "") {
+            file_prefix2 = joinpath(shard_dir, basename(output_prefix2));
+        }
+        shard_summary.mShard = shard;
+        shard_summary.mShards = shard_count;
+        shard_summary.mStream = stream_mode || index_from_header;
+        shard_summary.mOutputPrefix = output_prefix;
+        shard_summary.mOutputPrefix2 = output_prefix2;
+        shard_summary.mSuffix = output_suffix;
+        shard_summary.mSamples = sample_names;
+        slice = sliceInputs(index_file, index2_file, reads_file, reads2_file, stream_mode, shard, shard_count, threads);
+    }
 
     // Delete existing files of same names
-    for (auto it_d = barcode_dictionary.begin(); it_d != barcode_dictionary.end(); ++it_d) {
-        auto key = it_d -> first;
-        auto value = it_d -> second;
-        string file_name = output_prefix + "_" + value + FASTQ_SUFFIX;
+    // The second reads of sample id i go to output mate_offset + i
+    bool paired = reads2_file != "";
+    int mate_offset = sample_names.size();
+    vector<string> output_files;
+    for (int i = 0; i < (paired ? 2 : 1) * sample_names.size(); ++i) {
+        string prefix = i < mate_offset ? file_prefix : file_prefix2;
+        string file_name = prefix + "_" + sample_names[i % mate_offset] + output_suffix;
         char* file_name_c = const_cast<char*>(file_name.c_str());
 
         // Delete if exists
@@ -436,81 +1315,559 @@ int main(int argc, char* argv[]) {
         if (infile.good()) {
             remove(file_name_c);
         }
+        output_files.push_back(file_name);
     }
-    
-    string this_file, output_destination;
 
-    // Read sequence fastq file
-    FastqReader reader2 (reads_file); // initialize input FASTQ file
-    Read* r2 = NULL;
+    // Each sample file is opened once, on its first read, and buffered
+    // Compression threads are only started when the outputs are compressed
+    // With --external the buffers of the sample files, and the BGZF blocks
+    // in flight, take a quarter of what the barcode tables leave of the
+    // --max-memory budget at most and the join gets the rest
+    size_t output_budget = WRITER_BUFFER_BUDGET;
+    if (external) {
+        output_budget = min(output_budget, index_budget / 4 / (compression_level > 0 ? WRITER_BGZF_BUFFERS : 1));
+    }
+    BgzfCompressor compressor (compression_level, compression_level > 0 ? threads : 1);
+    SampleOutputs outputs (output_files, compression_level > 0 ? &compressor : NULL, output_budget);
+
+    RunTotals totals = {0, 0, 0, 0, 0, 0};
+    RunReports reports = {report_tsv_file, report_json_file, unknown_tsv_file, unknown_top, stats_json_file,
+        shard_count > 0 ? &shard_summary : NULL, shard_dir};
+
+    if (index_from_header) {
+
+        // The index of each read is in its name, so the reads file is the
+        // only input and each read is written as soon as it has been matched
+        // Paired-end runs read the second reads in lockstep
+        // Without --deterministic the file is cut into one byte range per
+        // thread, each with its own reader
+        cout 
+            << endl
+            << "Reading sequence read file, indexes from read names..."
+            << endl;
+        LockstepInputs inputs = openInputs(reads_file, reads2_file, "", "", threads, slice);
+        vector<LockstepInputs> shards;
+        if (threads > 1 && !deterministic && slice.records < 0) {
+            shards = openReadShards(reads_file, reads2_file, threads, slice.readsBegin, slice.readsEnd);
+        }
+        totals.reads_seconds = demultiplexReads(inputs, shards, threads, deterministic,
+            [&](const LockstepRecords& r, SampleCounts& counts) {
+                return assignHeaderSample(r.read.name, r.read.nameLen, dual_index, barcode_table, dual_table, counts);
+            },
+            outputs, mate_offset, sample_counts, totals);
+        closeInputs(shards);
+        closeInputs(inputs);
+        totals.index = totals.reads;
+        totals.matched_index = totals.matched_reads;
+
+        printIndexSummary(totals.index, totals.matched_index);
+        cout << endl;
+        finishRun("index-from-header", totals, reports, outputs, compression_level > 0 ? &compressor : NULL, sample_counts, sample_names, sample_barcodes);
+        return 0;
+    }
+
+    if (stream_mode) {
+
+        // All files are read in the same order, so each read is assigned and
+        // written as soon as its index has been matched; dual-index runs read
+        // the i5 file in lockstep too, and paired-end runs the second reads
+        // Without --deterministic all files are cut at the same records and
+        // each set of shards gets its own reader thread
+        cout 
+            << endl
+            << "Reading index and sequence read files in lockstep..."
+            << endl;
+        LockstepInputs inputs = openInputs(reads_file, reads2_file, index_file, index2_file, threads, slice);
+        vector<LockstepInputs> shards;
+        if (threads > 1 && !deterministic && slice.records < 0) {
+            shards = openStreamShards(index_file, index2_file, reads_file, reads2_file, threads, slice.indexBegin, slice.indexEnd);
+        }
+        totals.reads_seconds = demultiplexReads(inputs, shards, threads, deterministic,
+            [&](const LockstepRecords& r, SampleCounts& counts) {
+                if (dual_index) {
+                    return assignDualSample(r.index.seq, r.index.seqLen, r.index.quality, r.index2.seq, r.index2.seqLen, r.index2.quality, dual_table, counts);
+                }
+                return assignSample(r.index.seq, r.index.seqLen, r.index.quality, barcode_table, counts);
+            },
+            outputs, mate_offset, sample_counts, totals);
+        closeInputs(shards);
+        closeInputs(inputs);
+        totals.index = totals.reads;
+        totals.matched_index = totals.matched_reads;
+
+        printIndexSummary(totals.index, totals.matched_index);
+        cout << endl;
+        finishRun("stream", totals, reports, outputs, compression_level > 0 ? &compressor : NULL, sample_counts, sample_names, sample_barcodes);
+        return 0;
+    }
+
+    if (window > 0) {
+
+        // A read read together with its index is written straight away, one
+        // up to window records from its index waits for it in memory, and the
+        // rest is joined at the end
+        FastqReader index_reader (index_file, true, false, threads);
+        FastqReader reads_reader (reads_file, true, false, threads);
+        FastqReader* mate_reader = paired ? new FastqReader(reads2_file, true, false, threads) : NULL;
+        SampleCounts& counts = sample_counts.local();
+        WindowJoin join (window, file_prefix, [&](int sample_id, const string& record, const string& mate) {
+            counts.addRead(sample_id);
+            outputs.writer(sample_id) -> write(record);
+            if (paired) {
+                outputs.writer(sample_id + mate_offset) -> write(mate);
+            }
+            if (sample_id != UNASSIGNED_ID) {
+                ++totals.matched_reads;
+            }
+        });
+
+        cout 
+            << endl
+            << "Reading index and sequence read files in lockstep, joining within "
+            << window
+            << " records..."
+            << endl;
+        RUN_STATS.startStage("reads_pass");
+        PROGRESS.start("Reads pass", inputBytes({&index_reader, &reads_reader, mate_reader}));
+
+        // Each file is read one record at a time, both at once unless records
+        // missing from one have put the other ahead
+        FastqRecord r1, r2, m2;
+        bool index_left = true;
+        bool reads_left = true;
+        while (index_left || reads_left) {
+            long ahead = totals.index - totals.reads - join.drift();
+            bool has_index = false;
+            bool has_read = false;
+            if (index_left && (ahead <= 0 || !reads_left)) {
+                has_index = index_left = index_reader.next(r1);
+            }
+            if (reads_left && (ahead >= 0 || !index_left)) {
+                has_read = reads_left = reads_reader.next(r2);
+            }
+            if (!has_index && !has_read) {
+                continue;
+            }
+
+            int index_sample = UNASSIGNED_ID;
+            if (has_index) {
+                ++totals.index;
+                index_sample = assignSample(r1.seq, r1.seqLen, r1.quality, barcode_table, counts);
+                if (index_sample != UNASSIGNED_ID) {
+                    ++totals.matched_index;
+                }
+            }
+            if (has_read) {
+                ++totals.reads;
+                printProgress(totals.reads);
+                if (paired) {
+                    if (!mate_reader -> next(m2)) {
+                        error_exit("Reads2 file has fewer reads than the reads file");
+                    }
+                    checkMates(r2, m2, totals.reads);
+                }
+            }
+            join.advance(totals.index, totals.reads);
+
+            int sample_id = index_sample;
+            if (!has_index || !has_read || !sameReadName(r1, r2)) {
+                if (has_index) {
+                    join.addIndex(r1.name, nameKeyLength(r1.name, r1.nameLen), index_sample);
+                }
+                if (!has_read) {
+                    continue;
+                }
+                sample_id = join.addRead(r2.name, nameKeyLength(r2.name, r2.nameLen), r2, paired ? &m2 : NULL);
+                if (sample_id < 0) {
+                    continue;
+                }
+            }
+            counts.addRead(sample_id);
+            outputs.write(sample_id, r2);
+            if (paired) {
+                outputs.write(sample_id + mate_offset, m2);
+            }
+            if (sample_id != UNASSIGNED_ID) {
+                ++totals.matched_reads;
+            }
+        }
+        if (paired && mate_reader -> next(m2)) {
+            error_exit("Reads2 file has more reads than the reads file");
+        }
+        delete mate_reader;
+
+        totals.reads_seconds = RUN_STATS.stopStage(totals.reads);
+        PROGRESS.finish(totals.reads);
+
+        // Reads whose index never came are unassigned
+        RUN_STATS.startStage("join");
+        join.finish(UNASSIGNED_ID);
+        outputs.closeAll();
+        totals.reads_seconds += RUN_STATS.stopStage(join.spilledReads());
+
+        printIndexSummary(totals.index, totals.matched_index);
+        cout
+            << "Joined outside the window: "
+            << join.spilledIndexes()
+            << " index reads, "
+            << join.spilledReads()
+            << " sequencing reads (at most "
+            << join.peakWaiting()
+            << " waiting in memory)"
+            << endl
+            << endl;
+        finishRun("window", totals, reports, outputs, compression_level > 0 ? &compressor : NULL, sample_counts, sample_names, sample_barcodes);
+        return 0;
+    }
+
+    // Read index fastq file
+    FastqRecord r1;
+
+    // Read name key -> sample id, sized from the file once the first
+    // reads show how long a record is
+    ReadIndex index_dictionary (0, index_budget);
+
+    // With --external the keys go to sorted runs on disk instead
+    ExternalJoin* external_join = external ? new ExternalJoin(index_budget - outputs.memoryBytes(), file_prefix) : NULL;
+
+    // Illumina names become integer keys once the first name gives the
+    // instrument:run:flowcell prefix, other names are hashed
+    NameCodec name_codec;
+    long counter_packed_names = 0;
+
+    // The matched barcode of every index read, for later runs
+    AssignmentWriter* assignment_writer = save_assignments_file != "" ? new AssignmentWriter(save_assignments_file, table_barcodes, fuzzy_threshold, min_index_qual) : NULL;
+
+    // The raw index and matched barcode are only kept for the debug output
+    ofstream debug_index;
+    if (debug_index_file != "") {
+        debug_index.open(debug_index_file.c_str());
+        if (!debug_index) {
+            error_exit("Failed to open file for writing: " + debug_index_file);
+        }
+        debug_index << "read\tindex\tmatched_barcode\tsample" << endl;
+    }
 
     // Process reads from index FASTQ file to identify read sample indices
-    int counter_read = 0;
-    int counter_matched_read = 0;
+    RUN_STATS.startStage("index_pass");
     cout 
         << endl
-        << "Reading sequence read file..."
+        << (load_assignments_file != "" ? "Reading index assignment file..." : "Reading index file...")
         << endl;
 
-    while (true) { 
+    if (load_assignments_file != "") {
 
-        r2 = reader2.read();
+        // Saved with the same barcodes and threshold, the records go straight
+        // into the read index; the samples are those of this barcodes file
+        AssignmentFile assignments (load_assignments_file);
+        string stale = assignments.staleReason(table_barcodes, fuzzy_threshold, min_index_qual);
+        if (stale != "") {
+            error_exit("Assignment file " + load_assignments_file + " is stale, it was " + stale);
+        }
+        name_codec.setPrefix(assignments.namePrefix());
+        index_dictionary.reserve(assignments.size());
+        SampleCounts& counts = sample_counts.local();
+        for (size_t i = 0; i < assignments.size(); ++i) {
+            Assignment assignment = assignments.record(i);
+            if (assignment.barcode >= (int)table_sample_ids.size()) {
+                error_exit("Assignment file is corrupt: " + load_assignments_file);
+            }
+            int sample_id = assignment.barcode < 0 ? UNASSIGNED_ID : table_sample_ids[assignment.barcode];
+            counts.addIndex(sample_id, assignment.type, assignment.mismatches, assignment.ambiguous);
+            ++totals.index;
+            if (sample_id != UNASSIGNED_ID) {
+                ++totals.matched_index;
+            }
+            if (NameCodec::isPacked(assignment.key)) {
+                ++counter_packed_names;
+            }
+            index_dictionary.insert(assignment.key, sample_id);
+        }
+        string name;
+        int barcode;
+        while (assignments.nextResolved(name, barcode)) {
+            if (barcode >= (int)table_sample_ids.size()) {
+                error_exit("Assignment file is corrupt: " + load_assignments_file);
+            }
+            index_dictionary.resolve(name, barcode < 0 ? UNASSIGNED_ID : table_sample_ids[barcode]);
+        }
+    } else if (threads > 1) {
 
-        if (r2 == NULL) {
-            break;
-        } else {
-            ++counter_read;
-            if (counter_read % UPDATE_FREQUENCY == 0) {
-                cout 
-                    << counter_read
-                    << " reads processed"
-                    << endl;
+        FastqReader reader1 (index_file, true, false, threads); // initialize input FASTQ file
+        PROGRESS.start("Index pass", inputBytes({&reader1}));
+
+        // Without --debug-index the file is cut into one byte range per thread;
+        // the read index ends up the same whatever order the names come in
+        vector<FastqReader*> index_shards;
+        if (!debug_index.is_open()) {
+            vector<size_t> index_offsets = shardOffsets(index_file, threads);
+            if (!index_offsets.empty()) {
+                index_shards = openShards(index_file, index_offsets);
+                FastqReader first_reader (index_file);
+                if (first_reader.next(r1)) {
+                    name_codec.learn(r1.name, nameKeyLength(r1.name, r1.nameLen));
+                }
+            }
+        }
+        long shard_count = max((size_t)1, index_shards.size());
+
+        // Match in parallel, insert into the read index on this thread
+        atomic<size_t> expected_records (0);
+        auto read_index = [&](FastqReader* reader, int shard) {
+            long records_read = 0;
+            return function<bool(ReadBatch*)>([&, reader, shard, records_read](ReadBatch* batch) mutable {
+                FastqRecord rec;
+                while (batch -> reads.size() < PIPELINE_BATCH_SIZE && reader -> next(rec)) {
+                    if (index_shards.empty() && records_read == 0 && batch -> reads.empty()) {
+                        name_codec.learn(rec.name, nameKeyLength(rec.name, rec.nameLen));
+                    }
+                    batch -> reads.push_back(batch -> arena.copy(rec));
+                }
+                if (shard == 0 && records_read < INDEX_ESTIMATE_RECORDS && records_read + (long)batch -> reads.size() >= INDEX_ESTIMATE_RECORDS) {
+                    expected_records = estimateRecords(*reader, records_read + batch -> reads.size()) * shard_count;
+                }
+                records_read += batch -> reads.size();
+                return !batch -> reads.empty();
+            });
+        };
+        vector<function<bool(ReadBatch*)>> shards;
+        for (int i = 0; i < index_shards.size(); ++i) {
+            shards.push_back(read_index(index_shards[i], i));
+        }
+        if (shards.empty()) {
+            shards.push_back(read_index(&reader1, 0));
+        }
+
+        Pipeline pipeline (threads, true);
+        pipeline.run(
+            shards,
+            [&](ReadBatch* batch) {
+                SampleCounts& counts = sample_counts.local();
+                for (int i = 0; i < batch -> reads.size(); ++i) {
+                    const FastqRecord& r = batch -> reads[i];
+                    batch -> keys.push_back(name_codec.key(r.name, nameKeyLength(r.name, r.nameLen)));
+                    batch -> matches.push_back(barcode_table.match(r.seq, r.seqLen, r.quality));
+                    BarcodeMatch& match = batch -> matches.back();
+                    counts.addIndex(match.barcode < 0 ? UNASSIGNED_ID : match.sampleId, match);
+                    if (match.barcode < 0) {
+                        counts.addUnknown(r.seq, r.seqLen);
+                    }
+                }
+            },
+            [&](ReadBatch* batch) {
+                if (expected_records > 0 && external_join == NULL) {
+                    index_dictionary.reserve(expected_records);
+                    expected_records = 0;
+                }
+                if (assignment_writer != NULL && totals.index == 0) {
+                    assignment_writer -> setNamePrefix(name_codec.prefix());
+                }
+                for (int i = 0; i < batch -> reads.size(); ++i) {
+                    BarcodeMatch& match = batch -> matches[i];
+                    int sample_id = match.barcode < 0 ? UNASSIGNED_ID : match.sampleId;
+                    if (sample_id != UNASSIGNED_ID) {
+                        ++totals.matched_index;
+                    }
+                    const FastqRecord& r = batch -> reads[i];
+                    if (external_join != NULL) {
+                        external_join -> addIndex(batch -> keys[i], r.name, nameKeyLength(r.name, r.nameLen), sample_id);
+                    } else {
+                        index_dictionary.insert(batch -> keys[i], sample_id);
+                    }
+                    if (assignment_writer != NULL) {
+                        assignment_writer -> add(batch -> keys[i], match);
+                    }
+                    if (NameCodec::isPacked(batch -> keys[i])) {
+                        ++counter_packed_names;
+                    }
+                    if (debug_index.is_open()) {
+                        debug_index
+                            << string(r.name, nameKeyLength(r.name, r.nameLen)) << "\t"
+                            << string(r.seq, r.seqLen) << "\t"
+                            << (match.barcode < 0 ? UNASSIGNED_VALUE : barcode_table.barcode(match.barcode)) << "\t"
+                            << sample_names[sample_id] << "\n";
+                    }
+                }
+                totals.index += batch -> records;
+                printProgress(totals.index);
+                delete batch;
+            });
+        for (int i = 0; i < index_shards.size(); ++i) {
+            delete index_shards[i];
+        }
+    } else {
+
+        FastqReader reader1 (index_file, true, false, threads); // initialize input FASTQ file
+        PROGRESS.start("Index pass", inputBytes({&reader1}));
+        SampleCounts& counts = sample_counts.local();
+        while (reader1.next(r1)) {
+
+            ++totals.index;
+            printProgress(totals.index);
+            if (totals.index == INDEX_ESTIMATE_RECORDS && external_join == NULL) {
+                index_dictionary.reserve(estimateRecords(reader1, totals.index));
             }
 
-            // Check read ID - before space
-            // Dictate output file
-            // Append read record to file
-            r2->toString();
-            string full_name = r2 -> mName;
-            string name = full_name.substr(0, full_name.find(FASTQ_ID_DELIMITER));
-
-            if (index_dictionary.count(name) > 0) {
-                output_destination = output_prefix + "_" + index_dictionary[name].at(2) + FASTQ_SUFFIX; // Get matched sample name
-                fstream output(output_destination, fstream::in | fstream::out | fstream::app); // prepare output file
-                output << r2->toString();
-                output.close();
-                if (index_dictionary[name].at(2) != UNASSIGNED_VALUE) {
-                    ++counter_matched_read;
+            int name_length = nameKeyLength(r1.name, r1.nameLen);
+            if (totals.index == 1) {
+                name_codec.learn(r1.name, name_length);
+                if (assignment_writer != NULL) {
+                    assignment_writer -> setNamePrefix(name_codec.prefix());
                 }
+            }
+
+            // Fuzzy search index against barcodes for sample labels
+            BarcodeMatch match = barcode_table.match(r1.seq, r1.seqLen, r1.quality);
+            int sample_id = match.barcode < 0 ? UNASSIGNED_ID : match.sampleId;
+            counts.addIndex(sample_id, match);
+            if (sample_id != UNASSIGNED_ID) {
+                ++totals.matched_index;
             } else {
-                output_destination = output_prefix + "_" + UNASSIGNED_VALUE + FASTQ_SUFFIX;
-                fstream output(output_destination, fstream::in | fstream::out | fstream::app); // prepare output file
-                output << r2->toString();
-                output.close();
+                counts.addUnknown(r1.seq, r1.seqLen);
+            }
+            bool packed;
+            uint64_t key = name_codec.key(r1.name, name_length, &packed);
+            if (external_join != NULL) {
+                external_join -> addIndex(key, r1.name, name_length, sample_id);
+            } else {
+                index_dictionary.insert(key, sample_id);
+            }
+            if (assignment_writer != NULL) {
+                assignment_writer -> add(key, match);
+            }
+            if (packed) {
+                ++counter_packed_names;
             }
-        }  
+            if (debug_index.is_open()) {
+                debug_index
+                    << string(r1.name, name_length) << "\t"
+                    << string(r1.seq, r1.seqLen) << "\t"
+                    << (match.barcode < 0 ? UNASSIGNED_VALUE : barcode_table.barcode(match.barcode)) << "\t"
+                    << sample_names[sample_id] << "\n";
+            }
+        }
+    }
 
-        delete r2;
+    if (debug_index.is_open()) {
+        debug_index.close();
+        if (!debug_index) {
+            error_exit("Failed to write to file: " + debug_index_file);
+        }
     }
+    RUN_STATS.stopStage(totals.index);
+    PROGRESS.finish(totals.index);
 
-    cout.precision(4);
+    // Names that share a hashed key with another name, or appear twice, are
+    // kept by name; this needs a second look at the index file but almost
+    // never happens
+    // Saved assignment files keep these names too
+    if (index_dictionary.hasCollisions() && load_assignments_file == "") {
+        RUN_STATS.startStage("name_collisions");
+        FastqReader reader3 (index_file, true, false, threads);
+        FastqRecord r3;
+        while (reader3.next(r3)) {
+            int name_length = nameKeyLength(r3.name, r3.nameLen);
+            if (index_dictionary.isCollided(name_codec.key(r3.name, name_length))) {
+                BarcodeMatch match = barcode_table.match(r3.seq, r3.seqLen, r3.quality);
+                index_dictionary.resolve(string(r3.name, name_length), match.barcode < 0 ? UNASSIGNED_ID : match.sampleId);
+                if (assignment_writer != NULL) {
+                    assignment_writer -> addResolved(string(r3.name, name_length), match);
+                }
+            }
+        }
+        RUN_STATS.stopStage();
+    }
+    if (assignment_writer != NULL) {
+        assignment_writer -> close();
+        delete assignment_writer;
+    }
+
+    printIndexSummary(totals.index, totals.matched_index);
+    if (external_join != NULL) {
+        external_join -> finishIndex();
+        printExternalJoinSummary(*external_join, outputs, name_codec, counter_packed_names, totals.index);
+    } else {
+        printReadIndexSummary(index_dictionary, name_codec, counter_packed_names, totals.index);
+    }
+
+    // Parse out samples from main FASTQ read file
+
+    // Read sequence fastq file, and the second reads of a paired-end run in
+    // lockstep
+    LockstepInputs inputs = openInputs(reads_file, reads2_file, "", "", threads, slice);
+
+    // Process reads from index FASTQ file to identify read sample indices
     cout 
-        << "Read "
-        << counter_read
-        << " total sequencing reads"
-        << endl 
-        << "Matched "
-        << counter_matched_read
-        << " sequencing reads"
-        << endl
-        << "Sequencing read match rate: "
-        << (double)counter_matched_read / (double)counter_read * 100.00
-        << "%"
         << endl
+        << "Reading sequence read file..."
         << endl;
 
-    // Exit
-    stop(); // stop and print elapsed time
-    cout.flush();
+    if (external_join != NULL) {
+
+        // Each read is written to the partition file of its name, then the
+        // partitions are joined one at a time against the runs
+        RUN_STATS.startStage("reads_pass");
+        PROGRESS.start("Reads pass", inputBytes({inputs.reads, inputs.reads2}));
+        LockstepRecords records;
+        while (nextRecords(inputs, records)) {
+            ++totals.reads;
+            printProgress(totals.reads);
+            if (paired) {
+                checkMates(records.read, records.mate, totals.reads);
+            }
+            int name_length = nameKeyLength(records.read.name, records.read.nameLen);
+            external_join -> addRead(name_codec.key(records.read.name, name_length), name_length, records.read, paired ? &records.mate : NULL);
+        }
+        totals.reads_seconds = RUN_STATS.stopStage(totals.reads);
+        PROGRESS.finish(totals.reads);
+        RUN_STATS.startStage("join");
+        SampleCounts& counts = sample_counts.local();
+        external_join -> finish(UNASSIGNED_ID, [&](int sample_id, const string& record, const string& mate) {
+            counts.addRead(sample_id);
+            outputs.writer(sample_id) -> write(record);
+            if (paired) {
+                outputs.writer(sample_id + mate_offset) -> write(mate);
+            }
+            if (sample_id != UNASSIGNED_ID) {
+                ++totals.matched_reads;
+            }
+        });
+        outputs.closeAll();
+        // the reads pass only partitioned, the join wrote the sample files
+        totals.reads_seconds += RUN_STATS.stopStage(totals.reads);
+        cout
+            << "Joined in "
+            << external_join -> partitions()
+            << " partitions (largest table "
+            << external_join -> tableBytes() / 1000000.0
+            << " MB, "
+            << external_join -> collisions()
+            << " shared name hashes resolved by name, "
+            << external_join -> spilledBytes() / 1000000.0
+            << " MB written to disk)"
+            << endl;
+        totals.spilled_bytes = external_join -> spilledBytes();
+        delete external_join;
+    } else {
+
+        // Without --deterministic the file is cut into one byte range per
+        // thread, each with its own reader
+        // The read index is only read from here on, so workers share it
+        vector<LockstepInputs> shards;
+        if (threads > 1 && !deterministic && slice.records < 0) {
+            shards = openReadShards(reads_file, reads2_file, threads, slice.readsBegin, slice.readsEnd);
+        }
+        totals.reads_seconds = demultiplexReads(inputs, shards, threads, deterministic,
+            [&](const LockstepRecords& r, SampleCounts&) {
+                int name_length = nameKeyLength(r.read.name, r.read.nameLen);
+                int sample_id = index_dictionary.find(name_codec.key(r.read.name, name_length), r.read.name, name_length);
+                return sample_id < 0 ? UNASSIGNED_ID : sample_id;
+            },
+            outputs, mate_offset, sample_counts, totals);
+        closeInputs(shards);
+    }
+    closeInputs(inputs);
+
+    finishRun(external ? "external" : "two-pass", totals, reports, outputs, compression_level > 0 ? &compressor : NULL, sample_counts, sample_names, sample_barcodes);
     return 0;
 }
@@ -0,0 +1,150 @@
+//
+//  namecodec.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "namecodec.h"
+#include "readindex.h"
+#include <string.h>
+
+#define NAME_CODEC_PACKED (1ULL << 63)
+
+int nameKeyLength(const char* name, int len){
+    const char* end = (const char*)memchr(name, NAME_KEY_DELIMITER, len);
+    return end == NULL ? len : end - name;
+}
+
+bool sameMateName(const char* n1, int len1, const char* n2, int len2){
+    int l1 = nameKeyLength(n1, len1);
+    int l2 = nameKeyLength(n2, len2);
+    if(l1 == l2 && l1 > 2 && n1[l1 - 2] == '/' && n2[l2 - 2] == '/') {
+        l1 -= 2;
+        l2 -= 2;
+    }
+    return l1 == l2 && memcmp(n1, n2, l1) == 0;
+}
+
+NameCodec::NameCodec(){
+    mHasPrefix = false;
+}
+
+// Offset of the colon ending the instrument:run:flowcell prefix, -1 if the
+// name does not have one
+static int prefixLength(const char* name, int len){
+    int colons = 0;
+    for(int i=0; i<len; i++) {
+        if(name[i] == ':' && ++colons == 3)
+            return i;
+    }
+    return -1;
+}
+
+void NameCodec::learn(const char* name, int len){
+    if(mHasPrefix)
+        return;
+    if(len > 0 && name[0] == '@') {
+        name++;
+        len--;
+    }
+    int prefixLen = prefixLength(name, len);
+    if(prefixLen <= 0)
+        return;
+    mPrefix.assign(name, prefixLen);
+    mHasPrefix = true;
+
+    // only keep the prefix if the name it came from packs
+    uint64_t key;
+    if(!pack(name, len, key)) {
+        mPrefix.clear();
+        mHasPrefix = false;
+    }
+}
+
+void NameCodec::setPrefix(const string& prefix){
+    mPrefix = prefix;
+    mHasPrefix = !prefix.empty();
+}
+
+bool NameCodec::hasPrefix() const{
+    return mHasPrefix;
+}
+
+const string& NameCodec::prefix() const{
+    return mPrefix;
+}
+
+// Decimal field without sign or leading zeros, so the text can be rebuilt
+static bool parseField(const char*& p, const char* end, char stop, int bits, uint64_t& value){
+    const char* start = p;
+    value = 0;
+    while(p < end && *p != stop) {
+        if(*p < '0' || *p > '9')
+            return false;
+        value = value * 10 + (*p - '0');
+        if(value >> bits)
+            return false;
+        p++;
+    }
+    if(p == start || (*start == '0' && p - start > 1))
+        return false;
+    return true;
+}
+
+bool NameCodec::pack(const char* name, int len, uint64_t& key) const{
+    if(!mHasPrefix || len <= (int)mPrefix.length() || name[mPrefix.length()] != ':'
+        || memcmp(name, mPrefix.data(), mPrefix.length()) != 0)
+        return false;
+
+    const char* p = name + mPrefix.length() + 1;
+    const char* end = name + len;
+    uint64_t lane, tile, x, y;
+    if(!parseField(p, end, ':', NAME_CODEC_LANE_BITS, lane) || p++ == end)
+        return false;
+    if(!parseField(p, end, ':', NAME_CODEC_TILE_BITS, tile) || p++ == end)
+        return false;
+    if(!parseField(p, end, ':', NAME_CODEC_X_BITS, x) || p++ == end)
+        return false;
+    if(!parseField(p, end, ':', NAME_CODEC_Y_BITS, y) || p != end)
+        return false;
+
+    key = NAME_CODEC_PACKED
+        | lane << (NAME_CODEC_TILE_BITS + NAME_CODEC_X_BITS + NAME_CODEC_Y_BITS)
+        | tile << (NAME_CODEC_X_BITS + NAME_CODEC_Y_BITS)
+        | x << NAME_CODEC_Y_BITS
+        | y;
+    return true;
+}
+
+uint64_t NameCodec::key(const char* name, int len, bool* packed) const{
+    if(len > 0 && name[0] == '@') {
+        name++;
+        len--;
+    }
+    uint64_t key;
+    bool isPacked = pack(name, len, key);
+    if(!isPacked) {
+        key = ReadIndex::hash(name, len) >> 1;
+        if(key == 0)
+            key = 1;
+    }
+    if(packed != NULL)
+        *packed = isPacked;
+    return key;
+}
+
+bool NameCodec::decode(uint64_t key, string& name) const{
+    if(!isPacked(key))
+        return false;
+    uint64_t y = key & ((1ULL << NAME_CODEC_Y_BITS) - 1);
+    uint64_t x = (key >> NAME_CODEC_Y_BITS) & ((1ULL << NAME_CODEC_X_BITS) - 1);
+    uint64_t tile = (key >> (NAME_CODEC_X_BITS + NAME_CODEC_Y_BITS)) & ((1ULL << NAME_CODEC_TILE_BITS) - 1);
+    uint64_t lane = (key >> (NAME_CODEC_TILE_BITS + NAME_CODEC_X_BITS + NAME_CODEC_Y_BITS)) & ((1ULL << NAME_CODEC_LANE_BITS) - 1);
+    name = "@" + mPrefix + ":" + to_string(lane) + ":" + to_string(tile) + ":" + to_string(x) + ":" + to_string(y);
+    return true;
+}
+
+bool NameCodec::isPacked(uint64_t key){
+    return (key & NAME_CODEC_PACKED) != 0;
+}
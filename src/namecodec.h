@@ -0,0 +1,65 @@
+//
+//  namecodec.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef NAME_CODEC_H
+#define NAME_CODEC_H
+
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+// Bits of each coordinate in a packed key, the top bit marks packed keys
+#define NAME_CODEC_LANE_BITS 5
+#define NAME_CODEC_TILE_BITS 17
+#define NAME_CODEC_X_BITS 20
+#define NAME_CODEC_Y_BITS 20
+
+// Read names are compared up to the first of these, the comment follows it
+#define NAME_KEY_DELIMITER ' '
+
+// Length of a read name up to NAME_KEY_DELIMITER
+int nameKeyLength(const char* name, int len);
+// Whether two read names are of the two mates of a pair, up to
+// NAME_KEY_DELIMITER and without the /1 and /2 of older Illumina names
+bool sameMateName(const char* n1, int len1, const char* n2, int len2);
+
+// Read names as fixed-width integer keys
+// Illumina names, @instrument:run:flowcell:lane:tile:x:y, are packed
+// losslessly into 63 bits once the instrument:run:flowcell prefix has been
+// checked against the one learnt from the first read. Names in any other
+// form, with a different prefix or with coordinates that do not fit are
+// hashed instead; hashed keys have the top bit clear, so they never equal a
+// packed key, but two hashed keys can collide and have to be verified.
+class NameCodec{
+public:
+    NameCodec();
+
+    // take the prefix from this name, if it has the Illumina form
+    // not thread-safe, call it before key() is used from other threads
+    void learn(const char* name, int len);
+    // the prefix learnt by another run, empty for none
+    void setPrefix(const string& prefix);
+    bool hasPrefix() const;
+    const string& prefix() const;
+
+    // name is the read name up to the first space, with or without '@'
+    uint64_t key(const char* name, int len, bool* packed = NULL) const;
+    // the name of a packed key, false for hashed keys
+    bool decode(uint64_t key, string& name) const;
+
+    static bool isPacked(uint64_t key);
+
+private:
+    bool pack(const char* name, int len, uint64_t& key) const;
+
+private:
+    string mPrefix;
+    bool mHasPrefix;
+};
+
+#endif
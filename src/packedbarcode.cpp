@@ -0,0 +1,204 @@
+//
+//  packedbarcode.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "packedbarcode.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL
+#define HAVE_POPCNT_KERNEL
+#endif
+
+// N is symbol 4, everything else is not packable
+static inline int symbolOf(char c) {
+    switch(c){
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        case 'N': return 4;
+        default: return -1;
+    }
+}
+
+PackedBarcode::PackedBarcode(){
+    mBases = 0;
+    mNMask = 0;
+    mLength = 0;
+}
+
+bool PackedBarcode::pack(const char* seq, int len, PackedBarcode& out){
+    if(len > PACKED_MAX_LEN)
+        return false;
+    uint64_t bases = 0;
+    uint64_t nmask = 0;
+    for(int i=0; i<len; i++) {
+        int s = symbolOf(seq[i]);
+        if(s < 0)
+            return false;
+        if(s == 4)
+            nmask |= 1ULL << (2 * i);
+        else
+            bases |= (uint64_t)s << (2 * i);
+    }
+    out.mBases = bases;
+    out.mNMask = nmask;
+    out.mLength = len;
+    return true;
+}
+
+bool PackedBarcode::pack(const string& seq, PackedBarcode& out){
+    return pack(seq.data(), seq.length(), out);
+}
+
+int PackedBarcode::base(int pos) const {
+    if(mNMask & (1ULL << (2 * pos)))
+        return 4;
+    return (mBases >> (2 * pos)) & 3;
+}
+
+void PackedBarcode::setBase(int pos, int symbol){
+    uint64_t lane = 3ULL << (2 * pos);
+    mBases &= ~lane;
+    mNMask &= ~lane;
+    if(symbol == 4)
+        mNMask |= 1ULL << (2 * pos);
+    else
+        mBases |= (uint64_t)symbol << (2 * pos);
+}
+
+string PackedBarcode::toString() const {
+    static const char letters[] = "ACGTN";
+    string s(mLength, 'N');
+    for(int i=0; i<mLength; i++)
+        s[i] = letters[base(i)];
+    return s;
+}
+
+PackedBarcode PackedBarcode::reverseComplement() const {
+    // complement of a 2-bit base is 3 - base, N stays N
+    PackedBarcode rc;
+    rc.mLength = mLength;
+    for(int i=0; i<mLength; i++) {
+        int b = base(i);
+        rc.setBase(mLength - 1 - i, b == 4 ? 4 : 3 - b);
+    }
+    return rc;
+}
+
+// Inlined into each scalar kernel, so __builtin_popcountll becomes the
+// popcnt instruction where the kernel is built for it and a libgcc call
+// otherwise
+static inline __attribute__((always_inline)) size_t withinThresholdLoop(const PackedBarcode& query, const uint64_t* bases, const uint64_t* nmasks, size_t n, int threshold, uint64_t care, size_t offset, uint32_t* hits, uint8_t* dists){
+    size_t found = 0;
+    for(size_t i=0; i<n; i++) {
+        uint64_t x = query.mBases ^ bases[i];
+        // care only has lane low bits set, so it also folds the pairs of bits
+        uint64_t lanes = ((x | (x >> 1)) | (query.mNMask ^ nmasks[i])) & care;
+        int d = __builtin_popcountll(lanes);
+        if(d <= threshold) {
+            hits[found] = offset + i;
+            dists[found++] = d;
+        }
+    }
+    return found;
+}
+
+static size_t withinThresholdScalar(const PackedBarcode& query, const uint64_t* bases, const uint64_t* nmasks, size_t n, int threshold, uint64_t care, size_t offset, uint32_t* hits, uint8_t* dists){
+    return withinThresholdLoop(query, bases, nmasks, n, threshold, care, offset, hits, dists);
+}
+
+#ifdef HAVE_POPCNT_KERNEL
+
+__attribute__((target("popcnt")))
+static size_t withinThresholdPopcnt(const PackedBarcode& query, const uint64_t* bases, const uint64_t* nmasks, size_t n, int threshold, uint64_t care, size_t offset, uint32_t* hits, uint8_t* dists){
+    return withinThresholdLoop(query, bases, nmasks, n, threshold, care, offset, hits, dists);
+}
+
+static bool cpuHasPopcnt(){
+    static const bool supported = __builtin_cpu_supports("popcnt");
+    return supported;
+}
+
+#endif
+
+#ifdef HAVE_AVX2_KERNEL
+
+// Bit w is set when barcode w of the four is more than threshold mismatches
+// away, counts gets the four distances
+__attribute__((target("avx2")))
+static inline int overThreshold(__m256i qb, __m256i qn, __m256i care, __m256i limit, const uint64_t* bases, const uint64_t* nmasks, __m256i& counts){
+    __m256i b = _mm256_loadu_si256((const __m256i*)bases);
+    __m256i nm = _mm256_loadu_si256((const __m256i*)nmasks);
+    __m256i x = _mm256_xor_si256(qb, b);
+    // care only has lane low bits set, so it also folds the pairs of bits
+    __m256i fold = _mm256_or_si256(x, _mm256_srli_epi64(x, 1));
+    __m256i lanes = _mm256_and_si256(_mm256_or_si256(fold, _mm256_xor_si256(qn, nm)), care);
+
+    // popcount of each 64-bit word: nibble lookup, then horizontal byte sum
+    const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                         0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(lanes, nibble));
+    __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi64(lanes, 4), nibble));
+    counts = _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+    return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(counts, limit)));
+}
+
+__attribute__((target("avx2")))
+static size_t withinThresholdAvx2(const PackedBarcode& query, const uint64_t* bases, const uint64_t* nmasks, size_t n, int threshold, uint64_t care, uint32_t* hits, uint8_t* dists){
+    __m256i qb = _mm256_set1_epi64x(query.mBases);
+    __m256i qn = _mm256_set1_epi64x(query.mNMask);
+    __m256i careLanes = _mm256_set1_epi64x(care);
+    __m256i limit = _mm256_set1_epi64x(threshold);
+    size_t found = 0;
+    size_t i = 0;
+
+    // 16 barcodes per iteration, 4 per register, hits are rare so only
+    // their bits are walked and their distances stored
+    __m256i counts[4];
+    uint64_t dist[16];
+    for(; i + 16 <= n; i += 16) {
+        uint32_t over = overThreshold(qb, qn, careLanes, limit, bases + i, nmasks + i, counts[0])
+            | (overThreshold(qb, qn, careLanes, limit, bases + i + 4, nmasks + i + 4, counts[1]) << 4)
+            | (overThreshold(qb, qn, careLanes, limit, bases + i + 8, nmasks + i + 8, counts[2]) << 8)
+            | (overThreshold(qb, qn, careLanes, limit, bases + i + 12, nmasks + i + 12, counts[3]) << 12);
+        uint32_t within = ~over & 0xffff;
+        if(!within)
+            continue;
+        for(int r=0; r<4; r++)
+            _mm256_storeu_si256((__m256i*)(dist + 4 * r), counts[r]);
+        while(within) {
+            int w = __builtin_ctz(within);
+            hits[found] = i + w;
+            dists[found++] = dist[w];
+            within &= within - 1;
+        }
+    }
+    // every AVX2 CPU has popcnt
+    return found + withinThresholdPopcnt(query, bases + i, nmasks + i, n - i, threshold, care, i, hits + found, dists + found);
+}
+
+static bool cpuHasAvx2(){
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+
+#endif
+
+size_t packedWithinThreshold(const PackedBarcode& query, const uint64_t* bases, const uint64_t* nmasks, size_t n, int threshold, uint32_t* hits, uint8_t* dists, uint64_t care){
+    care &= PACKED_LANE_LOW;
+#ifdef HAVE_AVX2_KERNEL
+    if(cpuHasAvx2())
+        return withinThresholdAvx2(query, bases, nmasks, n, threshold, care, hits, dists);
+#endif
+#ifdef HAVE_POPCNT_KERNEL
+    if(cpuHasPopcnt())
+        return withinThresholdPopcnt(query, bases, nmasks, n, threshold, care, 0, hits, dists);
+#endif
+    return withinThresholdScalar(query, bases, nmasks, n, threshold, care, 0, hits, dists);
+}
@@ -0,0 +1,71 @@
+//
+//  packedbarcode.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef PACKED_BARCODE_H
+#define PACKED_BARCODE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+using namespace std;
+
+#define PACKED_MAX_LEN 32
+
+// Low bit of every 2-bit lane
+#define PACKED_LANE_LOW 0x5555555555555555ULL
+
+// Care mask comparing every position
+#define PACKED_CARE_ALL PACKED_LANE_LOW
+
+// Up to 32 bases, 2 bits each (A=0 C=1 G=2 T=3)
+// N is stored as 0 in mBases with the low bit of its lane set in mNMask,
+// so N only matches N, exactly like a character comparison
+class PackedBarcode{
+public:
+    PackedBarcode();
+
+    static bool pack(const char* seq, int len, PackedBarcode& out);
+    static bool pack(const string& seq, PackedBarcode& out);
+
+    string toString() const;
+    PackedBarcode reverseComplement() const;
+    void setBase(int pos, int symbol);
+    int base(int pos) const;
+
+    // lengths must be equal, only positions whose lane low bit is set in
+    // care are counted
+    inline int mismatches(const PackedBarcode& other, uint64_t care = PACKED_CARE_ALL) const {
+        uint64_t x = mBases ^ other.mBases;
+        uint64_t lanes = ((x | (x >> 1)) | (mNMask ^ other.mNMask)) & care & PACKED_LANE_LOW;
+        return __builtin_popcountll(lanes);
+    }
+
+    // care mask of the first len positions
+    static inline uint64_t careOf(int len) {
+        return len >= PACKED_MAX_LEN ? PACKED_CARE_ALL : PACKED_CARE_ALL & ((1ULL << (2 * len)) - 1);
+    }
+
+    inline bool operator==(const PackedBarcode& other) const {
+        return mBases == other.mBases && mNMask == other.mNMask && mLength == other.mLength;
+    }
+
+public:
+    uint64_t mBases;
+    uint64_t mNMask;
+    uint8_t mLength;
+};
+
+// Positions of the barcodes (stored as parallel arrays) within threshold
+// mismatches of the query, and their distances in dists, lengths are not
+// compared
+// Positions cleared in care are not counted, at the cost of one AND per word
+// Uses AVX2 (16 barcodes per iteration) when the CPU supports it, else the
+// popcnt instruction if there is one
+size_t packedWithinThreshold(const PackedBarcode& query, const uint64_t* bases, const uint64_t* nmasks, size_t n, int threshold, uint32_t* hits, uint8_t* dists, uint64_t care = PACKED_CARE_ALL);
+
+#endif
@@ -0,0 +1,217 @@
+//
+//  pipeline.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "pipeline.h"
+#include <string.h>
+#include <map>
+#include <algorithm>
+
+Pipeline::Pipeline(int threads, bool deterministic){
+    mThreads = threads;
+    mDeterministic = deterministic;
+    mWindow = threads * PIPELINE_WINDOW_PER_THREAD;
+    mConsumed = 0;
+    mNextSeq = 0;
+    mReadersLeft = 0;
+    mWorkersLeft = threads;
+    mStopped = false;
+}
+
+void Pipeline::stop(){
+    lock_guard<mutex> lock(mWindowMtx);
+    mStopped = true;
+    mWindowCv.notify_all();
+}
+
+void Pipeline::markConsumed(){
+    lock_guard<mutex> lock(mWindowMtx);
+    mConsumed++;
+    mWindowCv.notify_one();
+}
+
+void Pipeline::readerLoop(function<bool(ReadBatch*)>& read, int shard, BoundedQueue<ReadBatch*>& input){
+    long first = 0;
+    while(true) {
+        // never run more than mWindow batches ahead of the consumer, which
+        // bounds the reorder buffer as well as the queues
+        long seq;
+        {
+            unique_lock<mutex> lock(mWindowMtx);
+            mWindowCv.wait(lock, [&]{ return mNextSeq - mConsumed < mWindow || mStopped; });
+            if(mStopped)
+                break;
+            seq = mNextSeq++;
+        }
+        ReadBatch* batch = new ReadBatch();
+        batch->seq = seq;
+        batch->shard = shard;
+        batch->first = first;
+        batch->matched = 0;
+        batch->pending = 0;
+        if(!read(batch)) {
+            // the unused sequence number gives its window slot back
+            delete batch;
+            markConsumed();
+            break;
+        }
+        batch->records = batch->reads.size();
+        first += batch->records;
+        input.push(batch);
+    }
+    if(--mReadersLeft == 0)
+        input.close();
+}
+
+void Pipeline::workerLoop(function<void(ReadBatch*)>& work, BoundedQueue<ReadBatch*>& input, BoundedQueue<ReadBatch*>& done){
+    ReadBatch* batch = NULL;
+    while(input.pop(batch)) {
+        if(!mStopped)
+            work(batch);
+        done.push(batch);
+    }
+    if(--mWorkersLeft == 0)
+        done.close();
+}
+
+void Pipeline::run(function<bool(ReadBatch*)> read, function<void(ReadBatch*)> work, function<void(ReadBatch*)> consume){
+    run(vector<function<bool(ReadBatch*)>>(1, read), work, consume);
+}
+
+void Pipeline::run(vector<function<bool(ReadBatch*)>> shards, function<void(ReadBatch*)> work, function<void(ReadBatch*)> consume){
+    BoundedQueue<ReadBatch*> input(mWindow);
+    BoundedQueue<ReadBatch*> done(mWindow);
+
+    // sequence numbers are only in input order with a single reader
+    bool ordered = mDeterministic && shards.size() == 1;
+    mReadersLeft = shards.size();
+    vector<thread> readers;
+    for(int i=0; i<shards.size(); i++)
+        readers.push_back(thread(&Pipeline::readerLoop, this, ref(shards[i]), i, ref(input)));
+    vector<thread> workers;
+    for(int i=0; i<mThreads; i++)
+        workers.push_back(thread(&Pipeline::workerLoop, this, ref(work), ref(input), ref(done)));
+
+    map<long, ReadBatch*> reorder;
+    long expected = 0;
+    ReadBatch* batch = NULL;
+    while(done.pop(batch)) {
+        if(mStopped) {
+            delete batch;
+            continue;
+        }
+        if(!ordered) {
+            consume(batch);
+            markConsumed();
+            continue;
+        }
+        reorder[batch->seq] = batch;
+        while(!reorder.empty() && reorder.begin()->first == expected && !mStopped) {
+            ReadBatch* next = reorder.begin()->second;
+            reorder.erase(reorder.begin());
+            consume(next);
+            markConsumed();
+            expected++;
+        }
+    }
+
+    for(int i=0; i<readers.size(); i++)
+        readers[i].join();
+    for(int i=0; i<workers.size(); i++)
+        workers[i].join();
+    for(map<long, ReadBatch*>::iterator it=reorder.begin(); it!=reorder.end(); it++)
+        delete it->second;
+}
+
+WriterPool::WriterPool(SampleOutputs* outputs, int threads){
+    mOutputs = outputs;
+    // each thread keeps its own samples' files open
+    mOutputs->setWriterThreads(threads);
+    for(int w=0; w<threads; w++)
+        mQueues.push_back(new BoundedQueue<ReadBatch*>(PIPELINE_WINDOW_PER_THREAD));
+    for(int w=0; w<threads; w++)
+        mThreads.push_back(thread(&WriterPool::writerLoop, this, w));
+}
+
+WriterPool::~WriterPool(){
+    finish();
+    for(int w=0; w<mQueues.size(); w++)
+        delete mQueues[w];
+}
+
+void WriterPool::write(ReadBatch* batch){
+    batch->pending = mQueues.size();
+    for(int w=0; w<mQueues.size(); w++)
+        mQueues[w]->push(batch);
+}
+
+void WriterPool::finish(){
+    for(int w=0; w<mQueues.size(); w++)
+        mQueues[w]->close();
+    for(int w=0; w<mThreads.size(); w++) {
+        if(mThreads[w].joinable())
+            mThreads[w].join();
+    }
+}
+
+void WriterPool::writerLoop(int w){
+    int writers = mQueues.size();
+    ReadBatch* batch = NULL;
+    while(mQueues[w]->pop(batch)) {
+        for(int s=w; s<batch->chunks.size(); s+=writers) {
+            if(!batch->chunks[s].empty())
+                mOutputs->writer(s)->write(batch->chunks[s]);
+        }
+        if(--batch->pending == 0)
+            delete batch;
+    }
+}
+
+RecordArena::RecordArena(){
+    mBlockLen = 0;
+    mUsed = 0;
+}
+
+RecordArena::~RecordArena(){
+    clear();
+}
+
+void RecordArena::clear(){
+    for(int i=0; i<mBlocks.size(); i++)
+        delete[] mBlocks[i];
+    mBlocks.clear();
+    mBlockLen = 0;
+    mUsed = 0;
+}
+
+char* RecordArena::alloc(size_t len){
+    if(mUsed + len > mBlockLen) {
+        // a record longer than a block gets a block of its own
+        mBlockLen = max((size_t)PIPELINE_ARENA_BLOCK, len);
+        mBlocks.push_back(new char[mBlockLen]);
+        mUsed = 0;
+    }
+    char* p = mBlocks.back() + mUsed;
+    mUsed += len;
+    return p;
+}
+
+FastqRecord RecordArena::copy(const FastqRecord& rec){
+    char* p = alloc(rec.nameLen + rec.seqLen + rec.strandLen + rec.qualityLen);
+    FastqRecord out = rec;
+    memcpy(p, rec.name, rec.nameLen);
+    out.name = p;
+    p += rec.nameLen;
+    memcpy(p, rec.seq, rec.seqLen);
+    out.seq = p;
+    p += rec.seqLen;
+    memcpy(p, rec.strand, rec.strandLen);
+    out.strand = p;
+    p += rec.strandLen;
+    memcpy(p, rec.quality, rec.qualityLen);
+    out.quality = p;
+    return out;
+}
@@ -0,0 +1,129 @@
+//
+//  pipeline.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include "fastqreader.h"
+#include "barcode.h"
+#include "writer.h"
+#include "boundedqueue.h"
+
+using namespace std;
+
+// Records handed from the reader thread to a worker at a time
+#define PIPELINE_BATCH_SIZE 4096
+
+// Batches allowed in flight per worker thread
+#define PIPELINE_WINDOW_PER_THREAD 4
+
+// Bytes per block of a batch's record arena
+#define PIPELINE_ARENA_BLOCK (1<<20)
+
+// Copies of the records of a batch, in blocks that never move so the views
+// handed out stay valid as more records are added
+class RecordArena{
+public:
+    RecordArena();
+    ~RecordArena();
+
+    // rec's four lines copied into the arena
+    FastqRecord copy(const FastqRecord& rec);
+    // frees every block, the views handed out become invalid
+    void clear();
+
+private:
+    char* alloc(size_t len);
+
+private:
+    vector<char*> mBlocks;
+    size_t mBlockLen;
+    size_t mUsed;
+};
+
+struct ReadBatch{
+    long seq;
+    int shard;                  // byte range of the input the batch was read from
+    long first;                 // ordinal of the first record in its shard, from 0
+    long records;
+    long matched;
+    RecordArena arena;          // bytes of the records below
+    vector<FastqRecord> reads;  // records to demultiplex
+    vector<FastqRecord> reads2; // second reads of pairs, if paired-end
+    vector<FastqRecord> mates;  // lockstep index reads, if any
+    vector<FastqRecord> mates2; // lockstep index 2 (i5) reads of dual-index runs
+    vector<uint64_t> keys;      // read name keys for the read index
+    vector<BarcodeMatch> matches;
+    vector<string> chunks;      // serialized records per sample id
+    string error;
+    atomic<int> pending;        // writer threads still to drain the batch
+};
+
+// Reader thread -> worker threads -> consumer
+// read() fills a batch on the reader thread and returns false at the end of input
+// work() runs on a worker thread
+// consume() runs on the calling thread, in input order when deterministic, and
+// takes ownership of the batch
+// With one read() per shard of the input, each shard gets its own reader thread
+// and batches are consumed as they are done, deterministic or not
+// stop() from consume() ends the run early: nothing more is read or consumed,
+// and run() returns once every thread is joined
+class Pipeline{
+public:
+    Pipeline(int threads, bool deterministic);
+
+    void run(function<bool(ReadBatch*)> read, function<void(ReadBatch*)> work, function<void(ReadBatch*)> consume);
+    void run(vector<function<bool(ReadBatch*)>> shards, function<void(ReadBatch*)> work, function<void(ReadBatch*)> consume);
+    void stop();
+
+private:
+    void readerLoop(function<bool(ReadBatch*)>& read, int shard, BoundedQueue<ReadBatch*>& input);
+    void workerLoop(function<void(ReadBatch*)>& work, BoundedQueue<ReadBatch*>& input, BoundedQueue<ReadBatch*>& done);
+    void markConsumed();
+
+private:
+    int mThreads;
+    bool mDeterministic;
+    long mWindow;
+    long mConsumed;
+    long mNextSeq;
+    atomic<int> mReadersLeft;
+    atomic<int> mWorkersLeft;
+    atomic<bool> mStopped;
+    mutex mWindowMtx;
+    condition_variable mWindowCv;
+};
+
+// Writer threads draining serialized batches into the sample files
+// Each sample belongs to one writer thread, so its records keep batch order
+class WriterPool{
+public:
+    WriterPool(SampleOutputs* outputs, int threads);
+    ~WriterPool();
+
+    // takes ownership of the batch
+    void write(ReadBatch* batch);
+    void finish();
+
+private:
+    void writerLoop(int w);
+
+private:
+    SampleOutputs* mOutputs;
+    vector<thread> mThreads;
+    vector<BoundedQueue<ReadBatch*>*> mQueues;
+};
+
+#endif
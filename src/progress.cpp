@@ -0,0 +1,99 @@
+//
+//  progress.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "progress.h"
+#include "fastqreader.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+
+ProgressMeter::ProgressMeter(){
+    mTotalBytes = 0;
+    mStartBytes = 0;
+    mTerminal = isatty(STDERR_FILENO);
+    mInterval = mTerminal ? PROGRESS_INTERVAL : PROGRESS_LOG_INTERVAL;
+    mNextReport = mInterval;
+    mLastSeconds = 0;
+    mLastBytes = 0;
+    mLastRecords = 0;
+    mChecked = 0;
+    mReports = 0;
+    mLineLen = 0;
+}
+
+void ProgressMeter::start(const string& label, size_t totalBytes){
+    mLabel = label;
+    mTotalBytes = totalBytes;
+    mStartBytes = FastqReader::totalBytesRead();
+    mStart = chrono::steady_clock::now();
+    mNextReport = mInterval;
+    mLastSeconds = 0;
+    mLastBytes = 0;
+    mLastRecords = 0;
+    mChecked = 0;
+    mReports = 0;
+    mLineLen = 0;
+}
+
+void ProgressMeter::check(long records){
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - mStart).count();
+    if(seconds < mNextReport)
+        return;
+    mNextReport = seconds + mInterval;
+    report(records, seconds, false);
+}
+
+void ProgressMeter::finish(long records){
+    // nothing was shown for a pass shorter than an interval
+    if(mReports == 0)
+        return;
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - mStart).count();
+    report(records, seconds, true);
+    if(mTerminal)
+        fputc('\n', stderr);
+    mReports = 0;
+}
+
+void ProgressMeter::report(long records, double seconds, bool last){
+    size_t bytes = FastqReader::totalBytesRead() - mStartBytes;
+    // rates since the last report, the whole pass in the last one
+    double span = last ? seconds : seconds - mLastSeconds;
+    size_t spanBytes = last ? bytes : bytes - mLastBytes;
+    long spanRecords = last ? records : records - mLastRecords;
+    mLastSeconds = seconds;
+    mLastBytes = bytes;
+    mLastRecords = records;
+    mReports++;
+
+    char line[256];
+    int len = snprintf(line, sizeof(line), "%s: ", mLabel.c_str());
+    if(mTotalBytes > 0) {
+        // readers that peek at the input count towards the bytes read
+        bytes = min(bytes, mTotalBytes);
+        len += snprintf(line + len, sizeof(line) - len, "%.1f%% of %.0f MB, ", 100.0 * bytes / mTotalBytes, mTotalBytes / 1e6);
+    } else {
+        len += snprintf(line + len, sizeof(line) - len, "%.0f MB, ", bytes / 1e6);
+    }
+    len += snprintf(line + len, sizeof(line) - len, "%.1f MB/s, %.0f reads/s", span > 0 ? spanBytes / span / 1e6 : 0, span > 0 ? spanRecords / span : 0);
+    if(last) {
+        len += snprintf(line + len, sizeof(line) - len, ", %.0fs", seconds);
+    } else if(mTotalBytes > 0 && bytes > 0) {
+        // from the average rate of the pass, steadier than the last interval
+        long left = (long)(seconds * (mTotalBytes - bytes) / bytes);
+        len += snprintf(line + len, sizeof(line) - len, ", ETA %ld:%02ld:%02ld", left / 3600, left / 60 % 60, left % 60);
+    }
+    len = min(len, (int)sizeof(line) - 1);
+
+    if(mTerminal) {
+        // overwrite the last report, padding over a longer one
+        fprintf(stderr, "\r%s%*s", line, (int)(mLineLen > (size_t)len ? mLineLen - len : 0), "");
+        mLineLen = len;
+    } else {
+        fprintf(stderr, "%s\n", line);
+    }
+    fflush(stderr);
+}
@@ -0,0 +1,63 @@
+//
+//  progress.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <string>
+#include <chrono>
+
+using namespace std;
+
+// Seconds between reports on a terminal, where each overwrites the last,
+// and in a log, where each is a line of its own
+#define PROGRESS_INTERVAL 1.0
+#define PROGRESS_LOG_INTERVAL 30.0
+
+// Records between looks at the clock
+#define PROGRESS_CHECK_RECORDS 8192
+
+// Percent done, MB/s, reads/s and time left of one pass over the input,
+// on stderr. The bytes come from FastqReader::totalBytesRead(), so the
+// loops only hand over their record count; reports are only made once a
+// pass has run for a full interval, short runs stay quiet
+class ProgressMeter{
+public:
+    ProgressMeter();
+
+    // totalBytes of input will be read by the pass, 0 if not known
+    void start(const string& label, size_t totalBytes);
+    // records handled so far in the pass
+    void update(long records){
+        if(records - mChecked < PROGRESS_CHECK_RECORDS)
+            return;
+        mChecked = records;
+        check(records);
+    }
+    void finish(long records);
+
+private:
+    void check(long records);
+    void report(long records, double seconds, bool last);
+
+private:
+    string mLabel;
+    size_t mTotalBytes;
+    size_t mStartBytes;
+    bool mTerminal;
+    double mInterval;
+    chrono::steady_clock::time_point mStart;
+    double mNextReport;
+    double mLastSeconds;
+    size_t mLastBytes;
+    long mLastRecords;
+    long mChecked;
+    int mReports;
+    size_t mLineLen;
+};
+
+#endif
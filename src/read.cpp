@@ -118,31 +118,42 @@ void Read::trimBack(int len){
     mQuality = mQuality.substr(0, mQuality.length() - len);
 }
 
-string Read::lastIndex(){
-    int len = mName.length();
+// The index follows the last ':' of the name, and a dual index is split at
+// its '+' into the first (i7) and last (i5) index. Both are empty if there
+// is no ':', and the same for a single index.
+void Read::findIndexes(const char* name, int len, IndexView& first, IndexView& last){
+    first.data = last.data = name + len;
+    first.len = last.len = 0;
     if(len<5)
-        return "";
+        return;
+    int end = len;
+    bool hasLast = false;
     for(int i=len-3;i>=0;i--){
-        if(mName[i]==':' || mName[i]=='+'){
-            return mName.substr(i+1, len-i);
+        if(!hasLast && (name[i]==':' || name[i]=='+')){
+            last.data = name + i + 1;
+            last.len = len - i - 1;
+            hasLast = true;
+        }
+        if(name[i]=='+')
+            end = i;
+        if(name[i]==':'){
+            first.data = name + i + 1;
+            first.len = end - i - 1;
+            return;
         }
     }
-    return "";
+}
+
+string Read::lastIndex(){
+    IndexView first, last;
+    findIndexes(mName.data(), mName.length(), first, last);
+    return string(last.data, last.len);
 }
 
 string Read::firstIndex(){
-    int len = mName.length();
-    int end = len;
-    if(len<5)
-        return "";
-    for(int i=len-3;i>=0;i--){
-        if(mName[i]=='+')
-            end = i-1;
-        if(mName[i]==':'){
-            return mName.substr(i+1, end-i);
-        }
-    }
-    return "";
+    IndexView first, last;
+    findIndexes(mName.data(), mName.length(), first, last);
+    return string(first.data, first.len);
 }
 
 int Read::lowQualCount(int qual){
@@ -185,3 +196,19 @@ void Read::addUmiTag(string umi){
     }
 
 }
+
+ReadPair::ReadPair(Read* left, Read* right){
+    mLeft = left;
+    mRight = right;
+}
+
+ReadPair::~ReadPair(){
+    if(mLeft){
+        delete mLeft;
+        mLeft = NULL;
+    }
+    if(mRight){
+        delete mRight;
+        mRight = NULL;
+    }
+}
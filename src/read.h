@@ -42,6 +42,12 @@
 
 using namespace std;
 
+// Part of a read field, valid for as long as the field is
+struct IndexView{
+    const char* data;
+    int len;
+};
+
 class Read{
 public:
     Read(string name, string seq, string strand, string quality, bool phred64=false);
@@ -54,6 +60,8 @@ public:
     Read* reverseComplement();
     string firstIndex();
     string lastIndex();
+    // views of firstIndex() and lastIndex() into name[0, len), in one pass
+    static void findIndexes(const char* name, int len, IndexView& first, IndexView& last);
     // default is Q20
     int lowQualCount(int qual=20);
     int length();
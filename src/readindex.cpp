@@ -0,0 +1,164 @@
+//
+//  readindex.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "readindex.h"
+#include "util.h"
+#include <string.h>
+#include <algorithm>
+
+#define READ_INDEX_MIN_CAPACITY 1024
+#define READ_INDEX_COLLIDED 0xffff
+#define READ_INDEX_SLOT_BYTES (sizeof(uint64_t) + sizeof(uint16_t))
+
+ReadIndex::ReadIndex(size_t expected, size_t maxBytes){
+    mCapacity = 0;
+    mSize = 0;
+    mMaxBytes = maxBytes;
+    rehash(max((size_t)READ_INDEX_MIN_CAPACITY, (size_t)(expected / READ_INDEX_MAX_LOAD + 1)));
+}
+
+static inline uint64_t rotl64(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+// 8 bytes at a time with the murmur3 64-bit finalizer, 0 is kept for empty slots
+uint64_t ReadIndex::hash(const char* name, int len){
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t)len;
+    int i = 0;
+    for(; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, name + i, 8);
+        h ^= rotl64(w * c1, 31) * c2;
+        h = rotl64(h, 27) * 5 + 0x52dce729;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, name + i, len - i);
+    h ^= rotl64(tail * c1, 31) * c2;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h == 0 ? 1 : h;
+}
+
+// Maps the key onto [0, capacity) without a power-of-two size, after a
+// multiplicative mix since packed keys keep their low bits in the tail
+size_t ReadIndex::slotFor(uint64_t key) const{
+    uint64_t mixed = key * 0x9e3779b97f4a7c15ULL;
+    mixed ^= mixed >> 29;
+    return (size_t)(((unsigned __int128)mixed * mCapacity) >> 64);
+}
+
+void ReadIndex::rehash(size_t capacity){
+    // the old table is only freed once its keys are in the new one
+    size_t peak = (mCapacity + capacity) * READ_INDEX_SLOT_BYTES;
+    if(mMaxBytes > 0 && peak > mMaxBytes)
+        error_exit("Read index needs " + to_string(peak / (1<<20) + 1)
+            + " MB, more than --max-memory; raise it or use --stream if the files share read order");
+
+    vector<uint64_t> keys(capacity, 0);
+    vector<uint16_t> ids(capacity, 0);
+    keys.swap(mKeys);
+    ids.swap(mIds);
+    size_t oldCapacity = mCapacity;
+    mCapacity = capacity;
+    for(size_t s=0; s<oldCapacity; s++) {
+        if(keys[s] == 0)
+            continue;
+        size_t slot = slotFor(keys[s]);
+        while(mKeys[slot] != 0)
+            slot = slot + 1 == mCapacity ? 0 : slot + 1;
+        mKeys[slot] = keys[s];
+        mIds[slot] = ids[s];
+    }
+}
+
+size_t ReadIndex::bytesFor(size_t expected){
+    return max((size_t)READ_INDEX_MIN_CAPACITY, (size_t)(expected / READ_INDEX_MAX_LOAD + 1)) * READ_INDEX_SLOT_BYTES;
+}
+
+void ReadIndex::reserve(size_t expected){
+    size_t capacity = expected / READ_INDEX_MAX_LOAD + 1;
+    if(capacity > mCapacity)
+        rehash(capacity);
+}
+
+void ReadIndex::insert(uint64_t key, int sampleId){
+    if(mSize + 1 > mCapacity * READ_INDEX_MAX_LOAD)
+        rehash(mCapacity + mCapacity / 2);
+
+    size_t slot = slotFor(key);
+    while(mKeys[slot] != 0) {
+        if(mKeys[slot] == key) {
+            // duplicate name or two names with one hash, settled by resolve()
+            mIds[slot] = READ_INDEX_COLLIDED;
+            mCollided.insert(key);
+            return;
+        }
+        slot = slot + 1 == mCapacity ? 0 : slot + 1;
+    }
+    mKeys[slot] = key;
+    mIds[slot] = sampleId;
+    mSize++;
+}
+
+void ReadIndex::markCollided(uint64_t key){
+    if(mSize + 1 > mCapacity * READ_INDEX_MAX_LOAD)
+        rehash(mCapacity + mCapacity / 2);
+
+    size_t slot = slotFor(key);
+    while(mKeys[slot] != 0 && mKeys[slot] != key)
+        slot = slot + 1 == mCapacity ? 0 : slot + 1;
+    if(mKeys[slot] == 0) {
+        mKeys[slot] = key;
+        mSize++;
+    }
+    mIds[slot] = READ_INDEX_COLLIDED;
+    mCollided.insert(key);
+}
+
+int ReadIndex::find(uint64_t key, const char* name, int len) const{
+    size_t slot = slotFor(key);
+    while(mKeys[slot] != 0) {
+        if(mKeys[slot] == key) {
+            if(mIds[slot] != READ_INDEX_COLLIDED)
+                return mIds[slot];
+            map<string, int>::const_iterator it = mResolved.find(string(name, len));
+            return it == mResolved.end() ? -1 : it->second;
+        }
+        slot = slot + 1 == mCapacity ? 0 : slot + 1;
+    }
+    return -1;
+}
+
+bool ReadIndex::hasCollisions() const{
+    return !mCollided.empty();
+}
+
+bool ReadIndex::isCollided(uint64_t key) const{
+    return mCollided.count(key) > 0;
+}
+
+void ReadIndex::resolve(const string& name, int sampleId){
+    mResolved[name] = sampleId;
+}
+
+size_t ReadIndex::size() const{
+    return mSize;
+}
+
+size_t ReadIndex::collisions() const{
+    return mCollided.size();
+}
+
+size_t ReadIndex::bytes() const{
+    return mCapacity * READ_INDEX_SLOT_BYTES;
+}
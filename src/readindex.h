@@ -0,0 +1,74 @@
+//
+//  readindex.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef READ_INDEX_H
+#define READ_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_set>
+
+using namespace std;
+
+// Sample ids stored in the table are below this, the top value marks a
+// hash shared by more than one read name
+#define READ_INDEX_MAX_SAMPLES 0xffff
+
+// Load factor the table grows at
+#define READ_INDEX_MAX_LOAD 0.85
+
+// Read name -> sample id for the reads pass of the two-pass mode
+// Names are stored as 64-bit keys (see NameCodec) in an open-addressing
+// table with linear probing, 10 bytes per slot. A key inserted twice, by a
+// duplicate name or two names with one hash, is marked and resolved by
+// exact name afterwards: the caller passes every index record with a
+// marked key to resolve() again.
+class ReadIndex{
+public:
+    // maxBytes of 0 is no limit, it covers the old and the new table
+    // while the table grows
+    ReadIndex(size_t expected = 0, size_t maxBytes = 0);
+
+    // later inserts of the same name replace earlier ones
+    void insert(uint64_t key, int sampleId);
+    // send every find() of this key to resolve(), as a second insert would
+    void markCollided(uint64_t key);
+    // sample id of the name with this key, -1 if it was never inserted
+    int find(uint64_t key, const char* name, int len) const;
+
+    bool hasCollisions() const;
+    bool isCollided(uint64_t key) const;
+    void resolve(const string& name, int sampleId);
+
+    // grow the table up front for this many names
+    void reserve(size_t expected);
+    size_t size() const;
+    size_t collisions() const;
+    size_t bytes() const;
+
+    // memory of a table reserved for this many names
+    static size_t bytesFor(size_t expected);
+    static uint64_t hash(const char* name, int len);
+
+private:
+    size_t slotFor(uint64_t key) const;
+    void rehash(size_t capacity);
+
+private:
+    vector<uint64_t> mKeys;
+    vector<uint16_t> mIds;
+    size_t mCapacity;
+    size_t mSize;
+    size_t mMaxBytes;
+    unordered_set<uint64_t> mCollided;
+    map<string, int> mResolved;
+};
+
+#endif
@@ -0,0 +1,158 @@
+//
+//  runstats.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "runstats.h"
+#include "fastqreader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include <sys/resource.h>
+
+static atomic<bool> sCountAllocations (false);
+static atomic<uint64_t> sAllocations (0);
+static atomic<uint64_t> sAllocatedBytes (0);
+
+// Every operator new of the program comes through here; the arrays and
+// nothrow forms of the standard library call this one
+void* operator new(size_t size){
+    if(sCountAllocations.load(memory_order_relaxed)) {
+        sAllocations.fetch_add(1, memory_order_relaxed);
+        sAllocatedBytes.fetch_add(size, memory_order_relaxed);
+    }
+    void* p = malloc(size == 0 ? 1 : size);
+    if(p == NULL)
+        throw bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+RunStats::RunStats(){
+    mInStage = false;
+    mStageStartCpu = 0;
+    mStageStartBytes = 0;
+    mStageStartAllocations = 0;
+    start();
+}
+
+void RunStats::start(){
+    mStart = chrono::steady_clock::now();
+    mStartCpu = cpuNow();
+}
+
+void RunStats::startStage(const string& name){
+    if(mInStage)
+        stopStage();
+    StageStats stage = {name, 0, 0, -1, 0, 0};
+    mStages.push_back(stage);
+    mInStage = true;
+    mStageStart = chrono::steady_clock::now();
+    mStageStartCpu = cpuNow();
+    mStageStartBytes = FastqReader::totalBytesRead();
+    mStageStartAllocations = allocations();
+}
+
+double RunStats::stopStage(long records){
+    if(!mInStage)
+        return 0;
+    StageStats& stage = mStages.back();
+    stage.wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - mStageStart).count();
+    stage.cpuSeconds = cpuNow() - mStageStartCpu;
+    stage.records = records;
+    stage.bytesRead = FastqReader::totalBytesRead() - mStageStartBytes;
+    stage.allocations = allocations() - mStageStartAllocations;
+    mInStage = false;
+    return stage.wallSeconds;
+}
+
+void RunStats::setCounter(const string& name, long long value){
+    for(int i=0; i<mCounters.size(); i++) {
+        if(mCounters[i].first == name) {
+            mCounters[i].second = value;
+            return;
+        }
+    }
+    mCounters.push_back(make_pair(name, value));
+}
+
+double RunStats::wallSeconds(){
+    return chrono::duration<double>(chrono::steady_clock::now() - mStart).count();
+}
+
+double RunStats::cpuSeconds(){
+    return cpuNow() - mStartCpu;
+}
+
+long RunStats::peakRssKb(){
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+const vector<StageStats>& RunStats::stages(){
+    return mStages;
+}
+
+bool RunStats::writeJson(const string& filename, const string& mode){
+    FILE* fp = fopen(filename.c_str(), "w");
+    if(fp == NULL)
+        return false;
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"schema\": %d,\n", RUN_STATS_JSON_SCHEMA);
+    fprintf(fp, "  \"mode\": \"%s\",\n", mode.c_str());
+    fprintf(fp, "  \"wall_seconds\": %.6f,\n", wallSeconds());
+    fprintf(fp, "  \"cpu_seconds\": %.6f,\n", cpuSeconds());
+    fprintf(fp, "  \"peak_rss_kb\": %ld,\n", peakRssKb());
+    fprintf(fp, "  \"stages\": [\n");
+    for(int i=0; i<mStages.size(); i++) {
+        const StageStats& stage = mStages[i];
+        fprintf(fp, "    {\"name\": \"%s\", \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f, \"records\": %ld, \"bytes_read\": %zu, \"allocations\": %llu}%s\n",
+            stage.name.c_str(), stage.wallSeconds, stage.cpuSeconds, stage.records, stage.bytesRead,
+            (unsigned long long)stage.allocations, i + 1 < mStages.size() ? "," : "");
+    }
+    fprintf(fp, "  ],\n");
+    fprintf(fp, "  \"counters\": {\n");
+    fprintf(fp, "    \"bytes_read\": %zu,\n", FastqReader::totalBytesRead());
+    for(int i=0; i<mCounters.size(); i++)
+        fprintf(fp, "    \"%s\": %lld,\n", mCounters[i].first.c_str(), mCounters[i].second);
+    fprintf(fp, "    \"allocations\": %llu,\n", (unsigned long long)allocations());
+    fprintf(fp, "    \"allocated_bytes\": %llu\n", (unsigned long long)allocatedBytes());
+    fprintf(fp, "  }\n");
+    fprintf(fp, "}\n");
+    return fclose(fp) == 0;
+}
+
+double RunStats::cpuNow(){
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+void RunStats::countAllocations(bool on){
+    sCountAllocations = on;
+}
+
+uint64_t RunStats::allocations(){
+    return sAllocations.load(memory_order_relaxed);
+}
+
+uint64_t RunStats::allocatedBytes(){
+    return sAllocatedBytes.load(memory_order_relaxed);
+}
@@ -0,0 +1,72 @@
+//
+//  runstats.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef RUN_STATS_H
+#define RUN_STATS_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <chrono>
+
+using namespace std;
+
+#define RUN_STATS_JSON_SCHEMA 1
+
+// One timed part of a run: wall time well above CPU time means it waited
+// on the disk, CPU time above wall time that threads were busy
+struct StageStats {
+    string name;
+    double wallSeconds;
+    double cpuSeconds;
+    long records;
+    size_t bytesRead;
+    uint64_t allocations;
+};
+
+// Wall-clock and CPU timers around the stages of a run, with the bytes of
+// input read during each, and named counters set at the end
+class RunStats{
+public:
+    RunStats();
+
+    void start();
+    // ends the running stage, if any, and starts timing the next one
+    void startStage(const string& name);
+    // wall seconds of the stage; records it handled, -1 if not counted
+    double stopStage(long records = -1);
+    // kept in the order first set
+    void setCounter(const string& name, long long value);
+
+    double wallSeconds();
+    double cpuSeconds();
+    long peakRssKb();
+    const vector<StageStats>& stages();
+    bool writeJson(const string& filename, const string& mode);
+
+public:
+    // process CPU time, all threads, user and system
+    static double cpuNow();
+    // allocations are only counted once switched on, so runs without
+    // --stats-json don't pay for the shared counter
+    static void countAllocations(bool on);
+    static uint64_t allocations();
+    static uint64_t allocatedBytes();
+
+private:
+    chrono::steady_clock::time_point mStart;
+    double mStartCpu;
+    bool mInStage;
+    chrono::steady_clock::time_point mStageStart;
+    double mStageStartCpu;
+    size_t mStageStartBytes;
+    uint64_t mStageStartAllocations;
+    vector<StageStats> mStages;
+    vector<pair<string, long long> > mCounters;
+};
+
+#endif
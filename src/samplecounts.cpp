@@ -0,0 +1,127 @@
+//
+//  samplecounts.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "samplecounts.h"
+#include <stdio.h>
+
+SampleCounts::SampleCounts(int samples, int minDistance, int maxDistance, int unknownSlots) : mUnknown(unknownSlots){
+    mSamples = samples;
+    mMinDistance = minDistance;
+    mMaxDistance = max(minDistance, maxDistance);
+    mDistances = mMaxDistance - mMinDistance + 1;
+    mStride = COUNT_FUZZY + 2 * mDistances;
+    mCounts.assign((size_t)mSamples * mStride, 0);
+}
+
+void SampleCounts::merge(const SampleCounts& other){
+    for(size_t i=0; i<mCounts.size() && i<other.mCounts.size(); i++)
+        mCounts[i] += other.mCounts[i];
+    mUnknown.merge(other.mUnknown);
+}
+
+const UnknownIndexes& SampleCounts::unknown() const{
+    return mUnknown;
+}
+
+uint64_t SampleCounts::count(int sampleId, int column) const{
+    return mCounts[sampleId * mStride + column];
+}
+
+static string joinBarcodes(const vector<string>& barcodes, const string& sep){
+    string out;
+    for(int i=0; i<barcodes.size(); i++)
+        out += (i > 0 ? sep : "") + barcodes[i];
+    return out;
+}
+
+static string jsonString(const string& s){
+    string out = "\"";
+    for(int i=0; i<s.length(); i++) {
+        if(s[i] == '"' || s[i] == '\\')
+            out += '\\';
+        if((unsigned char)s[i] >= 0x20)
+            out += s[i];
+    }
+    return out + "\"";
+}
+
+bool SampleCounts::writeTsv(const string& filename, const vector<string>& sampleNames, const vector<vector<string> >& sampleBarcodes){
+    FILE* fp = fopen(filename.c_str(), "w");
+    if(fp == NULL)
+        return false;
+    fprintf(fp, "sample\tbarcodes\treads\tindex_reads\texact\trevcomp");
+    for(int d=mMinDistance; d<=mMaxDistance; d++)
+        fprintf(fp, "\tfuzzy_%d", d);
+    for(int d=mMinDistance; d<=mMaxDistance; d++)
+        fprintf(fp, "\tfuzzy_revcomp_%d", d);
+    fprintf(fp, "\tambiguous\n");
+    for(int s=0; s<mSamples; s++) {
+        fprintf(fp, "%s\t%s", sampleNames[s].c_str(), joinBarcodes(sampleBarcodes[s], ",").c_str());
+        fprintf(fp, "\t%llu\t%llu\t%llu\t%llu", (unsigned long long)count(s, COUNT_READS), (unsigned long long)count(s, COUNT_INDEX_READS),
+            (unsigned long long)count(s, COUNT_EXACT), (unsigned long long)count(s, COUNT_REVCOMP));
+        for(int d=0; d<2*mDistances; d++)
+            fprintf(fp, "\t%llu", (unsigned long long)count(s, COUNT_FUZZY + d));
+        fprintf(fp, "\t%llu\n", (unsigned long long)count(s, COUNT_AMBIGUOUS));
+    }
+    return fclose(fp) == 0;
+}
+
+bool SampleCounts::writeJson(const string& filename, const vector<string>& sampleNames, const vector<vector<string> >& sampleBarcodes){
+    FILE* fp = fopen(filename.c_str(), "w");
+    if(fp == NULL)
+        return false;
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"schema\": %d,\n", SAMPLE_REPORT_SCHEMA);
+    fprintf(fp, "  \"samples\": [\n");
+    for(int s=0; s<mSamples; s++) {
+        fprintf(fp, "    {\"sample\": %s, \"barcodes\": [", jsonString(sampleNames[s]).c_str());
+        for(int i=0; i<sampleBarcodes[s].size(); i++)
+            fprintf(fp, "%s%s", i > 0 ? ", " : "", jsonString(sampleBarcodes[s][i]).c_str());
+        fprintf(fp, "], \"reads\": %llu, \"index_reads\": %llu, \"exact\": %llu, \"revcomp\": %llu",
+            (unsigned long long)count(s, COUNT_READS), (unsigned long long)count(s, COUNT_INDEX_READS),
+            (unsigned long long)count(s, COUNT_EXACT), (unsigned long long)count(s, COUNT_REVCOMP));
+        // objects keyed by the number of mismatches
+        for(int revComp=0; revComp<2; revComp++) {
+            fprintf(fp, ", \"%s\": {", revComp ? "fuzzy_revcomp" : "fuzzy");
+            for(int d=0; d<mDistances; d++)
+                fprintf(fp, "%s\"%d\": %llu", d > 0 ? ", " : "", mMinDistance + d, (unsigned long long)count(s, COUNT_FUZZY + revComp * mDistances + d));
+            fprintf(fp, "}");
+        }
+        fprintf(fp, ", \"ambiguous\": %llu}%s\n", (unsigned long long)count(s, COUNT_AMBIGUOUS), s + 1 < mSamples ? "," : "");
+    }
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+    return fclose(fp) == 0;
+}
+
+SampleCountsSet::SampleCountsSet(int samples, int minDistance, int maxDistance, int unknownSlots){
+    mSamples = samples;
+    mMinDistance = minDistance;
+    mMaxDistance = maxDistance;
+    mUnknownSlots = unknownSlots;
+}
+
+SampleCountsSet::~SampleCountsSet(){
+    for(auto it = mCounts.begin(); it != mCounts.end(); ++it)
+        delete it->second;
+}
+
+SampleCounts& SampleCountsSet::local(){
+    lock_guard<mutex> lock(mMtx);
+    SampleCounts*& counts = mCounts[this_thread::get_id()];
+    if(counts == NULL)
+        counts = new SampleCounts(mSamples, mMinDistance, mMaxDistance, mUnknownSlots);
+    return *counts;
+}
+
+SampleCounts SampleCountsSet::merged(){
+    lock_guard<mutex> lock(mMtx);
+    SampleCounts total (mSamples, mMinDistance, mMaxDistance, mUnknownSlots);
+    for(auto it = mCounts.begin(); it != mCounts.end(); ++it)
+        total.merge(*it->second);
+    return total;
+}
@@ -0,0 +1,119 @@
+//
+//  samplecounts.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef SAMPLE_COUNTS_H
+#define SAMPLE_COUNTS_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "barcode.h"
+#include "unknownindexes.h"
+
+using namespace std;
+
+#define SAMPLE_REPORT_SCHEMA 1
+
+// Per-sample counts of a run, one row of counters per sample id: reads
+// written, index reads assigned, and how those matched (exact, reverse
+// complement, or fuzzy at each mismatch distance). Ambiguous indexes, in
+// range of more than one barcode, are counted on the row they were
+// assigned to, the unassigned one.
+// Distances run from minDistance (0 when wildcard bases can make a
+// fuzzy match without mismatches) to maxDistance.
+// With unknownSlots, the indexes of unassigned reads are also kept in an
+// UnknownIndexes sketch of that many counters.
+class SampleCounts{
+public:
+    SampleCounts(int samples, int minDistance, int maxDistance, int unknownSlots = 0);
+
+    void addRead(int sampleId){
+        mCounts[sampleId * mStride + COUNT_READS]++;
+    }
+    void addIndex(int sampleId, const BarcodeMatch& match){
+        addIndex(sampleId, match.type, match.mismatches, match.ambiguous);
+    }
+    void addIndex(int sampleId, MatchType type, int mismatches, bool ambiguous){
+        uint64_t* row = &mCounts[sampleId * mStride];
+        row[COUNT_INDEX_READS]++;
+        int d = min(max(mismatches, mMinDistance), mMaxDistance) - mMinDistance;
+        switch(type) {
+        case MATCH_EXACT:
+            row[COUNT_EXACT]++;
+            break;
+        case MATCH_REVCOMP:
+            row[COUNT_REVCOMP]++;
+            break;
+        case MATCH_FUZZY:
+            row[COUNT_FUZZY + d]++;
+            break;
+        case MATCH_FUZZY_REVCOMP:
+            row[COUNT_FUZZY + mDistances + d]++;
+            break;
+        default:
+            row[COUNT_AMBIGUOUS] += ambiguous;
+            break;
+        }
+    }
+
+    // index (or i7 and i5) of a read that was not assigned
+    void addUnknown(const char* i7, int len7, const char* i5 = NULL, int len5 = 0){
+        mUnknown.add(i7, len7, i5, len5);
+    }
+
+    void merge(const SampleCounts& other);
+    const UnknownIndexes& unknown() const;
+    // sampleNames and sampleBarcodes indexed by sample id
+    bool writeTsv(const string& filename, const vector<string>& sampleNames, const vector<vector<string> >& sampleBarcodes);
+    bool writeJson(const string& filename, const vector<string>& sampleNames, const vector<vector<string> >& sampleBarcodes);
+
+private:
+    enum {
+        COUNT_READS = 0,
+        COUNT_INDEX_READS,
+        COUNT_EXACT,
+        COUNT_REVCOMP,
+        COUNT_AMBIGUOUS,
+        COUNT_FUZZY     // then fuzzy revcomp, mDistances each
+    };
+    uint64_t count(int sampleId, int column) const;
+
+private:
+    int mSamples;
+    int mMinDistance;
+    int mMaxDistance;
+    int mDistances;
+    int mStride;
+    vector<uint64_t> mCounts;
+    UnknownIndexes mUnknown;
+};
+
+// SampleCounts of each thread, so worker threads count without sharing a
+// cache line; merged once the run is done
+class SampleCountsSet{
+public:
+    SampleCountsSet(int samples, int minDistance, int maxDistance, int unknownSlots = 0);
+    ~SampleCountsSet();
+
+    // the counts of the calling thread, looked up once per batch or loop
+    SampleCounts& local();
+    SampleCounts merged();
+
+private:
+    int mSamples;
+    int mMinDistance;
+    int mMaxDistance;
+    int mUnknownSlots;
+    mutex mMtx;
+    map<thread::id, SampleCounts*> mCounts;
+};
+
+#endif
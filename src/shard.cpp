@@ -0,0 +1,212 @@
+//
+//  shard.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "shard.h"
+#include "bgzf.h"
+#include "util.h"
+#include <fstream>
+#include <algorithm>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#define SHARD_COPY_BUF_SIZE (1<<20)
+
+ShardSummary::ShardSummary(){
+    mShard = 0;
+    mShards = 0;
+    mStream = false;
+    mIndexReads = 0;
+    mMatchedIndexReads = 0;
+    mReads = 0;
+    mMatchedReads = 0;
+    mReadsSeconds = 0;
+}
+
+ShardSummary ShardSummary::load(string dir){
+    string filename = joinpath(dir, SHARD_SUMMARY_FILE);
+    ifstream in(filename.c_str());
+    if(!in)
+        error_exit("Failed to open shard summary: " + filename);
+
+    ShardSummary summary;
+    summary.mDir = dir;
+    string line;
+    bool format = false;
+    while(getline(in, line)) {
+        size_t tab = line.find('\t');
+        if(tab == string::npos)
+            continue;
+        string key = line.substr(0, tab);
+        string value = line.substr(tab + 1);
+        if(key == "format")
+            format = value == SHARD_SUMMARY_FORMAT;
+        else if(key == "shard")
+            summary.mShard = atoi(value.c_str());
+        else if(key == "shards")
+            summary.mShards = atoi(value.c_str());
+        else if(key == "mode")
+            summary.mStream = value == "stream";
+        else if(key == "output_prefix")
+            summary.mOutputPrefix = value;
+        else if(key == "output_prefix2")
+            summary.mOutputPrefix2 = value;
+        else if(key == "output_suffix")
+            summary.mSuffix = value;
+        else if(key == "index_reads")
+            summary.mIndexReads = atol(value.c_str());
+        else if(key == "matched_index_reads")
+            summary.mMatchedIndexReads = atol(value.c_str());
+        else if(key == "reads")
+            summary.mReads = atol(value.c_str());
+        else if(key == "matched_reads")
+            summary.mMatchedReads = atol(value.c_str());
+        else if(key == "reads_seconds")
+            summary.mReadsSeconds = atof(value.c_str());
+        else if(key == "sample")
+            summary.mSamples.push_back(value);
+    }
+    if(!format || summary.mShard < 1 || summary.mShard > summary.mShards || summary.mSamples.empty())
+        error_exit("Not a shard summary: " + filename);
+    return summary;
+}
+
+void ShardSummary::save(string dir){
+    string filename = joinpath(dir, SHARD_SUMMARY_FILE);
+    ofstream out(filename.c_str());
+    out << "format\t" << SHARD_SUMMARY_FORMAT << "\n";
+    out << "shard\t" << mShard << "\n";
+    out << "shards\t" << mShards << "\n";
+    out << "mode\t" << (mStream ? "stream" : "two-pass") << "\n";
+    out << "output_prefix\t" << mOutputPrefix << "\n";
+    if(!mOutputPrefix2.empty())
+        out << "output_prefix2\t" << mOutputPrefix2 << "\n";
+    out << "output_suffix\t" << mSuffix << "\n";
+    out << "index_reads\t" << mIndexReads << "\n";
+    out << "matched_index_reads\t" << mMatchedIndexReads << "\n";
+    out << "reads\t" << mReads << "\n";
+    out << "matched_reads\t" << mMatchedReads << "\n";
+    out << "reads_seconds\t" << mReadsSeconds << "\n";
+    for(int i=0; i<mSamples.size(); i++)
+        out << "sample\t" << mSamples[i] << "\n";
+    out.close();
+    if(!out)
+        error_exit("Failed to write shard summary: " + filename);
+}
+
+string ShardSummary::sampleFile(string dir, int sampleId, bool mate) const{
+    return joinpath(dir, basename(mate ? mOutputPrefix2 : mOutputPrefix) + "_" + mSamples[sampleId] + mSuffix);
+}
+
+// Append the file to out, less its trailing BGZF end-of-file block if it has one
+static void appendFile(ofstream& out, string filename, bool dropEofBlock, char* buf){
+    struct stat st;
+    if(stat(filename.c_str(), &st) != 0)
+        error_exit("Failed to open file: " + filename);
+    size_t len = st.st_size;
+
+    ifstream in(filename.c_str(), ios::binary);
+    if(!in)
+        error_exit("Failed to open file: " + filename);
+    const string& eof = BgzfCompressor::eofBlock();
+    if(dropEofBlock && len >= eof.length()) {
+        in.seekg(len - eof.length());
+        string tail(eof.length(), '\0');
+        in.read(&tail[0], tail.length());
+        if(tail == eof)
+            len -= eof.length();
+        in.seekg(0);
+    }
+
+    while(len > 0) {
+        size_t chunk = min(len, (size_t)SHARD_COPY_BUF_SIZE);
+        in.read(buf, chunk);
+        if((size_t)in.gcount() != chunk)
+            error_exit("Failed to read file: " + filename);
+        out.write(buf, chunk);
+        len -= chunk;
+    }
+}
+
+static bool byShard(const ShardSummary& a, const ShardSummary& b){
+    return a.mShard < b.mShard;
+}
+
+ShardSummary mergeShards(vector<ShardSummary> shards, string prefix, string prefix2){
+    if(shards.empty())
+        error_exit("No shards to merge");
+    sort(shards.begin(), shards.end(), byShard);
+
+    const ShardSummary& first = shards[0];
+    if(shards.size() != first.mShards)
+        error_exit("Expected " + to_string(first.mShards) + " shards, got " + to_string(shards.size()));
+    for(int i=0; i<shards.size(); i++) {
+        const ShardSummary& s = shards[i];
+        if(s.mShard != i + 1 || s.mShards != first.mShards)
+            error_exit("Shard " + to_string(i + 1) + " of " + to_string(first.mShards) + " is missing or given twice");
+        if(s.mStream != first.mStream || s.mSuffix != first.mSuffix || s.mSamples != first.mSamples
+            || s.mOutputPrefix2.empty() != first.mOutputPrefix2.empty())
+            error_exit("Shard in " + s.mDir + " was run with different options or barcodes");
+    }
+
+    ShardSummary merged = first;
+    merged.mShard = 0;
+    merged.mOutputPrefix = prefix;
+    merged.mOutputPrefix2 = first.mOutputPrefix2.empty() ? "" : prefix2;
+    merged.mDir = "";
+    merged.mReads = 0;
+    merged.mMatchedReads = 0;
+    merged.mReadsSeconds = 0;
+    if(merged.mStream) {
+        merged.mIndexReads = 0;
+        merged.mMatchedIndexReads = 0;
+    }
+    for(int i=0; i<shards.size(); i++) {
+        // every two-pass shard read the whole index file
+        if(merged.mStream) {
+            merged.mIndexReads += shards[i].mIndexReads;
+            merged.mMatchedIndexReads += shards[i].mMatchedIndexReads;
+        }
+        merged.mReads += shards[i].mReads;
+        merged.mMatchedReads += shards[i].mMatchedReads;
+        merged.mReadsSeconds += shards[i].mReadsSeconds;
+    }
+
+    // sample files are only created for samples with reads, as by a single run
+    bool bgzf = ends_with(merged.mSuffix, ".gz");
+    char* buf = new char[SHARD_COPY_BUF_SIZE];
+    int outputs = merged.mSamples.size() * (merged.mOutputPrefix2.empty() ? 1 : 2);
+    for(int o=0; o<outputs; o++) {
+        // second reads after all the first reads
+        int id = o % merged.mSamples.size();
+        bool mate = o >= merged.mSamples.size();
+        string filename = (mate ? prefix2 : prefix) + "_" + merged.mSamples[id] + merged.mSuffix;
+        remove(filename.c_str());
+
+        vector<string> parts;
+        for(int i=0; i<shards.size(); i++) {
+            string part = shards[i].sampleFile(shards[i].mDir, id, mate);
+            if(file_exists(part))
+                parts.push_back(part);
+        }
+        if(parts.empty())
+            continue;
+
+        ofstream out(filename.c_str(), ios::binary);
+        if(!out)
+            error_exit("Failed to open file for writing: " + filename);
+        for(int i=0; i<parts.size(); i++)
+            appendFile(out, parts[i], bgzf, buf);
+        if(bgzf)
+            out << BgzfCompressor::eofBlock();
+        out.close();
+        if(!out)
+            error_exit("Failed to write to file: " + filename);
+    }
+    delete[] buf;
+
+    return merged;
+}
@@ -0,0 +1,56 @@
+//
+//  shard.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Written into each shard directory next to the sample files
+#define SHARD_SUMMARY_FILE "shard_summary.tsv"
+#define SHARD_SUMMARY_FORMAT "demultiplex_satay_shard_v1"
+
+// Counts and outputs of one --shard run, a tab-separated key/value file read
+// back by the merge subcommand
+class ShardSummary{
+public:
+    ShardSummary();
+
+    // the summary of dir/SHARD_SUMMARY_FILE, exits on a missing or bad file
+    static ShardSummary load(string dir);
+    void save(string dir);
+
+    // dir/<prefix basename>_<sample><suffix>, of the second reads if mate
+    string sampleFile(string dir, int sampleId, bool mate = false) const;
+
+public:
+    int mShard;                 // from 1
+    int mShards;
+    bool mStream;               // index sliced with the reads, else read whole by every shard
+    string mOutputPrefix;       // of a single-node run
+    string mOutputPrefix2;      // of its second reads, empty unless paired-end
+    string mSuffix;
+    long mIndexReads;
+    long mMatchedIndexReads;
+    long mReads;
+    long mMatchedReads;
+    double mReadsSeconds;
+    vector<string> mSamples;    // by sample id
+    string mDir;
+};
+
+// Merge the shards into the files a single-node run would write to
+// <prefix>_<sample><suffix>: each sample file is the concatenation of its
+// shard files in shard order, with BGZF end-of-file blocks dropped between
+// shards. The second reads of paired-end shards go to <prefix2>_<sample><suffix>.
+// Counts are added up into the returned summary.
+ShardSummary mergeShards(vector<ShardSummary> shards, string prefix, string prefix2);
+
+#endif
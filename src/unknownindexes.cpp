@@ -0,0 +1,311 @@
+//
+//  unknownindexes.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "unknownindexes.h"
+#include "barcode.h"
+#include <stdio.h>
+#include <algorithm>
+
+UnknownIndexes::UnknownIndexes(int slots){
+    mSlots = max(slots, 0);
+    mTotal = 0;
+    mUnpacked = 0;
+    mMask = 0;
+    mShift = 64;
+    if(mSlots == 0)
+        return;
+    // at most half full, so probes stay short
+    uint64_t capacity = 2;
+    mShift = 63;
+    while(capacity < 2 * (uint64_t)mSlots) {
+        capacity <<= 1;
+        mShift--;
+    }
+    mMask = capacity - 1;
+    mTable.assign(capacity, -1);
+    mEntries.reserve(mSlots);
+    mHeap.reserve(mSlots);
+    mHeapPos.reserve(mSlots);
+}
+
+bool UnknownIndexes::makeKey(const char* i7, int len7, const char* i5, int len5, Key& key){
+    PackedBarcode first, second;
+    if(len7 + len5 > PACKED_MAX_LEN || !PackedBarcode::pack(i7, len7, first))
+        return false;
+    key.bases = first.mBases;
+    key.nmask = first.mNMask;
+    key.length = len7;
+    key.split = len7;
+    if(i5 != NULL) {
+        if(!PackedBarcode::pack(i5, len5, second))
+            return false;
+        // len7 < PACKED_MAX_LEN here unless the i5 is empty
+        if(len5 > 0) {
+            key.bases |= second.mBases << (2 * len7);
+            key.nmask |= second.mNMask << (2 * len7);
+        }
+        key.length += len5;
+    }
+    return true;
+}
+
+string UnknownIndexes::keyString(const Key& key){
+    PackedBarcode seq;
+    seq.mBases = key.bases;
+    seq.mNMask = key.nmask;
+    seq.mLength = key.length;
+    string s = seq.toString();
+    if(key.split < key.length)
+        s.insert(key.split, "+");
+    return s;
+}
+
+uint64_t UnknownIndexes::slotFor(const Key& key) const{
+    uint64_t h = key.bases ^ (key.nmask * 0xC2B2AE3D27D4EB4FULL) ^ ((uint64_t)key.length << 58) ^ ((uint64_t)key.split << 52);
+    return (h * 0x9E3779B97F4A7C15ULL) >> mShift;
+}
+
+int UnknownIndexes::find(const Key& key) const{
+    if(mSlots == 0)
+        return -1;
+    uint64_t i = slotFor(key);
+    while(mTable[i] >= 0) {
+        if(sameKey(mEntries[mTable[i]].key, key))
+            return mTable[i];
+        i = (i + 1) & mMask;
+    }
+    return -1;
+}
+
+void UnknownIndexes::insert(const Key& key, int entry){
+    uint64_t i = slotFor(key);
+    while(mTable[i] >= 0)
+        i = (i + 1) & mMask;
+    mTable[i] = entry;
+}
+
+// Linear probing without tombstones: later keys of the run are moved back
+// into the hole unless that would put them before their own slot
+void UnknownIndexes::erase(const Key& key){
+    uint64_t i = slotFor(key);
+    while(!sameKey(mEntries[mTable[i]].key, key))
+        i = (i + 1) & mMask;
+    uint64_t j = i;
+    while(true) {
+        j = (j + 1) & mMask;
+        if(mTable[j] < 0)
+            break;
+        uint64_t home = slotFor(mEntries[mTable[j]].key);
+        if(((j - home) & mMask) >= ((j - i) & mMask)) {
+            mTable[i] = mTable[j];
+            i = j;
+        }
+    }
+    mTable[i] = -1;
+}
+
+void UnknownIndexes::addKey(const Key& key, uint64_t count, uint64_t error){
+    int e = find(key);
+    if(e >= 0) {
+        mEntries[e].count += count;
+        mEntries[e].error += error;
+        siftDown(mHeapPos[e]);
+        return;
+    }
+    if(mEntries.size() < mSlots) {
+        Entry entry = {key, count, error};
+        e = mEntries.size();
+        mEntries.push_back(entry);
+        mHeap.push_back(e);
+        mHeapPos.push_back(mHeap.size() - 1);
+        insert(key, e);
+        siftUp(mHeapPos[e]);
+        return;
+    }
+    // take over the smallest counter
+    e = mHeap[0];
+    Entry& smallest = mEntries[e];
+    erase(smallest.key);
+    smallest.key = key;
+    smallest.error = smallest.count + error;
+    smallest.count += count;
+    insert(key, e);
+    siftDown(0);
+}
+
+uint64_t UnknownIndexes::minCount() const{
+    // an index counted by neither could have been seen this often if full
+    if(mSlots == 0 || mEntries.size() < mSlots)
+        return 0;
+    return mEntries[mHeap[0]].count;
+}
+
+void UnknownIndexes::swapHeap(int a, int b){
+    swap(mHeap[a], mHeap[b]);
+    mHeapPos[mHeap[a]] = a;
+    mHeapPos[mHeap[b]] = b;
+}
+
+void UnknownIndexes::siftUp(int pos){
+    while(pos > 0) {
+        int parent = (pos - 1) / 2;
+        if(mEntries[mHeap[parent]].count <= mEntries[mHeap[pos]].count)
+            break;
+        swapHeap(pos, parent);
+        pos = parent;
+    }
+}
+
+void UnknownIndexes::siftDown(int pos){
+    int n = mHeap.size();
+    while(true) {
+        int child = 2 * pos + 1;
+        if(child >= n)
+            break;
+        if(child + 1 < n && mEntries[mHeap[child + 1]].count < mEntries[mHeap[child]].count)
+            child++;
+        if(mEntries[mHeap[pos]].count <= mEntries[mHeap[child]].count)
+            break;
+        swapHeap(pos, child);
+        pos = child;
+    }
+}
+
+// Ties in key order, so the report doesn't depend on the order of updates
+bool UnknownIndexes::moreFrequent(const Entry& a, const Entry& b){
+    if(a.count != b.count)
+        return a.count > b.count;
+    if(a.key.bases != b.key.bases)
+        return a.key.bases < b.key.bases;
+    if(a.key.nmask != b.key.nmask)
+        return a.key.nmask < b.key.nmask;
+    if(a.key.length != b.key.length)
+        return a.key.length < b.key.length;
+    return a.key.split < b.key.split;
+}
+
+// Keep the mSlots largest counts; stored smallest first, which is a heap
+void UnknownIndexes::rebuild(vector<Entry>& entries){
+    sort(entries.begin(), entries.end(), moreFrequent);
+    if(entries.size() > mSlots)
+        entries.resize(mSlots);
+    reverse(entries.begin(), entries.end());
+    mEntries = entries;
+    mHeap.resize(mEntries.size());
+    mHeapPos.resize(mEntries.size());
+    fill(mTable.begin(), mTable.end(), -1);
+    for(int i=0; i<mEntries.size(); i++) {
+        mHeap[i] = i;
+        mHeapPos[i] = i;
+        insert(mEntries[i].key, i);
+    }
+}
+
+void UnknownIndexes::merge(const UnknownIndexes& other){
+    mTotal += other.mTotal;
+    mUnpacked += other.mUnpacked;
+    if(mSlots == 0 || other.mEntries.empty())
+        return;
+    uint64_t minThis = minCount();
+    uint64_t minOther = other.minCount();
+    vector<Entry> entries;
+    entries.reserve(mEntries.size() + other.mEntries.size());
+    for(int i=0; i<mEntries.size(); i++) {
+        Entry entry = mEntries[i];
+        int o = other.find(entry.key);
+        entry.count += o >= 0 ? other.mEntries[o].count : minOther;
+        entry.error += o >= 0 ? other.mEntries[o].error : minOther;
+        entries.push_back(entry);
+    }
+    for(int i=0; i<other.mEntries.size(); i++) {
+        if(find(other.mEntries[i].key) >= 0)
+            continue;
+        Entry entry = other.mEntries[i];
+        entry.count += minThis;
+        entry.error += minThis;
+        entries.push_back(entry);
+    }
+    rebuild(entries);
+}
+
+uint64_t UnknownIndexes::total() const{
+    return mTotal;
+}
+
+uint64_t UnknownIndexes::unpacked() const{
+    return mUnpacked;
+}
+
+// Mismatches over the shorter of the two, plus the difference in length
+static int distance(const string& a, const string& b){
+    int n = min(a.length(), b.length());
+    int d = max(a.length(), b.length()) - n;
+    for(int i=0; i<n; i++)
+        d += a[i] != b[i];
+    return d;
+}
+
+static vector<string> splitIndexes(const string& s){
+    vector<string> parts;
+    size_t plus = s.find('+');
+    parts.push_back(s.substr(0, plus));
+    if(plus != string::npos)
+        parts.push_back(s.substr(plus + 1));
+    return parts;
+}
+
+bool UnknownIndexes::writeTsv(const string& filename, const vector<string>& sampleNames, const vector<vector<string> >& sampleBarcodes, int top) const{
+    FILE* fp = fopen(filename.c_str(), "w");
+    if(fp == NULL)
+        return false;
+
+    // each barcode and its reverse complement, index by index
+    vector<vector<string> > barcodes, revComps;
+    vector<int> barcodeSamples;
+    for(int s=0; s<sampleBarcodes.size(); s++) {
+        for(int i=0; i<sampleBarcodes[s].size(); i++) {
+            vector<string> parts = splitIndexes(sampleBarcodes[s][i]);
+            barcodes.push_back(parts);
+            for(int p=0; p<parts.size(); p++)
+                parts[p] = reverseComplement(parts[p]);
+            revComps.push_back(parts);
+            barcodeSamples.push_back(s);
+        }
+    }
+
+    vector<Entry> entries = mEntries;
+    sort(entries.begin(), entries.end(), moreFrequent);
+    if(entries.size() > top)
+        entries.resize(top);
+
+    fprintf(fp, "index\tcount\terror\tnearest_barcode\tnearest_sample\tdistance\n");
+    for(int i=0; i<entries.size(); i++) {
+        string index = keyString(entries[i].key);
+        vector<string> parts = splitIndexes(index);
+        int nearest = -1;
+        int nearestDist = 0;
+        for(int b=0; b<barcodes.size(); b++) {
+            if(barcodes[b].size() != parts.size())
+                continue;
+            int d = 0;
+            for(int p=0; p<parts.size(); p++)
+                d += min(distance(parts[p], barcodes[b][p]), distance(parts[p], revComps[b][p]));
+            if(nearest < 0 || d < nearestDist) {
+                nearest = b;
+                nearestDist = d;
+            }
+        }
+        fprintf(fp, "%s\t%llu\t%llu", index.c_str(), (unsigned long long)entries[i].count, (unsigned long long)entries[i].error);
+        if(nearest < 0) {
+            fprintf(fp, "\t\t\t\n");
+        } else {
+            string barcode = barcodes[nearest][0] + (parts.size() > 1 ? "+" + barcodes[nearest][1] : "");
+            fprintf(fp, "\t%s\t%s\t%d\n", barcode.c_str(), sampleNames[barcodeSamples[nearest]].c_str(), nearestDist);
+        }
+    }
+    return fclose(fp) == 0;
+}
@@ -0,0 +1,104 @@
+//
+//  unknownindexes.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef UNKNOWN_INDEXES_H
+#define UNKNOWN_INDEXES_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "packedbarcode.h"
+
+using namespace std;
+
+// Counters kept for each index reported, more than the report lists so
+// that the counts near its end are still close
+#define UNKNOWN_SLOTS_PER_TOP 8
+
+// Most frequent index sequences of the unassigned reads, in a fixed number
+// of counters (space-saving): an index without a counter takes over the
+// smallest one, adding to its count and keeping that count as the error.
+// A count is never below the true number of reads and overstates it by at
+// most its error, and any index more frequent than every counter is kept.
+// The i7 (and i5 after it) are packed 2 bits per base into one 64-bit key;
+// an index pair longer than PACKED_MAX_LEN or with other letters than ACGTN
+// is only counted as not packed.
+// Counters are found through a flat open-addressing table and the smallest
+// one through a min-heap, so adding an index is one probe and a short sift.
+class UnknownIndexes{
+public:
+    // slots of 0 keeps nothing
+    UnknownIndexes(int slots = 0);
+
+    // i5 is NULL for single indexes
+    void add(const char* i7, int len7, const char* i5 = NULL, int len5 = 0){
+        if(mSlots == 0)
+            return;
+        mTotal++;
+        Key key;
+        if(!makeKey(i7, len7, i5, len5, key)) {
+            mUnpacked++;
+            return;
+        }
+        addKey(key, 1, 0);
+    }
+
+    // counters of both, the counts of an index missing from one raised by
+    // that one's smallest count if it was full
+    void merge(const UnknownIndexes& other);
+    uint64_t total() const;
+    uint64_t unpacked() const;
+    // the top indexes with the nearest barcode, allowing for the reverse
+    // complement as the matcher does; dual barcodes are i7+i5
+    bool writeTsv(const string& filename, const vector<string>& sampleNames, const vector<vector<string> >& sampleBarcodes, int top) const;
+
+private:
+    struct Key {
+        uint64_t bases;
+        uint64_t nmask;
+        uint8_t length;
+        uint8_t split;      // length of the i7, length for single indexes
+    };
+
+    struct Entry {
+        Key key;
+        uint64_t count;
+        uint64_t error;
+    };
+
+    static bool makeKey(const char* i7, int len7, const char* i5, int len5, Key& key);
+    static string keyString(const Key& key);
+    static bool sameKey(const Key& a, const Key& b){
+        return a.bases == b.bases && a.nmask == b.nmask && a.length == b.length && a.split == b.split;
+    }
+    static bool moreFrequent(const Entry& a, const Entry& b);
+    void addKey(const Key& key, uint64_t count, uint64_t error);
+    uint64_t slotFor(const Key& key) const;
+    int find(const Key& key) const;
+    void insert(const Key& key, int entry);
+    void erase(const Key& key);
+    uint64_t minCount() const;
+    void siftUp(int pos);
+    void siftDown(int pos);
+    void swapHeap(int a, int b);
+    void rebuild(vector<Entry>& entries);
+
+private:
+    int mSlots;
+    uint64_t mTotal;
+    uint64_t mUnpacked;
+    vector<Entry> mEntries;
+    // entry indexes, smallest count first, and where each entry sits in it
+    vector<int32_t> mHeap;
+    vector<int32_t> mHeapPos;
+    // entry index of each key, -1 when empty
+    vector<int32_t> mTable;
+    uint64_t mMask;
+    int mShift;
+};
+
+#endif
@@ -0,0 +1,224 @@
+//
+//  windowjoin.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "windowjoin.h"
+#include "util.h"
+#include <stdint.h>
+
+// Side files are a sequence of length-prefixed strings
+static void writeString(FILE* fp, const string& s, const string& filename){
+    uint32_t len = s.length();
+    if(fwrite(&len, sizeof(len), 1, fp) != 1 || fwrite(s.data(), 1, len, fp) != len)
+        error_exit("Failed to write to file: " + filename);
+}
+
+static bool readString(FILE* fp, string& s, const string& filename){
+    uint32_t len;
+    if(fread(&len, sizeof(len), 1, fp) != 1)
+        return false;
+    s.resize(len);
+    if(fread(&s[0], 1, len, fp) != len)
+        error_exit("Failed to read file: " + filename);
+    return true;
+}
+
+WindowJoin::WindowJoin(long window, string spillPrefix, function<void(int, const string&, const string&)> emit){
+    mWindow = window;
+    mIndexCount = 0;
+    mReadCount = 0;
+    mDrift = 0;
+    mIndexSpillFile = spillPrefix + "_window_index.tmp";
+    mReadSpillFile = spillPrefix + "_window_reads.tmp";
+    mIndexSpill = NULL;
+    mReadSpill = NULL;
+    mEmit = emit;
+    mSpilledIndexes = 0;
+    mSpilledReads = 0;
+    mPeakWaiting = 0;
+}
+
+WindowJoin::~WindowJoin(){
+    if(mIndexSpill) {
+        fclose(mIndexSpill);
+        remove(mIndexSpillFile.c_str());
+    }
+    if(mReadSpill) {
+        fclose(mReadSpill);
+        remove(mReadSpillFile.c_str());
+    }
+}
+
+FILE* WindowJoin::openSpill(string filename, const char* mode){
+    FILE* fp = fopen(filename.c_str(), mode);
+    if(fp == NULL)
+        error_exit("Failed to open file: " + filename);
+    return fp;
+}
+
+void WindowJoin::advance(long indexes, long reads){
+    mIndexCount = indexes;
+    mReadCount = reads;
+    while(!mIndexOrder.empty() && mIndexOrder.front().other + mWindow < mReadCount) {
+        const Arrival& arrival = mIndexOrder.front();
+        unordered_map<string, WaitingIndex>::iterator it = mIndexes.find(arrival.name);
+        if(it != mIndexes.end() && it->second.ordinal == arrival.ordinal) {
+            spillIndex(it->first, it->second.sampleId);
+            mIndexes.erase(it);
+        }
+        mIndexOrder.pop_front();
+    }
+    while(!mReadOrder.empty() && mReadOrder.front().other + mWindow < mIndexCount) {
+        const Arrival& arrival = mReadOrder.front();
+        pair<unordered_multimap<string, WaitingRead>::iterator, unordered_multimap<string, WaitingRead>::iterator> range = mReads.equal_range(arrival.name);
+        for(unordered_multimap<string, WaitingRead>::iterator it = range.first; it != range.second; ++it) {
+            if(it->second.ordinal == arrival.ordinal) {
+                spillRead(arrival.name, it->second);
+                mReads.erase(it);
+                break;
+            }
+        }
+        mReadOrder.pop_front();
+    }
+}
+
+void WindowJoin::addIndex(const char* name, int len, int sampleId){
+    string key(name, len);
+    if(!mReads.empty()) {
+        pair<unordered_multimap<string, WaitingRead>::iterator, unordered_multimap<string, WaitingRead>::iterator> range = mReads.equal_range(key);
+        if(range.first != range.second) {
+            for(unordered_multimap<string, WaitingRead>::iterator it = range.first; it != range.second; ++it) {
+                noteDrift(mIndexCount - it->second.ordinal);
+                mEmit(sampleId, it->second.record, it->second.mate);
+            }
+            mReads.erase(range.first, range.second);
+            return;
+        }
+    }
+    // a later index of the same name replaces one still waiting, but not one
+    // a read has taken: that read keeps the first index after it, and this
+    // one waits for another read of the name
+    WaitingIndex& index = mIndexes[key];
+    index.sampleId = sampleId;
+    index.ordinal = mIndexCount;
+    Arrival arrival = {mReadCount, mIndexCount, key};
+    mIndexOrder.push_back(arrival);
+    notePeak();
+}
+
+int WindowJoin::addRead(const char* name, int len, const FastqRecord& read, const FastqRecord* mate){
+    string key(name, len);
+    unordered_map<string, WaitingIndex>::iterator it = mIndexes.find(key);
+    if(it != mIndexes.end()) {
+        int sampleId = it->second.sampleId;
+        noteDrift(it->second.ordinal - mReadCount);
+        mIndexes.erase(it);
+        return sampleId;
+    }
+    WaitingRead& waiting = mReads.insert(make_pair(key, WaitingRead()))->second;
+    appendRecord(waiting.record, read);
+    if(mate != NULL)
+        appendRecord(waiting.mate, *mate);
+    waiting.ordinal = mReadCount;
+    Arrival arrival = {mIndexCount, mReadCount, key};
+    mReadOrder.push_back(arrival);
+    notePeak();
+    return -1;
+}
+
+// Step towards the offset of each pair, which follows the median offset:
+// records missing from one file move it one at a time, records far out of
+// place barely move it
+void WindowJoin::noteDrift(long offset){
+    if(offset > mDrift)
+        mDrift++;
+    else if(offset < mDrift)
+        mDrift--;
+}
+
+long WindowJoin::drift(){
+    return mDrift;
+}
+
+void WindowJoin::spillIndex(const string& name, int sampleId){
+    if(mIndexSpill == NULL)
+        mIndexSpill = openSpill(mIndexSpillFile, "wb+");
+    writeString(mIndexSpill, name, mIndexSpillFile);
+    if(fwrite(&sampleId, sizeof(sampleId), 1, mIndexSpill) != 1)
+        error_exit("Failed to write to file: " + mIndexSpillFile);
+    mSpilledIndexes++;
+}
+
+void WindowJoin::spillRead(const string& name, const WaitingRead& read){
+    if(mReadSpill == NULL)
+        mReadSpill = openSpill(mReadSpillFile, "wb+");
+    writeString(mReadSpill, name, mReadSpillFile);
+    writeString(mReadSpill, read.record, mReadSpillFile);
+    writeString(mReadSpill, read.mate, mReadSpillFile);
+    mSpilledReads++;
+}
+
+void WindowJoin::finish(int unassignedId){
+    // the side table: every index still waiting or spilled, later ones first
+    unordered_map<string, int> indexes;
+    if(mIndexSpill) {
+        rewind(mIndexSpill);
+        string name;
+        int sampleId;
+        while(readString(mIndexSpill, name, mIndexSpillFile)) {
+            if(fread(&sampleId, sizeof(sampleId), 1, mIndexSpill) != 1)
+                error_exit("Failed to read file: " + mIndexSpillFile);
+            indexes[name] = sampleId;
+        }
+    }
+    for(unordered_map<string, WaitingIndex>::iterator it = mIndexes.begin(); it != mIndexes.end(); ++it)
+        indexes[it->first] = it->second.sampleId;
+    mIndexes.clear();
+    mIndexOrder.clear();
+
+    // spilled reads came before the ones still waiting
+    if(mReadSpill) {
+        rewind(mReadSpill);
+        string name, record, mate;
+        while(readString(mReadSpill, name, mReadSpillFile)) {
+            if(!readString(mReadSpill, record, mReadSpillFile) || !readString(mReadSpill, mate, mReadSpillFile))
+                error_exit("Failed to read file: " + mReadSpillFile);
+            unordered_map<string, int>::iterator it = indexes.find(name);
+            mEmit(it == indexes.end() ? unassignedId : it->second, record, mate);
+        }
+    }
+    for(int i=0; i<mReadOrder.size(); i++) {
+        const string& name = mReadOrder[i].name;
+        pair<unordered_multimap<string, WaitingRead>::iterator, unordered_multimap<string, WaitingRead>::iterator> range = mReads.equal_range(name);
+        for(unordered_multimap<string, WaitingRead>::iterator it = range.first; it != range.second; ++it) {
+            if(it->second.ordinal == mReadOrder[i].ordinal) {
+                unordered_map<string, int>::iterator found = indexes.find(name);
+                mEmit(found == indexes.end() ? unassignedId : found->second, it->second.record, it->second.mate);
+                mReads.erase(it);
+                break;
+            }
+        }
+    }
+    mReadOrder.clear();
+}
+
+void WindowJoin::notePeak(){
+    long waiting = mIndexes.size() + mReads.size();
+    if(waiting > mPeakWaiting)
+        mPeakWaiting = waiting;
+}
+
+long WindowJoin::spilledIndexes(){
+    return mSpilledIndexes;
+}
+
+long WindowJoin::spilledReads(){
+    return mSpilledReads;
+}
+
+long WindowJoin::peakWaiting(){
+    return mPeakWaiting;
+}
@@ -0,0 +1,100 @@
+//
+//  windowjoin.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef WINDOW_JOIN_H
+#define WINDOW_JOIN_H
+
+#include <stdio.h>
+#include <string>
+#include <deque>
+#include <functional>
+#include <unordered_map>
+#include "fastqreader.h"
+
+using namespace std;
+
+// Join of index assignments and reads from files that are nearly in the same
+// order, read side by side. A record whose partner has not turned up yet
+// waits in a hash table until window records of the other file have been read
+// past it, then is spilled to a side file next to the outputs and resolved
+// after the last record. Memory is proportional to how out of order the files
+// are, not to their size.
+// Records missing from one file shift the other ahead; drift() is how far,
+// from the pairs joined in the tables, so the caller can read the file that
+// is behind and keep partners within the window.
+// Index records of the same name are not resolved last-one-wins as in the
+// two-pass ReadIndex: each read takes the last one read before it or, when
+// the read came first, the first one after it, or the last of all if the
+// read was spilled.
+class WindowJoin{
+public:
+    // emit(sampleId, record, mate) is called for each waiting read once its
+    // sample is known; mate is empty for single-end reads
+    WindowJoin(long window, string spillPrefix, function<void(int, const string&, const string&)> emit);
+    ~WindowJoin();
+
+    // records read so far from each file, spills what has waited too long
+    void advance(long indexes, long reads);
+    // index record number indexes: the read waiting for this name, if any,
+    // is emitted
+    void addIndex(const char* name, int len, int sampleId);
+    // read number reads: sample id of the read if its index has been seen,
+    // else -1 and the read (and its mate, which may be NULL) waits for it
+    int addRead(const char* name, int len, const FastqRecord& read, const FastqRecord* mate);
+    // index record number - read number, typical of the pairs joined in the tables
+    long drift();
+    // emit every read still waiting, unassignedId if its index never came
+    void finish(int unassignedId);
+
+    long spilledIndexes();
+    long spilledReads();
+    long peakWaiting();
+
+private:
+    struct WaitingIndex {
+        int sampleId;
+        long ordinal;
+    };
+    struct WaitingRead {
+        string record;
+        string mate;
+        long ordinal;
+    };
+    // other is the count of the other file when the record started waiting
+    struct Arrival {
+        long other;
+        long ordinal;
+        string name;
+    };
+
+    void spillIndex(const string& name, int sampleId);
+    void spillRead(const string& name, const WaitingRead& read);
+    FILE* openSpill(string filename, const char* mode);
+    void notePeak();
+    void noteDrift(long offset);
+
+private:
+    long mWindow;
+    long mIndexCount;
+    long mReadCount;
+    long mDrift;
+    string mIndexSpillFile;
+    string mReadSpillFile;
+    FILE* mIndexSpill;
+    FILE* mReadSpill;
+    function<void(int, const string&, const string&)> mEmit;
+    unordered_map<string, WaitingIndex> mIndexes;
+    unordered_multimap<string, WaitingRead> mReads;
+    // in arrival order, stale once matched
+    deque<Arrival> mIndexOrder;
+    deque<Arrival> mReadOrder;
+    long mSpilledIndexes;
+    long mSpilledReads;
+    long mPeakWaiting;
+};
+
+#endif
@@ -0,0 +1,294 @@
+//
+//  writer.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#include "writer.h"
+#include "util.h"
+#include <string.h>
+#include <sys/resource.h>
+
+SampleWriter::SampleWriter(string filename, size_t bufSize, BgzfCompressor* compressor){
+    mFilename = filename;
+    mFile = NULL;
+    mCompressor = compressor;
+    mBuf = NULL;
+    mBufSize = bufSize;
+    mBufUsedLen = 0;
+    mBytesWritten = 0;
+    // two buffers' worth, BGZF_PENDING_PER_WRITER for a full size buffer
+    mMaxPending = max(min((size_t)BGZF_PENDING_PER_WRITER, 2 * bufSize / BGZF_BLOCK_SIZE), (size_t)1);
+    mSuspended = false;
+    mOpenFiles = NULL;
+}
+
+SampleWriter::~SampleWriter(){
+    close();
+}
+
+void SampleWriter::setOpenFiles(OpenFiles* openFiles){
+    mOpenFiles = openFiles;
+}
+
+void SampleWriter::open(){
+    // a suspended file already holds the records written before
+    mFile = fopen(mFilename.c_str(), mSuspended ? "ab" : "wb");
+    if(mFile == NULL) {
+        error_exit("Failed to open file for writing: " + mFilename);
+    }
+    mBuf = new char[mBufSize];
+    mBufUsedLen = 0;
+    mSuspended = false;
+    if(mOpenFiles)
+        mOpenFiles->opened(this);
+}
+
+bool SampleWriter::isOpen(){
+    return mFile != NULL;
+}
+
+void SampleWriter::write(const char* data, size_t len){
+    if(mFile == NULL)
+        open();
+    else if(mOpenFiles)
+        mOpenFiles->written(this);
+
+    // records larger than the buffer skip it entirely
+    if(mBufUsedLen + len > mBufSize) {
+        flush();
+        if(len >= mBufSize) {
+            output(data, len);
+            mBytesWritten += len;
+            return;
+        }
+    }
+    memcpy(mBuf + mBufUsedLen, data, len);
+    mBufUsedLen += len;
+    mBytesWritten += len;
+}
+
+void SampleWriter::write(const string& str){
+    write(str.data(), str.length());
+}
+
+void SampleWriter::writeRead(Read* r){
+    // same layout as Read::toString() without building the temporary
+    write(r->mName);
+    write("\n", 1);
+    write(r->mSeq.mStr);
+    write("\n", 1);
+    write(r->mStrand);
+    write("\n", 1);
+    write(r->mQuality);
+    write("\n", 1);
+}
+
+void SampleWriter::writeRecord(const FastqRecord& rec){
+    write(rec.name, rec.nameLen);
+    write("\n", 1);
+    write(rec.seq, rec.seqLen);
+    write("\n", 1);
+    write(rec.strand, rec.strandLen);
+    write("\n", 1);
+    write(rec.quality, rec.qualityLen);
+    write("\n", 1);
+}
+
+void SampleWriter::output(const char* data, size_t len){
+    if(mCompressor == NULL) {
+        if(fwrite(data, 1, len, mFile) != len)
+            error_exit("Failed to write to file: " + mFilename);
+        return;
+    }
+
+    for(size_t pos=0; pos<len; pos+=BGZF_BLOCK_SIZE) {
+        BgzfBlock* block = new BgzfBlock();
+        block->data.assign(data + pos, min((size_t)BGZF_BLOCK_SIZE, len - pos));
+        mCompressor->submit(block);
+        mBlocks.push_back(block);
+    }
+    writeBlocks(false);
+}
+
+// Write compressed blocks in submission order, all of them or only those
+// already done while few enough are pending
+void SampleWriter::writeBlocks(bool all){
+    while(!mBlocks.empty()) {
+        BgzfBlock* block = mBlocks.front();
+        if(all || mBlocks.size() > mMaxPending)
+            mCompressor->wait(block);
+        else if(!mCompressor->isDone(block))
+            break;
+        if(fwrite(block->compressed.data(), 1, block->compressed.length(), mFile) != block->compressed.length())
+            error_exit("Failed to write to file: " + mFilename);
+        mBlocks.pop_front();
+        delete block;
+    }
+}
+
+void SampleWriter::flush(){
+    if(mFile == NULL || mBufUsedLen == 0)
+        return;
+    output(mBuf, mBufUsedLen);
+    mBufUsedLen = 0;
+}
+
+void SampleWriter::close(){
+    if(mFile == NULL) {
+        // a suspended BGZF file still needs its end-of-file block
+        if(!mSuspended || mCompressor == NULL) {
+            mSuspended = false;
+            return;
+        }
+        open();
+    }
+    flush();
+    if(mCompressor) {
+        writeBlocks(true);
+        const string& eof = BgzfCompressor::eofBlock();
+        if(fwrite(eof.data(), 1, eof.length(), mFile) != eof.length())
+            error_exit("Failed to write to file: " + mFilename);
+    }
+    if(fclose(mFile) != 0)
+        error_exit("Failed to close file: " + mFilename);
+    mFile = NULL;
+    delete[] mBuf;
+    mBuf = NULL;
+    if(mOpenFiles)
+        mOpenFiles->closed(this);
+}
+
+void SampleWriter::suspend(){
+    if(mFile == NULL)
+        return;
+    flush();
+    if(mCompressor)
+        writeBlocks(true);
+    if(fclose(mFile) != 0)
+        error_exit("Failed to close file: " + mFilename);
+    mFile = NULL;
+    delete[] mBuf;
+    mBuf = NULL;
+    mSuspended = true;
+    if(mOpenFiles)
+        mOpenFiles->closed(this);
+}
+
+size_t SampleWriter::bytesWritten(){
+    return mBytesWritten;
+}
+
+OpenFiles::OpenFiles(size_t maxOpen){
+    mMaxOpen = max(maxOpen, (size_t)1);
+}
+
+void OpenFiles::opened(SampleWriter* writer){
+    mOpen.push_front(writer);
+    writer->mOpenPos = mOpen.begin();
+    while(mOpen.size() > mMaxOpen)
+        mOpen.back()->suspend();
+}
+
+void OpenFiles::written(SampleWriter* writer){
+    if(mOpen.front() != writer)
+        mOpen.splice(mOpen.begin(), mOpen, writer->mOpenPos);
+}
+
+void OpenFiles::closed(SampleWriter* writer){
+    mOpen.erase(writer->mOpenPos);
+}
+
+size_t OpenFiles::maxOpen(){
+    return mMaxOpen;
+}
+
+SampleOutputs::SampleOutputs(vector<string> filenames, BgzfCompressor* compressor, size_t bufferBudget, size_t maxOpen){
+    mMaxOpen = maxOpen > 0 ? maxOpen : defaultMaxOpen();
+    // fewer open files rather than buffers below the minimum
+    mMaxOpen = max(min(mMaxOpen, bufferBudget / WRITER_MIN_BUF_SIZE), (size_t)1);
+    size_t open = max(min(mMaxOpen, filenames.size()), (size_t)1);
+    mBufSize = min(max(bufferBudget / open, (size_t)WRITER_MIN_BUF_SIZE), (size_t)WRITER_BUF_SIZE);
+    mCompressed = compressor != NULL;
+    for(int i=0; i<filenames.size(); i++) {
+        mWriters.push_back(new SampleWriter(filenames[i], mBufSize, compressor));
+    }
+    setWriterThreads(1);
+}
+
+SampleOutputs::~SampleOutputs(){
+    for(int i=0; i<mWriters.size(); i++) {
+        delete mWriters[i];
+    }
+    for(int i=0; i<mOpenFiles.size(); i++) {
+        delete mOpenFiles[i];
+    }
+}
+
+void SampleOutputs::setWriterThreads(int threads){
+    for(int i=0; i<mWriters.size(); i++) {
+        mWriters[i]->suspend();
+    }
+    for(int i=0; i<mOpenFiles.size(); i++) {
+        delete mOpenFiles[i];
+    }
+    mOpenFiles.clear();
+    threads = max(threads, 1);
+    for(int t=0; t<threads; t++) {
+        mOpenFiles.push_back(new OpenFiles(mMaxOpen / threads));
+    }
+    for(int i=0; i<mWriters.size(); i++) {
+        mWriters[i]->setOpenFiles(mOpenFiles[i % threads]);
+    }
+}
+
+size_t SampleOutputs::defaultMaxOpen(){
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+        return WRITER_MAX_OPEN;
+    return min(max((size_t)limit.rlim_cur / 2, (size_t)WRITER_MIN_OPEN), (size_t)WRITER_MAX_OPEN);
+}
+
+size_t SampleOutputs::maxOpen(){
+    return mMaxOpen;
+}
+
+size_t SampleOutputs::bufferSize(){
+    return mBufSize;
+}
+
+size_t SampleOutputs::memoryBytes(){
+    size_t open = min(mMaxOpen, mWriters.size());
+    return open * mBufSize * (mCompressed ? WRITER_BGZF_BUFFERS : 1);
+}
+
+void SampleOutputs::write(int sampleId, Read* r){
+    mWriters[sampleId]->writeRead(r);
+}
+
+void SampleOutputs::write(int sampleId, const FastqRecord& rec){
+    mWriters[sampleId]->writeRecord(rec);
+}
+
+SampleWriter* SampleOutputs::writer(int sampleId){
+    return mWriters[sampleId];
+}
+
+void SampleOutputs::closeAll(){
+    for(int i=0; i<mWriters.size(); i++) {
+        mWriters[i]->close();
+    }
+}
+
+size_t SampleOutputs::bytesWritten(){
+    size_t total = 0;
+    for(int i=0; i<mWriters.size(); i++) {
+        total += mWriters[i]->bytesWritten();
+    }
+    return total;
+}
+
+int SampleOutputs::size(){
+    return mWriters.size();
+}
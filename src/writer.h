@@ -0,0 +1,138 @@
+//
+//  writer.h
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include "read.h"
+#include "fastqreader.h"
+#include "bgzf.h"
+
+using namespace std;
+
+// Buffer of each sample file, shrunk down to WRITER_MIN_BUF_SIZE so that
+// the buffers of all files open at once fit in WRITER_BUFFER_BUDGET
+#define WRITER_BUF_SIZE (1<<20)
+#define WRITER_MIN_BUF_SIZE (64<<10)
+#define WRITER_BUFFER_BUDGET (64<<20)
+
+// A compressed file holds its buffer and up to two buffers' worth of BGZF
+// blocks in flight, each block raw and compressed
+#define WRITER_BGZF_BUFFERS 5
+
+// Sample files kept open at once: half the descriptor limit, leaving the
+// rest to the inputs and join files, within these bounds
+#define WRITER_MIN_OPEN 8
+#define WRITER_MAX_OPEN 1024
+
+class SampleWriter;
+
+// Sample files open at once on one writer thread, most recently written
+// first; opening one more than maxOpen closes the least recently written
+class OpenFiles{
+public:
+    OpenFiles(size_t maxOpen);
+
+    void opened(SampleWriter* writer);
+    void written(SampleWriter* writer);
+    void closed(SampleWriter* writer);
+    size_t maxOpen();
+
+private:
+    list<SampleWriter*> mOpen;
+    size_t mMaxOpen;
+};
+
+// Buffered output for a single sample file
+// The file is opened (and truncated) on the first write and the buffer is
+// only handed to fwrite() once it is full, so each sample costs one open and
+// one close per run regardless of how many reads it receives, as long as
+// its OpenFiles has room. A file closed to make room is reopened for
+// appending on its next write.
+// With a compressor, each full buffer is cut into BGZF blocks that are
+// compressed in the background and written out in order
+class SampleWriter{
+public:
+    SampleWriter(string filename, size_t bufSize = WRITER_BUF_SIZE, BgzfCompressor* compressor = NULL);
+    ~SampleWriter();
+
+    void setOpenFiles(OpenFiles* openFiles);
+
+    void write(const char* data, size_t len);
+    void write(const string& str);
+    void writeRead(Read* r);
+    void writeRecord(const FastqRecord& rec);
+    void flush();
+    void close();
+    // close the file until the next write, keeping what it holds
+    void suspend();
+    bool isOpen();
+    size_t bytesWritten();
+
+private:
+    friend class OpenFiles;
+    void open();
+    void output(const char* data, size_t len);
+    void writeBlocks(bool all);
+
+private:
+    string mFilename;
+    FILE* mFile;
+    BgzfCompressor* mCompressor;
+    deque<BgzfBlock*> mBlocks;
+    char* mBuf;
+    size_t mBufSize;
+    size_t mBufUsedLen;
+    size_t mBytesWritten;
+    size_t mMaxPending;
+    bool mSuspended;
+    OpenFiles* mOpenFiles;
+    list<SampleWriter*>::iterator mOpenPos;
+};
+
+// One SampleWriter per sample, addressed by sample id
+// Open files are capped at maxOpen (0 for the default from the descriptor
+// limit), and the buffer of each file is the budget divided by the files
+// that can be open at once
+// Sample i belongs to writer thread i % threads, each with its own share of
+// the open files, so threads never close each other's files
+//this class is not thread-safe
+class SampleOutputs{
+public:
+    SampleOutputs(vector<string> filenames, BgzfCompressor* compressor = NULL, size_t bufferBudget = WRITER_BUFFER_BUDGET, size_t maxOpen = 0);
+    ~SampleOutputs();
+
+    // called before writing from this many threads, with no file open
+    void setWriterThreads(int threads);
+    static size_t defaultMaxOpen();
+    size_t maxOpen();
+    size_t bufferSize();
+    // most memory the buffers and BGZF blocks of the open files can take
+    size_t memoryBytes();
+
+    void write(int sampleId, Read* r);
+    void write(int sampleId, const FastqRecord& rec);
+    SampleWriter* writer(int sampleId);
+    void closeAll();
+    size_t bytesWritten();
+    int size();
+
+private:
+    vector<SampleWriter*> mWriters;
+    vector<OpenFiles*> mOpenFiles;
+    size_t mMaxOpen;
+    size_t mBufSize;
+    bool mCompressed;
+};
+
+#endif
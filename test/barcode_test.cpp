@@ -0,0 +1,77 @@
+//
+//  barcode_test.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+//  Checks of BarcodeTable matching, exits non-zero if any fails.
+//
+//  usage: barcode_test
+//
+
+#include "barcode.h"
+#include <string.h>
+#include <iostream>
+
+using namespace std;
+
+static int failures = 0;
+
+static void expect(const string& name, const BarcodeMatch& m, int barcode, bool ambiguous){
+    bool ok = m.barcode == barcode && m.ambiguous == ambiguous;
+    cout << (ok ? "ok   " : "FAIL ") << name << ": barcode " << m.barcode << (m.ambiguous ? " (ambiguous)" : "")
+        << ", expected " << barcode << (ambiguous ? " (ambiguous)" : "") << endl;
+    if(!ok)
+        failures++;
+}
+
+static void expectTable(const string& name, BarcodeTable& table, bool lookup){
+    bool ok = table.hasLookup() == lookup && (table.memoryBytes() > 0) == lookup;
+    cout << (ok ? "ok   " : "FAIL ") << name << ": " << (table.hasLookup() ? "lookup" : "scan") << " of "
+        << table.memoryBytes() << " bytes, expected " << (lookup ? "lookup" : "scan") << endl;
+    if(!ok)
+        failures++;
+}
+
+static BarcodeMatch match(BarcodeTable& table, const char* index, const char* qual){
+    return table.match(index, strlen(index), qual);
+}
+
+int main(int argc, char* argv[]){
+    vector<string> barcodes;
+    barcodes.push_back("ACGTAA");
+    barcodes.push_back("ACGAAC");
+    vector<int> sampleIds;
+    sampleIds.push_back(1);
+    sampleIds.push_back(2);
+    BarcodeTable plain (barcodes, sampleIds, 1);
+    BarcodeTable masked (barcodes, sampleIds, 1, 20);
+
+    // the N is one mismatch from ACGTAA and two from ACGAAC
+    expect("N without --min-index-qual", match(plain, "ACGNAA", NULL), 0, false);
+    // masked, ACGTAA is at distance 0 and ACGAAC at 1: still ACGTAA
+    expect("N with --min-index-qual", match(masked, "ACGNAA", NULL), 0, false);
+    expect("low quality base", match(masked, "ACGCAA", "III#II"), 0, false);
+    expect("masked reverse complement", match(masked, "TTNCGT", NULL), 0, false);
+    // both barcodes at distance 0 once two bases are masked
+    expect("tie at the best distance", match(masked, "ACGNAN", NULL), -1, true);
+    expect("exact", match(masked, "ACGAAC", "IIIIII"), 1, false);
+
+    // GTTCGN is one mismatch from GTTCTA, and its reverse complement NCGAAC
+    // none from ACGAAC: the nearer reverse complement wins
+    barcodes.push_back("GTTCTA");
+    sampleIds.push_back(3);
+    BarcodeTable three (barcodes, sampleIds, 1, 20);
+    expect("nearer reverse complement", match(three, "GTTCGN", NULL), 1, false);
+    expect("nearer reverse complement, low quality", match(three, "GTTCGA", "IIIII#"), 1, false);
+    expect("nearer forward", match(three, "GTTCTN", NULL), 2, false);
+
+    // a lookup table over its memory budget falls back to the scan
+    BarcodeTable small (barcodes, sampleIds, 1, 0, 1024);
+    expectTable("lookup table without a budget", plain, true);
+    expectTable("lookup table over its budget", small, false);
+    expect("fuzzy match by scan", match(small, "ACGTAT", NULL), 0, false);
+    expect("reverse complement by scan", match(small, "TAGAAC", NULL), 2, false);
+
+    return failures > 0 ? 1 : 0;
+}
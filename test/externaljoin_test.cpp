@@ -0,0 +1,153 @@
+//
+//  externaljoin_test.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+//  Checks that ExternalJoin, on a budget small enough for several runs and
+//  partitions, assigns every read the sample the in-memory ReadIndex gives
+//  it, with duplicate names and names forced onto one key; exits non-zero
+//  if any fails.
+//
+//  usage: externaljoin_test
+//
+
+#include "externaljoin.h"
+#include "readindex.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iterator>
+#include <iostream>
+
+using namespace std;
+
+static int failures = 0;
+
+static void expect(const string& name, bool ok, const string& detail){
+    cout << (ok ? "ok   " : "FAIL ") << name << ": " << detail << endl;
+    if(!ok)
+        failures++;
+}
+
+struct IndexRecord{
+    uint64_t key;
+    string name;
+    int sampleId;
+};
+
+static FastqRecord record(const string& text){
+    // name, sequence, strand and quality lines of text
+    FastqRecord rec;
+    size_t l1 = text.find('\n');
+    size_t l2 = text.find('\n', l1 + 1);
+    size_t l3 = text.find('\n', l2 + 1);
+    rec.name = text.data();
+    rec.nameLen = l1;
+    rec.seq = text.data() + l1 + 1;
+    rec.seqLen = l2 - l1 - 1;
+    rec.strand = text.data() + l2 + 1;
+    rec.strandLen = l3 - l2 - 1;
+    rec.quality = text.data() + l3 + 1;
+    rec.qualityLen = text.length() - l3 - 1;
+    return rec;
+}
+
+static string readText(const string& name, int i){
+    string seq = string("ACGT").substr(i % 4, 1) + "ACGTACGT";
+    return name + " 1:N:0:ACGT\n" + seq + "\n+\n" + string(seq.length(), 'F');
+}
+
+int main(int argc, char* argv[]){
+    char dirTemplate[] = "/tmp/externaljoin_test.XXXXXX";
+    if(mkdtemp(dirTemplate) == NULL) {
+        cerr << "can't create a directory in /tmp" << endl;
+        return 1;
+    }
+    string dir = dirTemplate;
+
+    // Illumina names, packed into their keys, and names of another form,
+    // hashed; every 97th record repeats an earlier name with another sample,
+    // and every 89th hashed name is forced onto the key of the one before
+    NameCodec codec;
+    string illumina = "@M00001:12:000000000-ABCDE:1:";
+    codec.learn(illumina.data(), illumina.length());
+    const int names = 200000;
+    vector<IndexRecord> index;
+    for(int i=0; i<names; i++) {
+        IndexRecord r;
+        if(i % 2 == 0)
+            r.name = illumina + to_string(1101 + i % 7) + ":" + to_string(i % 30000) + ":" + to_string(i / 2);
+        else
+            r.name = "@read_" + to_string(i);
+        r.key = codec.key(r.name.data(), r.name.length());
+        r.sampleId = 1 + i % 12;
+        if(i % 89 == 1 && i > 2)
+            r.key = index[i - 2].key;
+        index.push_back(r);
+        if(i % 97 == 0 && i > 0) {
+            IndexRecord dup = index[i / 2];
+            dup.sampleId = 13;
+            index.push_back(dup);
+        }
+    }
+
+    // reads in another order, with some that have no index record
+    vector<IndexRecord> reads;
+    for(int i=0; i<index.size(); i+=2)
+        reads.push_back(index[i]);
+    for(int i=1; i<index.size(); i+=2)
+        reads.push_back(index[i]);
+    for(int i=0; i<500; i++) {
+        IndexRecord r;
+        r.name = "@missing_" + to_string(i);
+        r.key = codec.key(r.name.data(), r.name.length());
+        reads.push_back(r);
+    }
+    reverse(reads.begin(), reads.begin() + reads.size() / 3);
+
+    // in memory, as the two-pass mode joins
+    ReadIndex table;
+    for(int i=0; i<index.size(); i++)
+        table.insert(index[i].key, index[i].sampleId);
+    for(int i=0; i<index.size(); i++) {
+        if(table.isCollided(index[i].key))
+            table.resolve(index[i].name, index[i].sampleId);
+    }
+    vector<string> expected;
+    for(int i=0; i<reads.size(); i++) {
+        int sampleId = table.find(reads[i].key, reads[i].name.data(), reads[i].name.length());
+        string text = readText(reads[i].name, i);
+        expected.push_back(to_string(sampleId < 0 ? 0 : sampleId) + "\t" + text + "\n\t" + (i % 3 == 0 ? text + "\n" : ""));
+    }
+
+    // on disk, within 1.5 MB
+    ExternalJoin join(3 << 19, dir + "/join");
+    for(int i=0; i<index.size(); i++)
+        join.addIndex(index[i].key, index[i].name.data(), index[i].name.length(), index[i].sampleId);
+    join.finishIndex();
+    for(int i=0; i<reads.size(); i++) {
+        string text = readText(reads[i].name, i);
+        FastqRecord read = record(text);
+        join.addRead(reads[i].key, reads[i].name.length(), read, i % 3 == 0 ? &read : NULL);
+    }
+    vector<string> joined;
+    join.finish(0, [&](int sampleId, const string& rec, const string& mate) {
+        joined.push_back(to_string(sampleId) + "\t" + rec + "\t" + mate);
+    });
+
+    expect("several runs", join.runs() > 1, to_string(join.runs()) + " runs");
+    expect("several partitions", join.partitions() > 1, to_string(join.partitions()) + " partitions");
+    expect("keys shared by names", join.collisions() > 0 && table.collisions() > 0,
+        to_string(join.collisions()) + " on disk, " + to_string(table.collisions()) + " in memory");
+    sort(expected.begin(), expected.end());
+    sort(joined.begin(), joined.end());
+    vector<string> differ;
+    set_symmetric_difference(expected.begin(), expected.end(), joined.begin(), joined.end(), back_inserter(differ));
+    expect("samples of the in-memory read index", differ.empty() && joined.size() == expected.size(),
+        to_string(differ.size()) + " reads differ, " + to_string(joined.size()) + " of " + to_string(expected.size()) + " joined");
+
+    rmdir(dir.c_str());
+
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,179 @@
+//
+//  gzipreader_test.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+//  Checks that GzipReader inflates BGZF, multi-member and single-member
+//  gzip files, and members with gzip headers inside their compressed data,
+//  to the same bytes as zlib's streaming inflate, on one thread, on a
+//  thread pool and through a pipe; exits non-zero if any fails.
+//
+//  usage: gzipreader_test
+//
+
+#include "gzipreader.h"
+#include "bgzf.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include <fstream>
+
+using namespace std;
+
+static int failures = 0;
+
+static void expect(const string& name, bool ok, const string& detail){
+    cout << (ok ? "ok   " : "FAIL ") << name << (ok ? "" : ": " + detail) << endl;
+    if(!ok)
+        failures++;
+}
+
+// FASTQ records of pseudo-random bases and qualities, which compress about
+// as well as real reads, so a few MB of output span several jobs
+static string fastq(size_t bytes){
+    string out;
+    unsigned int seed = 12345;
+    for(long i=0; out.size() < bytes; i++) {
+        out += "@read" + to_string(i) + " 1:N:0:ACGTACGT\n";
+        string seq, qual;
+        for(int b=0; b<100; b++) {
+            seed = seed * 1103515245 + 12345;
+            seq.push_back("ACGT"[(seed >> 16) & 3]);
+            qual.push_back('F' - ((seed >> 20) & 7));
+        }
+        out += seq + "\n+\n" + qual + "\n";
+    }
+    return out;
+}
+
+// One gzip member of data
+static string gzipMember(const string& data, int level){
+    z_stream s;
+    memset(&s, 0, sizeof(s));
+    deflateInit2(&s, level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    string out(deflateBound(&s, data.size()), '\0');
+    s.next_in = (Bytef*)data.data();
+    s.avail_in = data.size();
+    s.next_out = (Bytef*)&out[0];
+    s.avail_out = out.size();
+    deflate(&s, Z_FINISH);
+    out.resize(out.size() - s.avail_out);
+    deflateEnd(&s);
+    return out;
+}
+
+// data cut into members of memberSize bytes
+static string gzipMembers(const string& data, size_t memberSize, int level){
+    string out;
+    for(size_t pos=0; pos<data.size(); pos+=memberSize)
+        out += gzipMember(data.substr(pos, memberSize), level);
+    return out;
+}
+
+static string bgzf(const string& data){
+    BgzfCompressor compressor(6, 1);
+    string out;
+    for(size_t pos=0; pos<data.size(); pos+=BGZF_BLOCK_SIZE) {
+        BgzfBlock block;
+        block.data = data.substr(pos, BGZF_BLOCK_SIZE);
+        compressor.submit(&block);
+        compressor.wait(&block);
+        out += block.compressed;
+    }
+    return out + BgzfCompressor::eofBlock();
+}
+
+// Every member of a gzip file inflated with zlib's streaming interface
+static string zlibInflate(const string& gz){
+    z_stream s;
+    memset(&s, 0, sizeof(s));
+    inflateInit2(&s, 16 + MAX_WBITS);
+    s.next_in = (Bytef*)gz.data();
+    s.avail_in = gz.size();
+    string out;
+    char buf[1<<16];
+    while(true) {
+        s.next_out = (Bytef*)buf;
+        s.avail_out = sizeof(buf);
+        int ret = inflate(&s, Z_NO_FLUSH);
+        out.append(buf, sizeof(buf) - s.avail_out);
+        if(ret == Z_STREAM_END) {
+            if(s.avail_in == 0)
+                break;
+            inflateReset(&s);
+        } else if(ret != Z_OK) {
+            out += "<zlib error>";
+            break;
+        }
+    }
+    inflateEnd(&s);
+    return out;
+}
+
+static string readAll(GzipReader& reader){
+    string out;
+    char buf[50000];
+    size_t n;
+    while((n = reader.read(buf, sizeof(buf))) > 0)
+        out.append(buf, n);
+    return out;
+}
+
+// The file read on one thread, on a pool of threads and through a pipe
+static void checkFile(const string& name, const string& dir, const string& gz, const string& data){
+    string path = dir + "/test.gz";
+    {
+        ofstream file(path.c_str(), ofstream::binary);
+        file << gz;
+    }
+    string reference = zlibInflate(gz);
+    expect(name + ", zlib", reference == data, "zlib output differs from the input");
+
+    int threads[] = {1, 4};
+    for(int t=0; t<2; t++) {
+        FILE* file = fopen(path.c_str(), "rb");
+        GzipReader reader(file, path, threads[t]);
+        string out = readAll(reader);
+        bool parallel = reader.isParallel();
+        fclose(file);
+        expect(name + ", " + to_string(threads[t]) + (threads[t] > 1 ? " threads" : " thread") + (parallel ? " (parallel)" : ""),
+            out == reference, to_string(out.size()) + " bytes instead of " + to_string(reference.size()));
+    }
+
+    FILE* pipe = popen(("cat " + path).c_str(), "r");
+    GzipReader reader(pipe, path, 4);
+    string out = readAll(reader);
+    pclose(pipe);
+    expect(name + ", pipe", out == reference, to_string(out.size()) + " bytes instead of " + to_string(reference.size()));
+
+    unlink(path.c_str());
+}
+
+int main(int argc, char* argv[]){
+    char dirTemplate[] = "/tmp/gzipreader_test.XXXXXX";
+    if(mkdtemp(dirTemplate) == NULL) {
+        cerr << "can't create a directory in /tmp" << endl;
+        return 1;
+    }
+    string dir = dirTemplate;
+    string data = fastq(12 << 20);
+
+    checkFile("BGZF", dir, bgzf(data), data);
+    checkFile("multi-member", dir, gzipMembers(data, 300000, 6), data);
+    checkFile("single member", dir, gzipMember(data, 6), data);
+
+    // stored (level 0) members keep the input bytes, so gzip headers in the
+    // reads show up in the compressed data where the jobs are cut
+    string fake = data;
+    const char header[] = "\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\x03";
+    for(size_t pos=1000; pos + sizeof(header) < fake.size(); pos+=100000)
+        fake.replace(pos, sizeof(header) - 1, header, sizeof(header) - 1);
+    checkFile("gzip headers inside stored members", dir, gzipMembers(fake, 3 << 20, 0), fake);
+
+    rmdir(dir.c_str());
+
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,192 @@
+//
+//  inputshards_test.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+//  Checks that FASTQ files cut at every byte offset, on their own and
+//  aligned to another file, give each record exactly once, exits non-zero
+//  if any fails.
+//
+//  usage: inputshards_test
+//
+
+#include "inputshards.h"
+#include "namecodec.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <iostream>
+#include <fstream>
+
+using namespace std;
+
+static int failures = 0;
+
+static void expect(const string& name, bool ok, const string& detail){
+    cout << (ok ? "ok   " : "FAIL ") << name << (ok ? "" : ": " + detail) << endl;
+    if(!ok)
+        failures++;
+}
+
+// Records with sequences of several lengths, whose quality lines start with
+// '@' or '+' every other record, so they look like the start of a record or
+// like a separator line; with repeat, the separator lines repeat the name, so
+// a quality line starting with '@' is followed by lines of record lengths
+static string fixture(const string& tag, int records, int seqLen, const string& eol, bool repeat = false){
+    string out;
+    for(int i=0; i<records; i++) {
+        int len = seqLen + i % 3;
+        string seq = string("ACGTN").substr(i % 5, 1) + string(len - 1, "ACGT"[i % 4]);
+        string qual = string(1, i % 2 == 0 ? '@' : '+') + string(len - 1, 'I');
+        string name = "r" + to_string(i) + " " + tag;
+        out += "@" + name + eol + seq + eol + "+" + (repeat ? name : "") + eol + qual + eol;
+    }
+    return out;
+}
+
+static string writeFile(const string& dir, const string& name, const string& content){
+    string path = dir + "/" + name;
+    ofstream file(path.c_str(), ofstream::binary);
+    file << content;
+    return path;
+}
+
+// Names of the records of a file cut at offsets, shard after shard, without
+// the comment that tells index and reads records apart
+static vector<string> shardNames(const string& path, const vector<size_t>& offsets){
+    vector<string> names;
+    vector<FastqReader*> shards = openShards(path, offsets);
+    for(int i=0; i<shards.size(); i++) {
+        FastqRecord rec;
+        while(shards[i]->next(rec))
+            names.push_back(string(rec.name, nameKeyLength(rec.name, rec.nameLen)));
+        delete shards[i];
+    }
+    return names;
+}
+
+static vector<string> fileNames(const string& path){
+    vector<size_t> whole;
+    whole.push_back(0);
+    whole.push_back(string::npos);
+    return shardNames(path, whole);
+}
+
+static size_t fileSize(const string& path){
+    FastqReader reader(path);
+    size_t bytesRead, bytesTotal;
+    reader.getBytes(bytesRead, bytesTotal);
+    return bytesTotal;
+}
+
+// First record starting at or after offset, as shardOffsets() cuts
+static size_t recordStart(const string& path, size_t offset, size_t size){
+    FastqReader reader(path);
+    FastqRecord rec;
+    reader.setRange(offset, size);
+    return reader.next(rec) ? reader.recordOffset() : size;
+}
+
+// Two shards cut at every offset, and a third one of at most a few bytes
+// right after it, smaller than any record
+static void checkEveryCut(const string& name, const string& path){
+    vector<string> expected = fileNames(path);
+    size_t size = fileSize(path);
+    string bad;
+    for(size_t cut=0; cut<=size && bad.empty(); cut++) {
+        for(size_t tiny=0; tiny<=3 && bad.empty(); tiny++) {
+            vector<size_t> offsets;
+            offsets.push_back(0);
+            offsets.push_back(cut);
+            if(tiny > 0)
+                offsets.push_back(min(size, cut + tiny));
+            offsets.push_back(size);
+            if(shardNames(path, offsets) != expected)
+                bad = "cut at " + to_string(cut) + (tiny > 0 ? " with a " + to_string(tiny) + " byte shard" : "");
+        }
+    }
+    expect(name + ", " + to_string(expected.size()) + " records", bad.empty(), bad);
+}
+
+// The reads file aligned to the index file cut at every offset: each pair of
+// shards holds the same records, and each record is in one pair
+static void checkAlignedCuts(const string& name, const string& indexPath, const string& readsPath){
+    vector<string> expected = fileNames(readsPath);
+    size_t size = fileSize(indexPath);
+    string bad;
+    for(size_t cut=0; cut<=size && bad.empty(); cut++) {
+        vector<size_t> indexOffsets;
+        indexOffsets.push_back(0);
+        indexOffsets.push_back(recordStart(indexPath, cut, size));
+        indexOffsets.push_back(size);
+        vector<size_t> readsOffsets = alignShards(indexPath, indexOffsets, readsPath);
+        if(shardNames(readsPath, readsOffsets) != expected || shardNames(indexPath, indexOffsets) != expected)
+            bad = "cut at " + to_string(cut);
+        for(int s=0; s+1<indexOffsets.size() && bad.empty(); s++) {
+            vector<size_t> index(indexOffsets.begin() + s, indexOffsets.begin() + s + 2);
+            vector<size_t> reads(readsOffsets.begin() + s, readsOffsets.begin() + s + 2);
+            if(shardNames(indexPath, index) != shardNames(readsPath, reads))
+                bad = "shard " + to_string(s + 1) + " of the cut at " + to_string(cut);
+        }
+    }
+    expect(name, bad.empty(), bad);
+}
+
+// Every --shard i/N of the inputs in stream mode, up to more shards than
+// records, covers the records once
+static void checkSlices(const string& name, const string& indexPath, const string& readsPath, int records){
+    vector<string> expected = fileNames(readsPath);
+    string bad;
+    for(int shards=1; shards<=records + 2 && bad.empty(); shards++) {
+        vector<string> index, reads;
+        for(int shard=1; shard<=shards; shard++) {
+            InputSlice slice = sliceInputs(indexPath, "", readsPath, "", true, shard, shards, 1);
+            vector<size_t> indexRange, readsRange;
+            indexRange.push_back(slice.indexBegin);
+            indexRange.push_back(slice.indexEnd);
+            readsRange.push_back(slice.readsBegin);
+            readsRange.push_back(slice.readsEnd);
+            vector<string> indexNames = shardNames(indexPath, indexRange);
+            vector<string> readsNames = shardNames(readsPath, readsRange);
+            if(indexNames != readsNames)
+                bad = "shard " + to_string(shard) + " of " + to_string(shards);
+            index.insert(index.end(), indexNames.begin(), indexNames.end());
+            reads.insert(reads.end(), readsNames.begin(), readsNames.end());
+        }
+        if(bad.empty() && (index != expected || reads != expected))
+            bad = to_string(shards) + " shards";
+    }
+    expect(name, bad.empty(), bad);
+}
+
+int main(int argc, char* argv[]){
+    char dirTemplate[] = "/tmp/inputshards_test.XXXXXX";
+    if(mkdtemp(dirTemplate) == NULL) {
+        cerr << "can't create a directory in /tmp" << endl;
+        return 1;
+    }
+    string dir = dirTemplate;
+    const int records = 9;
+
+    string lf = writeFile(dir, "lf.fastq", fixture("1:N:0:ACGT", records, 6, "\n"));
+    string repeat = writeFile(dir, "repeat.fastq", fixture("1:N:0:ACGT", records, 6, "\n", true));
+    string crlf = writeFile(dir, "crlf.fastq", fixture("1:N:0:ACGT", records, 6, "\r\n"));
+    string index = writeFile(dir, "index.fastq", fixture("2:N:0:ACGT", records, 8, "\n"));
+    string reads = writeFile(dir, "reads.fastq", fixture("1:N:0:ACGT", records, 23, "\n"));
+    string indexCrlf = writeFile(dir, "index_crlf.fastq", fixture("2:N:0:ACGT", records, 8, "\r\n"));
+
+    checkEveryCut("quality lines starting with @ and +, cut at every byte", lf);
+    checkEveryCut("separator lines repeating the name, cut at every byte", repeat);
+    checkEveryCut("CRLF line breaks, cut at every byte", crlf);
+    checkAlignedCuts("reads aligned to the index cut at every byte", index, reads);
+    checkAlignedCuts("LF reads aligned to CRLF index cut at every byte", indexCrlf, reads);
+    checkSlices("--shard i/N of index and reads, up to more shards than records", index, reads, records);
+
+    const char* files[] = {"lf.fastq", "repeat.fastq", "crlf.fastq", "index.fastq", "reads.fastq", "index_crlf.fastq"};
+    for(int i=0; i<6; i++)
+        unlink((dir + "/" + files[i]).c_str());
+    rmdir(dir.c_str());
+
+    return failures > 0 ? 1 : 0;
+}
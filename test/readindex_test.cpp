@@ -0,0 +1,125 @@
+//
+//  readindex_test.cpp
+//  demultiplex_satay
+//
+//  Copyright © 2022 Jordan Berg. All rights reserved.
+//
+//  Checks of ReadIndex inserts, collided keys resolved by name, duplicate
+//  names and the --max-memory budget while the table grows, exits non-zero
+//  if any fails.
+//
+//  usage: readindex_test
+//
+
+#include "readindex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+static int failures = 0;
+
+static void expect(const string& name, int got, int expected){
+    bool ok = got == expected;
+    cout << (ok ? "ok   " : "FAIL ") << name << ": " << got << ", expected " << expected << endl;
+    if(!ok)
+        failures++;
+}
+
+// Names inserted as main does it: every name, then the names of collided
+// keys resolved again in input order
+static void insertAll(ReadIndex& index, const vector<uint64_t>& keys, const vector<string>& names, const vector<int>& ids){
+    for(int i=0; i<keys.size(); i++)
+        index.insert(keys[i], ids[i]);
+    for(int i=0; i<keys.size(); i++) {
+        if(index.isCollided(keys[i]))
+            index.resolve(names[i], ids[i]);
+    }
+}
+
+static int find(const ReadIndex& index, uint64_t key, const string& name){
+    return index.find(key, name.data(), name.length());
+}
+
+// Exit status of a child inserting names into a table within maxBytes
+static int growsWithin(size_t maxBytes, size_t names){
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        ReadIndex index(0, maxBytes);
+        for(size_t i=1; i<=names; i++)
+            index.insert(i * 0x9e3779b97f4a7c15ULL, 1);
+        exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main(int argc, char* argv[]){
+    // two names forced onto one key, as a hashed key collision would be
+    vector<uint64_t> keys;
+    vector<string> names;
+    vector<int> ids;
+    keys.push_back(42);
+    names.push_back("@A:1");
+    ids.push_back(1);
+    keys.push_back(42);
+    names.push_back("@B:2");
+    ids.push_back(2);
+    keys.push_back(7);
+    names.push_back("@C:3");
+    ids.push_back(3);
+    ReadIndex collided;
+    insertAll(collided, keys, names, ids);
+    expect("collisions", collided.collisions(), 1);
+    expect("first name of a shared key", find(collided, 42, "@A:1"), 1);
+    expect("second name of a shared key", find(collided, 42, "@B:2"), 2);
+    expect("other name of a shared key", find(collided, 42, "@D:4"), -1);
+    expect("key of its own", find(collided, 7, "@C:3"), 3);
+    expect("missing key", find(collided, 8, "@E:5"), -1);
+
+    // a duplicate name keeps the sample of its last record
+    keys.clear();
+    names.clear();
+    ids.clear();
+    for(int i=0; i<3; i++) {
+        keys.push_back(99);
+        names.push_back("@dup");
+        ids.push_back(4 + i);
+    }
+    ReadIndex duplicates;
+    insertAll(duplicates, keys, names, ids);
+    expect("duplicate name, last one wins", find(duplicates, 99, "@dup"), 6);
+
+    // marked up front, as for a key already seen by a saved assignment
+    ReadIndex marked;
+    marked.markCollided(5);
+    marked.resolve("@F:6", 8);
+    expect("marked key resolved by name", find(marked, 5, "@F:6"), 8);
+
+    // grown well past its first capacity, every key is still found
+    ReadIndex grown;
+    int missing = 0;
+    for(uint64_t k=1; k<=100000; k++)
+        grown.insert(k, k % 100);
+    for(uint64_t k=1; k<=100000; k++) {
+        if(grown.find(k, "", 0) != (int)(k % 100))
+            missing++;
+    }
+    expect("keys lost while growing", missing, 0);
+
+    // sized once from the expected count, not grown to it
+    ReadIndex sized(50000);
+    expect("table sized from the expected names", sized.bytes() == ReadIndex::bytesFor(50000), 1);
+
+    // growing 1024 slots to 1536 needs both tables at once: 25600 bytes
+    expect("growth within --max-memory", growsWithin(25600, 1000), 0);
+    expect("growth over --max-memory counting the old table", growsWithin(20000, 1000) != 0, 1);
+
+    return failures > 0 ? 1 : 0;
+}